@@ -0,0 +1,84 @@
+#ifndef _NIHTERM_BENCH_COMMON_H
+#define _NIHTERM_BENCH_COMMON_H
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <string>
+
+#include <benchmark/benchmark.h>
+
+#include <nihterm/vt.h>
+
+struct teststate {
+  teststate(int rows = 25, int cols = 80) {
+    pty_parent = posix_openpt(O_RDWR | O_NOCTTY);
+    if (pty_parent < 0) {
+      std::cerr << "posix_openpt: " << strerror(errno) << std::endl;
+      abort();
+    }
+
+    int rc = grantpt(pty_parent);
+    if (rc < 0) {
+      std::cerr << "grantpt: " << strerror(errno) << std::endl;
+      abort();
+    }
+    rc = unlockpt(pty_parent);
+    if (rc < 0) {
+      std::cerr << "unlockpt: " << strerror(errno) << std::endl;
+      abort();
+    }
+
+    const char *name = ptsname(pty_parent);
+    pty_child = open(name, O_RDWR);
+    if (pty_child < 0) {
+      std::cerr << "open pty child: " << strerror(errno) << std::endl;
+      abort();
+    }
+
+    // set line discipline so we don't need newlines
+    struct termios t;
+    tcgetattr(pty_child, &t);
+    cfmakeraw(&t);
+    tcsetattr(pty_child, TCSANOW, &t);
+
+    vt = vt_create(pty_parent, rows, cols);
+  }
+
+  ~teststate() {
+    vt_destroy(vt);
+    close(pty_child);
+    close(pty_parent);
+  }
+
+  struct vt *vt;
+  int pty_parent;
+  int pty_child;
+};
+
+// Write rows lines of letters, each width long and in its own color.
+inline void fill_lines(struct vt *vt, int rows, int width) {
+  std::string text;
+  for (int y = 0; y < rows; ++y) {
+    text += "\033[" + std::to_string(31 + y % 7) + "m";
+    for (int x = 0; x < width; ++x) {
+      text += static_cast<char>('a' + (y + x) % 26);
+    }
+    text += "\r\n";
+  }
+  vt_process(vt, text.data(), text.size());
+}
+
+// Terminal geometries benchmarks are run at, as {cols, rows}.
+inline void Geometries(benchmark::internal::Benchmark *b) {
+  b->ArgNames({"cols", "rows"});
+  b->Args({80, 24});
+  b->Args({132, 50});
+  b->Args({250, 80});
+}
+
+#endif // _NIHTERM_BENCH_COMMON_H
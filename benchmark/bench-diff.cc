@@ -0,0 +1,69 @@
+// Cost of diffing screens for a remote viewer: a screen full of colored text
+// is drawn from nothing, and diffed against itself after a line of output has
+// scrolled it up. The size of the stream is reported as bytes per diff.
+
+#include <string>
+
+#include <benchmark/benchmark.h>
+
+#include <nihterm/diff.h>
+#include <nihterm/vt.h>
+
+#include "bench-common.h"
+#include "perf-counters.h"
+
+static void BM_DiffFull(benchmark::State &state) {
+  int cols = static_cast<int>(state.range(0));
+  int rows = static_cast<int>(state.range(1));
+
+  struct teststate vtstate(rows, cols);
+  fill_lines(vtstate.vt, rows, cols - 1);
+
+  struct snapshot *snap = vt_snapshot(vtstate.vt);
+  std::string out(snapshot_diff(nullptr, snap, nullptr, 0), '\0');
+
+  PerfCounters perf;
+  perf.Start();
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(snapshot_diff(nullptr, snap, &out[0], out.size()));
+  }
+  perf.Stop();
+
+  vt_snapshot_release(snap);
+
+  state.counters["diff_bytes"] = static_cast<double>(out.size());
+  perf.Report(state, 1, "diff");
+}
+
+static void BM_DiffScroll(benchmark::State &state) {
+  int cols = static_cast<int>(state.range(0));
+  int rows = static_cast<int>(state.range(1));
+
+  struct teststate vtstate(rows, cols);
+  fill_lines(vtstate.vt, rows, cols - 1);
+
+  struct snapshot *before = vt_snapshot(vtstate.vt);
+  std::string line = "\033[m$ make\r\n";
+  vt_process(vtstate.vt, line.data(), line.size());
+  struct snapshot *after = vt_snapshot(vtstate.vt);
+
+  std::string out(snapshot_diff(before, after, nullptr, 0), '\0');
+
+  PerfCounters perf;
+  perf.Start();
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(snapshot_diff(before, after, &out[0], out.size()));
+  }
+  perf.Stop();
+
+  vt_snapshot_release(before);
+  vt_snapshot_release(after);
+
+  state.counters["diff_bytes"] = static_cast<double>(out.size());
+  perf.Report(state, 1, "diff");
+}
+
+BENCHMARK(BM_DiffFull)->Apply(Geometries);
+BENCHMARK(BM_DiffScroll)->Apply(Geometries);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,187 @@
+// Render path benchmarks. Everything draws into an offscreen surface so these
+// run without a display.
+
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include <nihterm/gfx.h>
+#include <nihterm/vt.h>
+
+#include "bench-common.h"
+#include "perf-counters.h"
+
+enum attrs {
+  ATTRS_PLAIN,
+  ATTRS_BOLD,
+  ATTRS_MIXED,
+  ATTRS_COLOR,
+};
+
+// attribute table for the cells below: 0-7 are combinations of bold,
+// underline and reverse, 8-23 the 16 ANSI foreground colors
+static std::vector<struct cellattr> make_attrs() {
+  std::vector<struct cellattr> attrs;
+  for (uint32_t i = 0; i < 8; ++i) {
+    uint32_t flags = ((i & 1) ? ATTR_BOLD : 0) |
+                     ((i & 2) ? ATTR_UNDERLINE : 0) |
+                     ((i & 4) ? ATTR_REVERSE : 0);
+    attrs.push_back({COLOR_DEFAULT, COLOR_DEFAULT, flags});
+  }
+  for (uint32_t i = 0; i < 16; ++i) {
+    attrs.push_back({color_indexed(i), COLOR_DEFAULT, 0});
+  }
+  return attrs;
+}
+
+static std::vector<struct cell> make_cells(int count, int attrs) {
+  std::vector<struct cell> cells(static_cast<size_t>(count));
+  for (int i = 0; i < count; ++i) {
+    struct cell &cell = cells[static_cast<size_t>(i)];
+    memset(&cell, 0, sizeof(cell));
+    cell.cp = static_cast<uint32_t>('!' + (i % 94));
+
+    if (attrs == ATTRS_BOLD) {
+      cell.attr = 1;
+    } else if (attrs == ATTRS_MIXED) {
+      cell.attr = static_cast<uint16_t>((i / 4) % 8);
+    } else if (attrs == ATTRS_COLOR) {
+      // runs of a few cells per color, like ls --color
+      cell.attr = static_cast<uint16_t>(8 + (i / 6) % 16);
+    }
+  }
+  return cells;
+}
+
+// args: run length, attrs
+static void BM_CharsAt(benchmark::State &state) {
+  int count = static_cast<int>(state.range(0));
+  struct graphics *graphics = create_graphics_offscreen(132, 25);
+  std::vector<struct cell> cells = make_cells(count, static_cast<int>(state.range(1)));
+  std::vector<struct cellattr> attrs = make_attrs();
+
+  PerfCounters perf;
+  perf.Start();
+  for (auto _ : state) {
+    chars_at(graphics, 0, 0, cells.data(), attrs.data(), count, 0, 0);
+  }
+  perf.Stop();
+
+  perf.Report(state, count, "cell");
+
+  state.SetItemsProcessed(state.iterations() * count);
+  destroy_graphics(graphics);
+}
+
+// args: run length, 0 = double width, 1/2 = double height top/bottom
+static void BM_CharsAtDouble(benchmark::State &state) {
+  int count = static_cast<int>(state.range(0));
+  int dblheight = static_cast<int>(state.range(1));
+  struct graphics *graphics = create_graphics_offscreen(132, 25);
+  std::vector<struct cell> cells = make_cells(count, ATTRS_PLAIN);
+  std::vector<struct cellattr> attrs = make_attrs();
+
+  PerfCounters perf;
+  perf.Start();
+  for (auto _ : state) {
+    chars_at(graphics, 0, 0, cells.data(), attrs.data(), count, dblheight ? 0 : 1,
+             dblheight);
+  }
+  perf.Stop();
+
+  perf.Report(state, count, "cell");
+
+  state.SetItemsProcessed(state.iterations() * count);
+  destroy_graphics(graphics);
+}
+
+static void BM_GraphicsClear(benchmark::State &state) {
+  int cols = static_cast<int>(state.range(0));
+  int rows = static_cast<int>(state.range(1));
+  struct graphics *graphics = create_graphics_offscreen(cols, rows);
+
+  PerfCounters perf;
+  perf.Start();
+  for (auto _ : state) {
+    graphics_clear(graphics, 0, 0, cols, rows);
+  }
+  perf.Stop();
+
+  perf.Report(state, cols * rows, "cell");
+
+  state.SetItemsProcessed(state.iterations() * cols * rows);
+  destroy_graphics(graphics);
+}
+
+// fills the screen with printable text so renders have glyphs to draw
+static void fill_screen(struct vt *vt, int cols, int rows) {
+  std::string text;
+  for (int y = 0; y < rows; ++y) {
+    for (int x = 0; x < cols; ++x) {
+      text += static_cast<char>('!' + ((x + y) % 94));
+    }
+  }
+  vt_process(vt, "\033[H", 3);
+  vt_process(vt, text.data(), text.size());
+}
+
+static void BM_RenderAfterErase(benchmark::State &state) {
+  int cols = static_cast<int>(state.range(0));
+  int rows = static_cast<int>(state.range(1));
+  struct teststate vtstate(rows, cols);
+  struct graphics *graphics = create_graphics_offscreen(cols, rows);
+  vt_set_graphics(vtstate.vt, graphics);
+
+  PerfCounters perf;
+  perf.Start();
+  for (auto _ : state) {
+    vt_process(vtstate.vt, "\033[2J", 4);
+    vt_render(vtstate.vt);
+  }
+  perf.Stop();
+
+  perf.Report(state, cols * rows, "cell");
+
+  state.SetItemsProcessed(state.iterations() * cols * rows);
+  destroy_graphics(graphics);
+}
+
+static void BM_RenderAfterScroll(benchmark::State &state) {
+  int cols = static_cast<int>(state.range(0));
+  int rows = static_cast<int>(state.range(1));
+  struct teststate vtstate(rows, cols);
+  struct graphics *graphics = create_graphics_offscreen(cols, rows);
+  vt_set_graphics(vtstate.vt, graphics);
+
+  fill_screen(vtstate.vt, cols, rows);
+  vt_render(vtstate.vt);
+
+  PerfCounters perf;
+  perf.Start();
+  for (auto _ : state) {
+    // a line feed at the bottom row scrolls the whole screen
+    vt_process(vtstate.vt, "\n", 1);
+    vt_render(vtstate.vt);
+  }
+  perf.Stop();
+
+  perf.Report(state, cols * rows, "cell");
+
+  state.SetItemsProcessed(state.iterations() * cols * rows);
+  destroy_graphics(graphics);
+}
+
+BENCHMARK(BM_CharsAt)
+    ->ArgNames({"run", "attrs"})
+    ->ArgsProduct({{1, 8, 32, 80, 132}, {ATTRS_PLAIN, ATTRS_BOLD, ATTRS_MIXED, ATTRS_COLOR}});
+BENCHMARK(BM_CharsAtDouble)
+    ->ArgNames({"run", "dblheight"})
+    ->ArgsProduct({{1, 8, 40, 66}, {0, 1, 2}});
+BENCHMARK(BM_GraphicsClear)->Apply(Geometries);
+BENCHMARK(BM_RenderAfterErase)->Apply(Geometries);
+BENCHMARK(BM_RenderAfterScroll)->Apply(Geometries);
+
+BENCHMARK_MAIN();
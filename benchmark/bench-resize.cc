@@ -0,0 +1,44 @@
+// Cost of one step of a drag resize: a full screen of wrapped text is
+// rewrapped one column narrower or wider at a time.
+
+#include <benchmark/benchmark.h>
+
+#include <nihterm/vt.h>
+
+#include "bench-common.h"
+#include "perf-counters.h"
+
+// how far the drag goes before turning back
+static const int kDragColumns = 40;
+
+static void BM_DragResize(benchmark::State &state) {
+  int cols = static_cast<int>(state.range(0));
+  int rows = static_cast<int>(state.range(1));
+
+  struct teststate vtstate(rows, cols);
+
+  // paragraphs long enough to wrap two or three times
+  vt_process(vtstate.vt, "\033[?7h", 5);
+  fill_lines(vtstate.vt, rows, cols * 5 / 2);
+
+  int step = 0;
+  PerfCounters perf;
+  perf.Start();
+  for (auto _ : state) {
+    // back and forth over kDragColumns columns
+    int offset = step % (2 * kDragColumns);
+    if (offset >= kDragColumns) {
+      offset = 2 * kDragColumns - offset;
+    }
+    vt_resize(vtstate.vt, rows, cols - offset);
+    vt_render(vtstate.vt);
+    ++step;
+  }
+  perf.Stop();
+
+  perf.Report(state, 1, "resize");
+}
+
+BENCHMARK(BM_DragResize)->Apply(Geometries);
+
+BENCHMARK_MAIN();
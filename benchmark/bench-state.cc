@@ -0,0 +1,58 @@
+// Cost of saving and restoring a session: a screen full of colored text is
+// written to a blob with vt_save and read back with vt_load.
+
+#include <string>
+
+#include <benchmark/benchmark.h>
+
+#include <nihterm/vt.h>
+
+#include "bench-common.h"
+#include "perf-counters.h"
+
+static void BM_Save(benchmark::State &state) {
+  int cols = static_cast<int>(state.range(0));
+  int rows = static_cast<int>(state.range(1));
+
+  struct teststate vtstate(rows, cols);
+  fill_lines(vtstate.vt, rows, cols - 1);
+
+  std::string blob(vt_save(vtstate.vt, nullptr, 0), '\0');
+
+  PerfCounters perf;
+  perf.Start();
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(vt_save(vtstate.vt, &blob[0], blob.size()));
+  }
+  perf.Stop();
+
+  state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(blob.size()));
+  perf.Report(state, 1, "save");
+}
+
+static void BM_Load(benchmark::State &state) {
+  int cols = static_cast<int>(state.range(0));
+  int rows = static_cast<int>(state.range(1));
+
+  struct teststate vtstate(rows, cols);
+  fill_lines(vtstate.vt, rows, cols - 1);
+
+  std::string blob(vt_save(vtstate.vt, nullptr, 0), '\0');
+  vt_save(vtstate.vt, &blob[0], blob.size());
+
+  PerfCounters perf;
+  perf.Start();
+  for (auto _ : state) {
+    vt_load(vtstate.vt, blob.data(), blob.size());
+    vt_render(vtstate.vt);
+  }
+  perf.Stop();
+
+  state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(blob.size()));
+  perf.Report(state, 1, "load");
+}
+
+BENCHMARK(BM_Save)->Apply(Geometries);
+BENCHMARK(BM_Load)->Apply(Geometries);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,385 @@
+// Parser throughput over generated corpora that look like real workloads.
+// Each corpus is fed to the VT in read-sized chunks with a vt_render between
+// chunks, the same way the main loop does it.
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+
+#include <benchmark/benchmark.h>
+
+#include <nihterm/vt.h>
+
+#include "bench-common.h"
+#include "perf-counters.h"
+
+// roughly what one trip around the main loop reads from the pty
+static const size_t kChunkSize = 4096;
+
+// corpora are generated to at least this size
+static const size_t kCorpusSize = 256 * 1024;
+
+// deterministic so runs are comparable
+struct lcg {
+  uint32_t state = 12345;
+
+  uint32_t next(uint32_t bound) {
+    state = state * 1103515245u + 12345u;
+    return (state >> 8) % bound;
+  }
+};
+
+static const char *const kWords[] = {
+    "request", "completed", "in",      "ms",     "worker", "cache",
+    "miss",    "compiling", "src/vt.c", "warning", "error",  "linking",
+    "GET",     "/index.html", "200",   "OK",     "retrying", "upstream",
+};
+
+static const size_t kNumWords = sizeof(kWords) / sizeof(kWords[0]);
+
+static void append_format(std::string &out, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void append_format(std::string &out, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  char buf[64];
+  int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+  out.append(buf, static_cast<size_t>(n));
+  va_end(ap);
+}
+
+// Plain ASCII log lines of varying length, some long enough to wrap.
+static std::string corpus_ascii_log(int cols, int rows) {
+  (void)rows;
+  std::string out;
+  lcg rng;
+  while (out.size() < kCorpusSize) {
+    append_format(out, "2023-06-04 12:%02d:%02d ", static_cast<int>(rng.next(60)),
+                  static_cast<int>(rng.next(60)));
+    size_t words = 4 + rng.next(static_cast<uint32_t>(cols / 4));
+    for (size_t i = 0; i < words; ++i) {
+      out += kWords[rng.next(kNumWords)];
+      out += ' ';
+    }
+    out += "\r\n";
+  }
+  return out;
+}
+
+// Colored compiler/ls style output: an SGR change every word or two.
+static std::string corpus_sgr(int cols, int rows) {
+  (void)rows;
+  std::string out;
+  lcg rng;
+  while (out.size() < kCorpusSize) {
+    size_t words = 4 + rng.next(static_cast<uint32_t>(cols / 8));
+    for (size_t i = 0; i < words; ++i) {
+      switch (rng.next(4)) {
+      case 0:
+        append_format(out, "\033[1;%dm", 31 + static_cast<int>(rng.next(7)));
+        break;
+      case 1:
+        append_format(out, "\033[%d;4m", 32 + static_cast<int>(rng.next(6)));
+        break;
+      case 2:
+        out += "\033[7m";
+        break;
+      default:
+        out += "\033[0m";
+      }
+      out += kWords[rng.next(kNumWords)];
+      out += "\033[m ";
+    }
+    out += "\r\n";
+  }
+  return out;
+}
+
+// Curses-style full screen repaint: every row is addressed with CUP and
+// rewritten, with a status line in reverse video.
+static std::string corpus_repaint(int cols, int rows) {
+  std::string out;
+  lcg rng;
+  while (out.size() < kCorpusSize) {
+    out += "\033[H";
+    for (int y = 1; y < rows; ++y) {
+      append_format(out, "\033[%d;%dH", y, 1);
+      int x = 0;
+      while (x < cols) {
+        const char *word = kWords[rng.next(kNumWords)];
+        size_t len = strlen(word);
+        if (x + static_cast<int>(len) + 1 > cols) {
+          break;
+        }
+        out += word;
+        out += ' ';
+        x += static_cast<int>(len) + 1;
+      }
+      out += "\033[K";
+    }
+    append_format(out, "\033[%d;%dH\033[7m", rows, 1);
+    out.append(static_cast<size_t>(cols - 1), '-');
+    out += "\033[m";
+  }
+  return out;
+}
+
+// Insert mode edits at random positions, like a line editor.
+static std::string corpus_irm(int cols, int rows) {
+  std::string out = "\033[4h";
+  lcg rng;
+  while (out.size() < kCorpusSize) {
+    append_format(out, "\033[%d;%dH", 1 + static_cast<int>(rng.next(static_cast<uint32_t>(rows))),
+                  1 + static_cast<int>(rng.next(static_cast<uint32_t>(cols))));
+    out += kWords[rng.next(kNumWords)];
+  }
+  out += "\033[4l";
+  return out;
+}
+
+// Scrolling inside a margin-restricted region, like a pager or tmux pane.
+static std::string corpus_scroll_region(int cols, int rows) {
+  std::string out;
+  append_format(out, "\033[%d;%dr", 2, rows - 1);
+  append_format(out, "\033[%d;%dH", rows - 1, 1);
+  lcg rng;
+  while (out.size() < kCorpusSize) {
+    size_t words = 1 + rng.next(static_cast<uint32_t>(cols / 10));
+    for (size_t i = 0; i < words; ++i) {
+      out += kWords[rng.next(kNumWords)];
+      out += ' ';
+    }
+    out += "\r\n";
+  }
+  out += "\033[r";
+  return out;
+}
+
+// Screen-wide fills and erases back to back.
+static std::string corpus_erase_storm(int cols, int rows) {
+  std::string out;
+  lcg rng;
+  while (out.size() < kCorpusSize) {
+    out += "\033#8";
+    for (int i = 0; i < 8; ++i) {
+      append_format(out, "\033[%d;%dH", 1 + static_cast<int>(rng.next(static_cast<uint32_t>(rows))),
+                    1 + static_cast<int>(rng.next(static_cast<uint32_t>(cols))));
+      append_format(out, "\033[%dK", static_cast<int>(rng.next(3)));
+    }
+    append_format(out, "\033[%dJ", static_cast<int>(rng.next(3)));
+    out += "\033[2J\033[H";
+  }
+  return out;
+}
+
+// Boxes drawn with the DEC line drawing set, like dialog or htop.
+static std::string corpus_line_drawing(int cols, int rows) {
+  std::string out = "\033)0";
+  while (out.size() < kCorpusSize) {
+    out += "\033[H\016l";
+    out.append(static_cast<size_t>(cols - 2), 'q');
+    out += "k";
+    for (int y = 2; y < rows; ++y) {
+      append_format(out, "\033[%d;1Hx\017", y);
+      out.append(static_cast<size_t>(cols - 2), ' ');
+      out += "\016x";
+    }
+    append_format(out, "\033[%d;1Hm", rows);
+    out.append(static_cast<size_t>(cols - 2), 'q');
+    out += "j\017";
+  }
+  return out;
+}
+
+// A pager or editor started and quit over and over, each time switching to
+// the alternate screen, drawing a few lines and switching back.
+static std::string corpus_alt_screen(int cols, int rows) {
+  (void)cols;
+  std::string out;
+  lcg rng;
+  while (out.size() < kCorpusSize) {
+    out += "\033[?1049h\033[H";
+    for (int y = 1; y <= 4 && y < rows; ++y) {
+      append_format(out, "\033[%d;1H%s %s", y, kWords[rng.next(kNumWords)],
+                    kWords[rng.next(kNumWords)]);
+    }
+    out += "\033[?1049l$ ";
+  }
+  return out;
+}
+
+// Tab separated columns, like a TSV dump or column -t.
+static std::string corpus_tsv(int cols, int rows) {
+  (void)rows;
+  std::string out;
+  lcg rng;
+  while (out.size() < kCorpusSize) {
+    int fields = 1 + cols / 8;
+    for (int i = 0; i < fields; ++i) {
+      if (rng.next(3)) {
+        append_format(out, "%d", static_cast<int>(rng.next(100000)));
+      }
+      out += '\t';
+    }
+    out += "\r\n";
+  }
+  return out;
+}
+
+// A large OSC 52 copy, as from a remote editor yanking a big buffer.
+static std::string corpus_osc52(int cols, int rows) {
+  static const char kBase64[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  (void)cols;
+  (void)rows;
+
+  std::string out = "\033]52;c;";
+  lcg rng;
+  while (out.size() < kCorpusSize) {
+    out += kBase64[rng.next(64)];
+  }
+  out.append((4 - (out.size() - 7) % 4) % 4, 'A');
+  out += "\033\\";
+  return out;
+}
+
+// Sixel plots, mixing runs of one color with per-column detail.
+static std::string corpus_sixel(int cols, int rows) {
+  (void)rows;
+  std::string out;
+  lcg rng;
+  int width = cols * 8;
+  while (out.size() < kCorpusSize) {
+    out += "\033P0;1;0q\"1;1;";
+    append_format(out, "%d;%d", width, 120);
+    for (int c = 0; c < 4; ++c) {
+      append_format(out, "#%d;2;%d;%d;%d", c, 25 * c, 100 - 25 * c, 50);
+    }
+    for (int band = 0; band < 20; ++band) {
+      for (int c = 0; c < 4; ++c) {
+        append_format(out, "#%d", c);
+        for (int x = 0; x < width;) {
+          int run = 1 + static_cast<int>(rng.next(16));
+          if (run > 4) {
+            append_format(out, "!%d%c", run, '?' + static_cast<int>(rng.next(64)));
+          } else {
+            for (int i = 0; i < run; ++i) {
+              out += static_cast<char>('?' + rng.next(64));
+            }
+          }
+          x += run;
+        }
+        out += c == 3 ? '-' : '$';
+      }
+    }
+    out += "\033\\";
+  }
+  return out;
+}
+
+// With snapshot set, a snapshot is taken after every chunk and dropped after
+// the next one, as a render thread would.
+static void run_corpus(benchmark::State &state,
+                       std::string (*generate)(int cols, int rows),
+                       bool snapshot = false) {
+  int cols = static_cast<int>(state.range(0));
+  int rows = static_cast<int>(state.range(1));
+
+  std::string corpus = generate(cols, rows);
+  struct teststate vtstate(rows, cols);
+
+  struct snapshot *snap = nullptr;
+
+  PerfCounters perf;
+  perf.Start();
+  for (auto _ : state) {
+    for (size_t off = 0; off < corpus.size(); off += kChunkSize) {
+      size_t len = corpus.size() - off;
+      if (len > kChunkSize) {
+        len = kChunkSize;
+      }
+      vt_process(vtstate.vt, corpus.data() + off, len);
+      vt_render(vtstate.vt);
+
+      if (snapshot) {
+        if (snap) {
+          vt_snapshot_release(snap);
+        }
+        snap = vt_snapshot(vtstate.vt);
+      }
+    }
+  }
+  perf.Stop();
+
+  if (snap) {
+    vt_snapshot_release(snap);
+  }
+
+  perf.Report(state, static_cast<int64_t>(corpus.size()));
+  state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(corpus.size()));
+}
+
+static void BM_ASCIILog(benchmark::State &state) {
+  run_corpus(state, corpus_ascii_log);
+}
+
+static void BM_ASCIILogSnapshots(benchmark::State &state) {
+  run_corpus(state, corpus_ascii_log, true);
+}
+
+static void BM_SGRColored(benchmark::State &state) {
+  run_corpus(state, corpus_sgr);
+}
+
+static void BM_CursesRepaint(benchmark::State &state) {
+  run_corpus(state, corpus_repaint);
+}
+
+static void BM_InsertMode(benchmark::State &state) {
+  run_corpus(state, corpus_irm);
+}
+
+static void BM_ScrollRegion(benchmark::State &state) {
+  run_corpus(state, corpus_scroll_region);
+}
+
+static void BM_EraseStorm(benchmark::State &state) {
+  run_corpus(state, corpus_erase_storm);
+}
+
+static void BM_LineDrawing(benchmark::State &state) {
+  run_corpus(state, corpus_line_drawing);
+}
+
+static void BM_AltScreen(benchmark::State &state) {
+  run_corpus(state, corpus_alt_screen);
+}
+
+static void BM_TabSeparated(benchmark::State &state) {
+  run_corpus(state, corpus_tsv);
+}
+
+static void BM_OSC52Copy(benchmark::State &state) {
+  run_corpus(state, corpus_osc52);
+}
+
+static void BM_Sixel(benchmark::State &state) {
+  run_corpus(state, corpus_sixel);
+}
+
+BENCHMARK(BM_ASCIILog)->Apply(Geometries);
+BENCHMARK(BM_ASCIILogSnapshots)->Apply(Geometries);
+BENCHMARK(BM_SGRColored)->Apply(Geometries);
+BENCHMARK(BM_CursesRepaint)->Apply(Geometries);
+BENCHMARK(BM_InsertMode)->Apply(Geometries);
+BENCHMARK(BM_ScrollRegion)->Apply(Geometries);
+BENCHMARK(BM_EraseStorm)->Apply(Geometries);
+BENCHMARK(BM_LineDrawing)->Apply(Geometries);
+BENCHMARK(BM_AltScreen)->Apply(Geometries);
+BENCHMARK(BM_TabSeparated)->Apply(Geometries);
+BENCHMARK(BM_OSC52Copy)->Apply(Geometries);
+BENCHMARK(BM_Sixel)->Apply(Geometries);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,176 @@
+#ifndef _NIHTERM_PERF_COUNTERS_H
+#define _NIHTERM_PERF_COUNTERS_H
+
+// Optional hardware performance counters for benchmarks. Set
+// NIH_PERF_COUNTERS=1 in the environment to report cycles, instructions,
+// cache misses and branch misses per iteration next to the usual results.
+// If perf events can't be opened (no kernel support, containers, paranoid
+// settings) the counters are skipped with a single warning.
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <iostream>
+#include <string>
+
+#include <benchmark/benchmark.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+class PerfCounters {
+ public:
+  PerfCounters() {
+#ifdef __linux__
+    const char *env = getenv("NIH_PERF_COUNTERS");
+    if (!env || !*env || !strcmp(env, "0")) {
+      return;
+    }
+
+    for (size_t i = 0; i < kNumEvents; ++i) {
+      struct perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = kEvents[i].config;
+      attr.disabled = i == 0;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+      int fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1,
+                                        i == 0 ? -1 : fds_[0], 0));
+      if (fd < 0) {
+        if (i == 0) {
+          // no cycle counter means no perf events at all here
+          Warn(strerror(errno));
+          return;
+        }
+
+        // some PMUs (e.g. in VMs) don't expose every event, skip those
+        continue;
+      }
+
+      fds_[i] = fd;
+    }
+
+    enabled_ = true;
+#endif
+  }
+
+  ~PerfCounters() {
+#ifdef __linux__
+    for (size_t i = 0; i < kNumEvents; ++i) {
+      if (fds_[i] >= 0) {
+        close(fds_[i]);
+      }
+    }
+#endif
+  }
+
+  PerfCounters(const PerfCounters &) = delete;
+  PerfCounters &operator=(const PerfCounters &) = delete;
+
+  void Start() {
+#ifdef __linux__
+    if (enabled_) {
+      ioctl(fds_[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+      ioctl(fds_[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+#endif
+  }
+
+  void Stop() {
+#ifdef __linux__
+    if (enabled_) {
+      ioctl(fds_[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    }
+#endif
+  }
+
+  // Report counters averaged per iteration. If units_per_iteration is
+  // non-zero, also report throughput and misses relative to that unit
+  // (e.g. "bytes/cycle" and "branch-misses/byte").
+  void Report(benchmark::State &state, int64_t units_per_iteration = 0,
+              const char *unit = "byte") {
+#ifdef __linux__
+    if (!enabled_) {
+      return;
+    }
+
+    double values[kNumEvents] = {0};
+    for (size_t i = 0; i < kNumEvents; ++i) {
+      if (fds_[i] < 0) {
+        continue;
+      }
+
+      uint64_t data[3] = {0, 0, 0};
+      if (read(fds_[i], data, sizeof(data)) != static_cast<ssize_t>(sizeof(data))) {
+        continue;
+      }
+
+      // scale up if the kernel had to multiplex the counters
+      double scale = data[2] ? static_cast<double>(data[1]) / static_cast<double>(data[2]) : 1.0;
+      values[i] = static_cast<double>(data[0]) * scale;
+
+      state.counters[kEvents[i].name] =
+          benchmark::Counter(values[i], benchmark::Counter::kAvgIterations);
+    }
+
+    if (values[0] > 0 && values[1] > 0) {
+      state.counters["IPC"] = values[1] / values[0];
+    }
+
+    if (units_per_iteration && values[0] > 0) {
+      double units = static_cast<double>(units_per_iteration) *
+                     static_cast<double>(state.iterations());
+      state.counters[std::string(unit) + "s/cycle"] = units / values[0];
+      if (fds_[3] >= 0) {
+        state.counters[std::string("branch-misses/") + unit] = values[3] / units;
+      }
+      if (fds_[2] >= 0) {
+        state.counters[std::string("cache-misses/") + unit] = values[2] / units;
+      }
+    }
+#else
+    (void)state;
+    (void)units_per_iteration;
+    (void)unit;
+#endif
+  }
+
+ private:
+#ifdef __linux__
+  struct event {
+    const char *name;
+    uint64_t config;
+  };
+
+  static constexpr size_t kNumEvents = 4;
+  static constexpr event kEvents[kNumEvents] = {
+      {"cycles", PERF_COUNT_HW_CPU_CYCLES},
+      {"instructions", PERF_COUNT_HW_INSTRUCTIONS},
+      {"cache-misses", PERF_COUNT_HW_CACHE_MISSES},
+      {"branch-misses", PERF_COUNT_HW_BRANCH_MISSES},
+  };
+
+  static void Warn(const char *why) {
+    static bool warned = false;
+    if (!warned) {
+      std::cerr << "perf counters unavailable, skipping: " << why << std::endl;
+      warned = true;
+    }
+  }
+
+  int fds_[kNumEvents] = {-1, -1, -1, -1};
+#endif
+  bool enabled_ = false;
+};
+
+#endif // _NIHTERM_PERF_COUNTERS_H
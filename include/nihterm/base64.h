@@ -0,0 +1,49 @@
+#ifndef _NIHTERM_BASE64_H
+#define _NIHTERM_BASE64_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Streaming base64 decoding. Input can be split anywhere, so data can be
+// decoded as it arrives without holding the encoded text. Whitespace is
+// skipped; padding is optional.
+
+struct base64_decoder {
+  uint32_t bits;
+  int nbits;
+  int padding;
+  int error;
+};
+
+// base64_decoded_size is the most bytes decoding length characters can
+// produce, including any left over from earlier calls.
+#define base64_decoded_size(length) (((length) / 4 + 1) * 3)
+
+// base64_encoded_size is the exact encoded length of length bytes.
+#define base64_encoded_size(length) ((((length) + 2) / 3) * 4)
+
+void base64_init(struct base64_decoder *dec);
+
+// base64_decode decodes length characters into out, which must have room for
+// base64_decoded_size(length) bytes. Returns the number of bytes written.
+// Invalid input sets dec->error and stops decoding.
+size_t base64_decode(struct base64_decoder *dec, const char *in, size_t length,
+                     uint8_t *out);
+
+// base64_finish checks that the input ended on a valid boundary. Returns 0 if
+// the whole input was valid.
+int base64_finish(struct base64_decoder *dec);
+
+// base64_encode encodes length bytes into out, which must have room for
+// base64_encoded_size(length) characters. Returns the number written.
+size_t base64_encode(const uint8_t *in, size_t length, char *out);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // _NIHTERM_BASE64_H
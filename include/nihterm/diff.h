@@ -0,0 +1,34 @@
+#ifndef _NIHTERM_DIFF_H
+#define _NIHTERM_DIFF_H
+
+#include <stddef.h>
+
+#include <nihterm/vt.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Screen diffing, for showing a terminal at the far end of a slow link.
+// Rather than everything the application wrote, the far end is sent what it
+// takes to bring its screen from the last state it was sent to the current
+// one: scrolls for lines that moved, then only the cells that changed, with
+// erases and repeats for runs of the same cell.
+//
+// The stream is for a terminal like this one, showing from at to's size,
+// with ASCII in G0 and insert mode, origin mode and any scroll region off.
+// Rows' wrap flags and images are not sent.
+
+// snapshot_diff writes to buf the escape sequences that turn a screen showing
+// from into one showing to, leaving the cursor where to has it. With no from,
+// or one of another size, the screen is cleared and drawn in full. At most
+// cap bytes are written; returns the length of the whole stream, so a result
+// over cap means buf holds only the start of it.
+size_t snapshot_diff(const struct snapshot *from, const struct snapshot *to,
+                     char *buf, size_t cap);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // _NIHTERM_DIFF_H
@@ -1,6 +1,7 @@
 #ifndef _NIHTERM_GFX_H
 #define _NIHTERM_GFX_H 1
 
+#include <stddef.h>
 #include <stdint.h>
 
 // private contents, part of public API
@@ -9,20 +10,65 @@ struct graphics;
 // forward-declare VT (circular header dependency)
 struct vt;
 
+// cellattr flags
+#define ATTR_BOLD 0x1
+#define ATTR_DIM 0x2
+#define ATTR_ITALIC 0x4
+#define ATTR_UNDERLINE 0x8
+#define ATTR_BLINK 0x10
+#define ATTR_REVERSE 0x20
+#define ATTR_HIDDEN 0x40
+#define ATTR_STRIKE 0x80
+
+// Colors are tagged in the top byte. Indexed colors use the 256-color
+// palette, where 0-15 are the ANSI colors.
+#define COLOR_DEFAULT 0
+#define COLOR_INDEXED_TAG 0x01000000u
+#define COLOR_RGB_TAG 0x02000000u
+#define COLOR_TAG(c) ((c)&0xFF000000u)
+
+static inline uint32_t color_indexed(uint32_t index) {
+  return COLOR_INDEXED_TAG | index;
+}
+
+static inline uint32_t color_rgb(uint32_t r, uint32_t g, uint32_t b) {
+  return COLOR_RGB_TAG | (r << 16) | (g << 8) | b;
+}
+
+// Cells refer to attributes by their index in the terminal's attribute
+// table, where index 0 is always the default attributes.
 struct cellattr {
-  int bold;
-  int underline;
-  int blink;
-  int reverse;
+  uint32_t fg;
+  uint32_t bg;
+  uint32_t flags;
 };
 
+// Combining marks kept per cell; any more are dropped.
+#define CELL_MAX_COMBINING 2
+
+// cell flags
+#define CELL_WIDE 0x1        // cp covers this cell and the next
+#define CELL_WIDE_SPACER 0x2 // right half of the wide character to the left
+
 struct cell {
-  char cp[5];
-  int cp_len;
-  struct cellattr attr;
+  uint32_t cp;
+  // marks drawn over cp, unused slots are 0
+  uint32_t combining[CELL_MAX_COMBINING];
+  uint16_t flags;
+  // index into the attribute table
+  uint16_t attr;
 };
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 struct graphics *create_graphics();
+
+// Create graphics that render into an offscreen surface of the given size in
+// cells instead of a window. Useful for benchmarks and headless replay.
+struct graphics *create_graphics_offscreen(int cols, int rows);
+
 void destroy_graphics(struct graphics *graphics);
 
 size_t cell_width(struct graphics *graphics);
@@ -39,11 +85,13 @@ void link_vt(struct graphics *graphics, struct vt *vt);
 // character will stretch over two cells. If dblheight is non-zero, the
 // character will be double-width and double-height. Setting dblheight to 1 or
 // 2 will control which half of the double-height character is rendered (1 for
-// top, 2 for bottom).
-void char_at(struct graphics *graphics, int x, int y, struct cell *cell,
-             int dblwide, int dblheight);
+// top, 2 for bottom). Cell attributes are looked up in attrs.
+void char_at(struct graphics *graphics, int x, int y, const struct cell *cell,
+             const struct cellattr *attrs, int dblwide, int dblheight);
 
-void chars_at(struct graphics *graphics, int x, int y, struct cell *cells, int count, int dblwide, int dblheight);
+void chars_at(struct graphics *graphics, int x, int y, const struct cell *cells,
+              const struct cellattr *attrs, int count, int dblwide,
+              int dblheight);
 
 void graphics_clear(struct graphics *graphics, int x, int y, int w, int h);
 
@@ -52,4 +100,23 @@ void graphics_resize(struct graphics *graphics, int cols, int rows);
 // Invert the colors of the terminal.
 void graphics_invert(struct graphics *graphics, int invert);
 
+// Composite w x h ARGB8888 pixels (stride in pixels) with alpha at pixel
+// position x, y.
+void graphics_draw_image(struct graphics *graphics, const uint32_t *pixels,
+                         int stride, int w, int h, int x, int y);
+
+// Set the window title.
+void graphics_set_title(struct graphics *graphics, const char *title);
+
+// Replace the system clipboard with the given text.
+void graphics_set_clipboard(struct graphics *graphics, const char *text);
+
+// Returns a copy of the system clipboard text that the caller must free, or
+// NULL if it is empty or unavailable.
+char *graphics_get_clipboard(struct graphics *graphics);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
 #endif  // _NIHTERM_GFX_H
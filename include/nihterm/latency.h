@@ -0,0 +1,58 @@
+#ifndef _NIHTERM_LATENCY_H
+#define _NIHTERM_LATENCY_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Keypress-to-photon latency. One keypress at a time is followed through the
+// pipeline: the key event, the write to the PTY, the next PTY read (which
+// should carry the echo), the first damage from processing that read, and the
+// present that shows it. Keys pressed while a measurement is in flight are not
+// sampled. Each stage and the end-to-end total go into HDR-style histograms.
+
+enum latency_stage {
+  LATENCY_IDLE = 0,
+  LATENCY_WAIT_WRITE,
+  LATENCY_WAIT_READ,
+  LATENCY_WAIT_DAMAGE,
+  LATENCY_WAIT_PRESENT,
+};
+
+// current stage, so hot paths can skip the call when it isn't their turn
+extern enum latency_stage latency_stage;
+
+// A key event arrived. age_ns is how long it sat in the event queue before
+// being handled, if known.
+void latency_input(uint64_t age_ns);
+
+// The input for the key was written to the PTY.
+void latency_written(void);
+
+// Data was read from the PTY.
+void latency_read(void);
+
+// The VT damaged the screen while processing.
+void latency_damaged(void);
+
+// The window surface was presented.
+void latency_presented(void);
+
+// Write percentiles for every stage to fp.
+void latency_dump(FILE *fp);
+
+#define LATENCY_MARK(stage, fn)     \
+  do {                              \
+    if (latency_stage == (stage)) { \
+      fn();                         \
+    }                               \
+  } while (0)
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // _NIHTERM_LATENCY_H
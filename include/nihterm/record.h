@@ -0,0 +1,59 @@
+#ifndef _NIHTERM_RECORD_H
+#define _NIHTERM_RECORD_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A recording is a compact binary log of everything read from the PTY. The
+// file starts with a fixed header (magic, version, geometry) followed by one
+// record per read: a LEB128 timestamp delta in nanoseconds since the previous
+// record, a LEB128 length, then the raw bytes. Reads are never empty, so a
+// length of 0 marks a resize instead, followed by LEB128 rows and cols.
+
+// struct recorder appends PTY reads to a recording.
+struct recorder;
+
+// struct playback reads back a recording.
+struct playback;
+
+// recorder_open creates (or truncates) a recording for a terminal of the
+// given geometry.
+struct recorder *recorder_open(const char *path, int rows, int cols);
+
+// recorder_write appends one PTY read, stamped with the current monotonic time.
+// An empty read is not recorded.
+int recorder_write(struct recorder *rec, const char *data, size_t length);
+
+// recorder_resize records that the terminal is now rows x cols.
+int recorder_resize(struct recorder *rec, int rows, int cols);
+
+// recorder_close flushes and closes the recording.
+void recorder_close(struct recorder *rec);
+
+// playback_open opens a recording, returning NULL if it is missing or invalid.
+struct playback *playback_open(const char *path);
+
+// playback_geometry returns the terminal's geometry as of the last record
+// read, starting with the one the recording was made with.
+void playback_geometry(struct playback *pb, int *rows, int *cols);
+
+// playback_next reads the next PTY read, applying any resizes before it.
+// *data points into a buffer owned by the playback that is valid until the
+// next call, and *timestamp is nanoseconds since the start of the recording.
+// Returns the read's length, which is never 0, 0 at the end of the recording,
+// or -1 if the recording is truncated or corrupt.
+ssize_t playback_next(struct playback *pb, const char **data,
+                      uint64_t *timestamp);
+
+// playback_close closes the recording and frees associated memory.
+void playback_close(struct playback *pb);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // _NIHTERM_RECORD_H
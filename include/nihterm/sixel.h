@@ -0,0 +1,72 @@
+#ifndef _NIHTERM_SIXEL_H
+#define _NIHTERM_SIXEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Incremental sixel decoding. Data from a DCS ... q string is fed in as it
+// arrives and rasterized straight into the image, so the sixel string itself
+// is never stored. Images are clipped to SIXEL_MAX_WIDTH x SIXEL_MAX_HEIGHT.
+
+#define SIXEL_MAX_WIDTH 4096
+#define SIXEL_MAX_HEIGHT 4096
+
+#define SIXEL_PALETTE_SIZE 256
+
+// A decoded image as ARGB8888 pixels, row-major with a stride of width.
+// Transparent pixels are 0.
+struct sixel_image {
+  int width;
+  int height;
+  uint32_t *pixels;
+};
+
+struct sixel_decoder {
+  int state;
+  int params[5];
+  int nparams;
+
+  int repeat;
+  uint32_t color;
+  uint32_t palette[SIXEL_PALETTE_SIZE];
+  int transparent;
+
+  // position of the next sixel; y is the top of the current band
+  int x;
+  int y;
+
+  // extent drawn so far
+  int width;
+  int height;
+
+  // allocated size of pixels, which has a stride of cap_width
+  int cap_width;
+  int cap_height;
+  uint32_t *pixels;
+};
+
+// sixel_init prepares to decode a sixel string. params are the DCS parameters
+// and final byte (e.g. "0;1;0q").
+void sixel_init(struct sixel_decoder *dec, const char *params);
+
+// sixel_decode rasterizes the next chunk of sixel data.
+void sixel_decode(struct sixel_decoder *dec, const char *data, size_t length);
+
+// sixel_finish returns the decoded image, or NULL if nothing was drawn. The
+// decoder no longer owns the image; release it with sixel_image_free.
+struct sixel_image *sixel_finish(struct sixel_decoder *dec);
+
+// sixel_discard drops a partially decoded image.
+void sixel_discard(struct sixel_decoder *dec);
+
+void sixel_image_free(struct sixel_image *image);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // _NIHTERM_SIXEL_H
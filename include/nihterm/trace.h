@@ -0,0 +1,43 @@
+#ifndef _NIHTERM_TRACE_H
+#define _NIHTERM_TRACE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Phase tracing. Spans are recorded into a per-thread ring buffer (the oldest
+// spans are overwritten once it fills) and can be dumped as Chrome trace-event
+// JSON, viewable in chrome://tracing or Perfetto. Tracing is always compiled
+// in but costs a single branch per span until trace_enable is called.
+
+extern int trace_active;
+
+// trace_enable turns span recording on or off.
+void trace_enable(int enable);
+
+// trace_now returns a monotonic timestamp in nanoseconds.
+uint64_t trace_now(void);
+
+// trace_span records a span that began at start (from TRACE_BEGIN) and ends
+// now. name must be a string literal or otherwise outlive the trace.
+void trace_span(const char *name, uint64_t start);
+
+// trace_dump writes every thread's recorded spans to path as Chrome JSON.
+// Returns 0 on success.
+int trace_dump(const char *path);
+
+#define TRACE_BEGIN(var) uint64_t var = trace_active ? trace_now() : 0
+#define TRACE_END(name, var)    \
+  do {                          \
+    if (var) {                  \
+      trace_span((name), (var)); \
+    }                           \
+  } while (0)
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // _NIHTERM_TRACE_H
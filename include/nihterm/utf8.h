@@ -0,0 +1,145 @@
+#ifndef _NIHTERM_UTF8_H
+#define _NIHTERM_UTF8_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// UTF-8 helpers for the parser and renderer. Everything here is inline as it
+// sits on the per-byte path.
+
+#define UTF8_REPLACEMENT 0xFFFD
+
+// Decoder state carried between calls, so sequences may be split anywhere.
+// Zeroed means nothing is pending.
+struct utf8_decoder {
+  uint32_t cp;
+  int remaining;
+  // valid range for the next continuation byte, which rules out overlong
+  // forms, surrogates and values above U+10FFFF
+  uint8_t lower;
+  uint8_t upper;
+};
+
+enum {
+  UTF8_CONTINUE = 0, // byte consumed, no codepoint yet
+  UTF8_ACCEPT,       // byte consumed, *cp is complete
+  UTF8_REJECT,       // sequence invalid, *cp is U+FFFD and the byte must be
+                     // fed again
+};
+
+// utf8_decode feeds one non-ASCII byte (or any byte while a sequence is
+// pending) to the decoder.
+static inline int utf8_decode(struct utf8_decoder *dec, uint8_t byte,
+                              uint32_t *cp) {
+  if (dec->remaining) {
+    if (byte < dec->lower || byte > dec->upper) {
+      dec->remaining = 0;
+      *cp = UTF8_REPLACEMENT;
+      return UTF8_REJECT;
+    }
+
+    dec->cp = (dec->cp << 6) | (byte & 0x3F);
+    dec->lower = 0x80;
+    dec->upper = 0xBF;
+    if (--dec->remaining) {
+      return UTF8_CONTINUE;
+    }
+
+    *cp = dec->cp;
+    return UTF8_ACCEPT;
+  }
+
+  dec->lower = 0x80;
+  dec->upper = 0xBF;
+  if (byte < 0x80) {
+    *cp = byte;
+    return UTF8_ACCEPT;
+  } else if (byte >= 0xC2 && byte <= 0xDF) {
+    dec->cp = byte & 0x1F;
+    dec->remaining = 1;
+  } else if (byte >= 0xE0 && byte <= 0xEF) {
+    dec->cp = byte & 0x0F;
+    dec->remaining = 2;
+    if (byte == 0xE0) {
+      dec->lower = 0xA0;
+    } else if (byte == 0xED) {
+      dec->upper = 0x9F;
+    }
+  } else if (byte >= 0xF0 && byte <= 0xF4) {
+    dec->cp = byte & 0x07;
+    dec->remaining = 3;
+    if (byte == 0xF0) {
+      dec->lower = 0x90;
+    } else if (byte == 0xF4) {
+      dec->upper = 0x8F;
+    }
+  } else {
+    // stray continuation byte or a lead byte that can't start a valid
+    // sequence; consumed
+    *cp = UTF8_REPLACEMENT;
+    return UTF8_ACCEPT;
+  }
+
+  return UTF8_CONTINUE;
+}
+
+// utf8_encode writes cp to out (at least 4 bytes) and returns the length.
+static inline size_t utf8_encode(uint32_t cp, char *out) {
+  if (cp < 0x80) {
+    out[0] = (char)cp;
+    return 1;
+  } else if (cp < 0x800) {
+    out[0] = (char)(0xC0 | (cp >> 6));
+    out[1] = (char)(0x80 | (cp & 0x3F));
+    return 2;
+  } else if (cp < 0x10000) {
+    out[0] = (char)(0xE0 | (cp >> 12));
+    out[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+    out[2] = (char)(0x80 | (cp & 0x3F));
+    return 3;
+  }
+
+  out[0] = (char)(0xF0 | (cp >> 18));
+  out[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+  out[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+  out[3] = (char)(0x80 | (cp & 0x3F));
+  return 4;
+}
+
+// utf8_ascii_run returns how many bytes at the start of buf are ASCII,
+// checking a word at a time.
+static inline size_t utf8_ascii_run(const char *buf, size_t length) {
+  size_t i = 0;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  while (i + 8 <= length) {
+    uint64_t word;
+    memcpy(&word, buf + i, sizeof(word));
+
+    uint64_t high = word & 0x8080808080808080ULL;
+    if (high) {
+      // the lowest set bit is in the first non-ASCII byte
+      return i + (size_t)(__builtin_ctzll(high) >> 3);
+    }
+
+    i += 8;
+  }
+#endif
+
+  while (i < length && !(buf[i] & 0x80)) {
+    ++i;
+  }
+
+  return i;
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // _NIHTERM_UTF8_H
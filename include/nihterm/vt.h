@@ -2,6 +2,7 @@
 #define _NIHTERM_VT_H
 
 #include <stdint.h>
+#include <sys/types.h>
 
 #include <nihterm/gfx.h>
 
@@ -16,18 +17,134 @@ void vt_destroy(struct vt *vt);
 
 void vt_set_graphics(struct vt *vt, struct graphics *graphics);
 
+// Change the size of the terminal and tell the application on the pty. Lines
+// on the primary screen that were wrapped by autowrap are rewrapped at the new
+// width.
+void vt_resize(struct vt *vt, int rows, int cols);
+
+// The current size of the terminal, after any resize or DECCOLM.
+void vt_size(struct vt *vt, int *rows, int *cols);
+
 // Process a string of bytes for rendering.
 int vt_process(struct vt *vt, const char *string, size_t length);
 
 // Pass on input to the pty, potentially processing it if needed.
 ssize_t vt_input(struct vt *vt, const char *string, size_t length);
 
+// Modes that change what keys send, as returned by vt_input_modes.
+#define VT_INPUT_DECCKM 0x1  // cursor keys in application mode
+#define VT_INPUT_DECKPAM 0x2 // keypad in application mode
+#define VT_INPUT_VT52 0x4    // VT52 mode (DECANM reset)
+
+// Current keyboard modes as a mask of VT_INPUT_* flags.
+unsigned vt_input_modes(struct vt *vt);
+
+// Write queued replies (DA, CPR, etc) to the pty. Never blocks if the pty is
+// non-blocking. Returns the number of bytes still pending, or -1 on error.
+ssize_t vt_flush(struct vt *vt);
+
+// Number of bytes waiting to be written by vt_flush.
+size_t vt_pending(struct vt *vt);
+
+// Queue pasted text for the pty, wrapped in bracketed paste markers if the
+// application asked for them. The text is copied and written out in chunks
+// by vt_flush; any later vt_input cuts the paste short. Returns 0 on success.
+int vt_paste(struct vt *vt, const char *text, size_t length);
+
+// The window title last set with OSC 0 or OSC 2.
+const char *vt_title(struct vt *vt);
+
+// The clipboard last set with OSC 52, or NULL. The data is NUL-terminated
+// but may also contain NULs; length (if non-NULL) receives its size.
+const char *vt_clipboard(struct vt *vt, size_t *length);
+
+// Cap the payload of a single OSC or DCS string. Anything longer is dropped
+// without being buffered.
+void vt_set_string_limit(struct vt *vt, size_t limit);
+
+// Let OSC 52 queries read the clipboard. Off by default, as anything written
+// to the terminal (a file being shown, a remote host) could send one.
+void vt_allow_clipboard_read(struct vt *vt, int allow);
+
 void vt_render(struct vt *vt);
 
-// Fill the given buffer with the current state of the screen.
-// Useful for testing.
+// Fill the given buffer with the current state of the screen, one byte per
+// cell with anything outside ASCII as '?'. The buffer is allocated and must be
+// freed by the caller. Useful for testing; see vt_fill_into.
 void vt_fill(struct vt *vt, char **buffer);
 
+// Flags for vt_fill_into and vt_fill_region.
+#define VT_FILL_TRIM 0x1 // leave out blanks at the end of each line
+
+// Write the screen's text to buf as UTF-8, including combining marks, with
+// each row ending in '\n'. At most cap bytes are written, NUL-terminated
+// unless cap is 0, and a character is never cut in half. Returns the length of
+// the whole text without the NUL, so a result of cap or more means buf was too
+// small. Nothing is allocated.
+size_t vt_fill_into(struct vt *vt, char *buf, size_t cap, unsigned flags);
+
+// As vt_fill_into, for only the w x h cells at x, y. The region is clipped to
+// the screen.
+size_t vt_fill_region(struct vt *vt, int x, int y, int w, int h, char *buf,
+                      size_t cap, unsigned flags);
+
+// The codepoint in the cell at the given position (0 if empty or out of
+// range).
+uint32_t vt_codepoint(struct vt *vt, int x, int y);
+
+// The attributes of the cell at the given position (defaults if out of
+// range).
+struct cellattr vt_attr(struct vt *vt, int x, int y);
+
+// An immutable view of the screen taken by vt_snapshot.
+struct snapshot;
+
+// One row of a snapshot.
+struct snapshot_row {
+  // the row's cells, half as many on double width and height rows; attr
+  // indexes the snapshot's attribute table
+  const struct cell *cells;
+  int dbl_width;
+  // 0, or 1 for the top half and 2 for the bottom half of double height text
+  int dbl_height;
+  // autowrap continued the line on the next row
+  int wrapped;
+};
+
+// Take an immutable view of the screen's cells, attributes and cursor. Rows
+// are shared with the screen rather than copied, until the screen changes
+// them. Call this from the thread feeding the vt; the snapshot can be read and
+// released from any thread.
+struct snapshot *vt_snapshot(struct vt *vt);
+
+// Take another reference to a snapshot.
+struct snapshot *vt_snapshot_ref(struct snapshot *snap);
+
+// Drop a reference to a snapshot, freeing it with the last one.
+void vt_snapshot_release(struct snapshot *snap);
+
+void vt_snapshot_size(const struct snapshot *snap, int *rows, int *cols);
+void vt_snapshot_cursor(const struct snapshot *snap, int *x, int *y);
+
+// Fetch row y of the snapshot. Returns 0, or -1 if y is out of range.
+int vt_snapshot_row(const struct snapshot *snap, int y,
+                    struct snapshot_row *row);
+
+// The attribute table the snapshot's cells index into.
+const struct cellattr *vt_snapshot_attrs(const struct snapshot *snap,
+                                         size_t *count);
+
+// Write the vt's state to buf as a versioned binary blob: both screens'
+// cells, the attribute table, modes, margins, tab stops, charsets, cursors and
+// title. Nothing is written unless the whole blob fits in cap bytes. Returns
+// the blob's size.
+size_t vt_save(struct vt *vt, void *buf, size_t cap);
+
+// Replace the vt's state with a blob from vt_save, resizing to match. The blob
+// is read in place, so it can be a mapped file. Returns 0, or -1 with the vt
+// untouched if the blob is damaged or from another version.
+int vt_load(struct vt *vt, const void *blob, size_t length);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
@@ -0,0 +1,36 @@
+#ifndef _NIHTERM_WIDTH_H
+#define _NIHTERM_WIDTH_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Tables generated by src/gen-width.py. Stage 1 maps each 256-codepoint
+// block to a row of stage 2, which packs four 2-bit widths per byte.
+#define WIDTH_BLOCK_BITS 8
+#define WIDTH_MAX_CODEPOINT 0x10FFFF
+
+extern const uint8_t width_stage1[(WIDTH_MAX_CODEPOINT + 1) >> WIDTH_BLOCK_BITS];
+extern const uint8_t width_stage2[];
+
+// unicode_width returns the number of cells cp occupies: 0 for combining
+// marks, 2 for wide (CJK, emoji) characters, 1 otherwise.
+static inline int unicode_width(uint32_t cp) {
+  if (cp > WIDTH_MAX_CODEPOINT) {
+    return 1;
+  }
+
+  uint32_t block = width_stage1[cp >> WIDTH_BLOCK_BITS];
+  uint32_t offset = cp & ((1u << WIDTH_BLOCK_BITS) - 1);
+  uint8_t packed =
+      width_stage2[(block << (WIDTH_BLOCK_BITS - 2)) + (offset >> 2)];
+  return (packed >> ((offset & 3) * 2)) & 3;
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // _NIHTERM_WIDTH_H
@@ -0,0 +1,137 @@
+#include <stdint.h>
+#include <string.h>
+
+#include <nihterm/base64.h>
+
+// values above 63 in the decode table
+#define B64_INVALID 0x80
+#define B64_SKIP 0x81
+#define B64_PAD 0x82
+
+static const char encode_table[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static uint8_t decode_table[256];
+static int decode_table_ready = 0;
+
+static void build_decode_table(void) {
+  memset(decode_table, B64_INVALID, sizeof(decode_table));
+  for (uint8_t i = 0; i < 64; ++i) {
+    decode_table[(uint8_t)encode_table[i]] = i;
+  }
+
+  decode_table[' '] = B64_SKIP;
+  decode_table['\t'] = B64_SKIP;
+  decode_table['\r'] = B64_SKIP;
+  decode_table['\n'] = B64_SKIP;
+  decode_table['='] = B64_PAD;
+
+  decode_table_ready = 1;
+}
+
+void base64_init(struct base64_decoder *dec) {
+  memset(dec, 0, sizeof(*dec));
+
+  if (!decode_table_ready) {
+    build_decode_table();
+  }
+}
+
+size_t base64_decode(struct base64_decoder *dec, const char *in, size_t length,
+                     uint8_t *out) {
+  const uint8_t *src = (const uint8_t *)in;
+  size_t i = 0;
+  size_t n = 0;
+
+  if (dec->error) {
+    return 0;
+  }
+
+  while (i < length) {
+    // fast path: four valid characters on a quad boundary become three bytes
+    // with no per-character state
+    while (!dec->nbits && !dec->padding && i + 4 <= length) {
+      uint32_t a = decode_table[src[i]];
+      uint32_t b = decode_table[src[i + 1]];
+      uint32_t c = decode_table[src[i + 2]];
+      uint32_t d = decode_table[src[i + 3]];
+      if ((a | b | c | d) & 0x80) {
+        break;
+      }
+
+      uint32_t quad = (a << 18) | (b << 12) | (c << 6) | d;
+      out[n] = (uint8_t)(quad >> 16);
+      out[n + 1] = (uint8_t)(quad >> 8);
+      out[n + 2] = (uint8_t)quad;
+      n += 3;
+      i += 4;
+    }
+
+    if (i >= length) {
+      break;
+    }
+
+    uint8_t value = decode_table[src[i++]];
+    if (value == B64_SKIP) {
+      continue;
+    } else if (value == B64_PAD) {
+      // only valid after two or three characters of a quad, which leave
+      // four or two bits over
+      if (!dec->padding && dec->nbits != 4 && dec->nbits != 2) {
+        dec->error = 1;
+        return n;
+      }
+      dec->padding = 1;
+      continue;
+    } else if (value == B64_INVALID || dec->padding) {
+      dec->error = 1;
+      return n;
+    }
+
+    dec->bits = (dec->bits << 6) | value;
+    dec->nbits += 6;
+    if (dec->nbits >= 8) {
+      dec->nbits -= 8;
+      out[n++] = (uint8_t)(dec->bits >> dec->nbits);
+      dec->bits &= (1u << dec->nbits) - 1;
+    }
+  }
+
+  return n;
+}
+
+int base64_finish(struct base64_decoder *dec) {
+  // a lone character in the last quad can't encode a whole byte
+  if (dec->error || dec->nbits >= 6) {
+    return -1;
+  }
+
+  return 0;
+}
+
+size_t base64_encode(const uint8_t *in, size_t length, char *out) {
+  size_t n = 0;
+  size_t i = 0;
+
+  for (; i + 3 <= length; i += 3) {
+    uint32_t triple = ((uint32_t)in[i] << 16) | ((uint32_t)in[i + 1] << 8) | in[i + 2];
+    out[n++] = encode_table[(triple >> 18) & 0x3f];
+    out[n++] = encode_table[(triple >> 12) & 0x3f];
+    out[n++] = encode_table[(triple >> 6) & 0x3f];
+    out[n++] = encode_table[triple & 0x3f];
+  }
+
+  if (i < length) {
+    uint32_t triple = (uint32_t)in[i] << 16;
+    if (i + 1 < length) {
+      triple |= (uint32_t)in[i + 1] << 8;
+    }
+
+    out[n++] = encode_table[(triple >> 18) & 0x3f];
+    out[n++] = encode_table[(triple >> 12) & 0x3f];
+    out[n++] = i + 1 < length ? encode_table[(triple >> 6) & 0x3f] : '=';
+    out[n++] = '=';
+  }
+
+  return n;
+}
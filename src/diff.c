@@ -0,0 +1,720 @@
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <nihterm/diff.h>
+#include <nihterm/gfx.h>
+#include <nihterm/utf8.h>
+
+// most parameters the parser keeps from one SGR
+#define SGR_MAX_PARAMS 16
+
+// a scroll is only worth sending if it saves redrawing this many rows
+#define SCROLL_MIN_GAIN 2
+
+// unchanged cells between changes are written over rather than skipped with a
+// cursor movement if there are no more than this many
+#define GAP_MAX 4
+
+// cells compared before two rows are hashed
+#define QUICK_CELLS 4
+
+// The screen at the other end, and what we know of its cursor and pen.
+struct diff {
+  char *buf;
+  size_t cap;
+  size_t len;
+
+  int rows;
+  int cols;
+
+  // the screen being drawn
+  struct snapshot_row *target;
+  const struct cellattr *target_attrs;
+  uint64_t *target_hash;
+  unsigned char *target_blank;
+
+  // the other end's rows: those of from, moved by any scrolls sent, or blank
+  struct snapshot_row *shadow;
+  const struct cellattr *shadow_attrs;
+  uint64_t *shadow_hash;
+
+  // a row of blank cells with the default attributes, which is index 0 in
+  // every attribute table
+  struct cell *blank;
+
+  // cursor; x is -1 if unknown, e.g. with a wrap pending
+  int x;
+  int y;
+
+  struct cellattr pen;
+  int pen_known;
+
+  // columns of the row being drawn that the other end has as in its shadow;
+  // the right half of a row that was double width never went out
+  int known;
+};
+
+static void put(struct diff *d, const char *data, size_t length) {
+  if (d->len < d->cap) {
+    size_t n = d->cap - d->len < length ? d->cap - d->len : length;
+    memcpy(d->buf + d->len, data, n);
+  }
+  d->len += length;
+}
+
+static void putf(struct diff *d, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+static void putf(struct diff *d, const char *fmt, ...) {
+  char buf[64];
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  put(d, buf, (size_t)n);
+}
+
+// Length of CSI n <final>, with n left out when it's 1.
+static size_t csi_len(int n) {
+  size_t len = 3;
+  if (n > 1) {
+    for (; n; n /= 10) {
+      ++len;
+    }
+  }
+  return len;
+}
+
+static void put_csi(struct diff *d, int n, char final) {
+  if (n > 1) {
+    putf(d, "\033[%d%c", n, final);
+  } else {
+    putf(d, "\033[%c", final);
+  }
+}
+
+static int row_width(const struct diff *d, const struct snapshot_row *row) {
+  return (row->dbl_width || row->dbl_height) ? d->cols / 2 : d->cols;
+}
+
+static int attr_equal(const struct cellattr *a, const struct cellattr *b) {
+  return a->fg == b->fg && a->bg == b->bg && a->flags == b->flags;
+}
+
+static int cell_equal(const struct cell *a, const struct cellattr *a_attrs,
+                      const struct cell *b, const struct cellattr *b_attrs) {
+  // cells that were never written are blank too
+  uint32_t a_cp = a->cp || (a->flags & CELL_WIDE_SPACER) ? a->cp : ' ';
+  uint32_t b_cp = b->cp || (b->flags & CELL_WIDE_SPACER) ? b->cp : ' ';
+  if (a_cp != b_cp || a->flags != b->flags) {
+    return 0;
+  }
+
+  for (int i = 0; i < CELL_MAX_COMBINING; ++i) {
+    if (a->combining[i] != b->combining[i]) {
+      return 0;
+    }
+  }
+
+  return a->attr == b->attr && a_attrs == b_attrs
+             ? 1
+             : attr_equal(&a_attrs[a->attr], &b_attrs[b->attr]);
+}
+
+static int is_blank(const struct cell *cell) {
+  return (cell->cp == ' ' || !cell->cp) && !cell->combining[0] &&
+         !cell->flags;
+}
+
+static uint64_t row_hash(const struct diff *d, const struct snapshot_row *row,
+                         const struct cellattr *attrs) {
+  uint64_t hash = 0xCBF29CE484222325u;
+  hash = (hash ^ (uint64_t)(row->dbl_width | row->dbl_height << 1)) *
+         0x100000001B3u;
+
+  // two words a cell rather than a byte at a time: rows that hash the same
+  // are compared in full anyway, so a collision only costs time
+  int w = row_width(d, row);
+  for (int x = 0; x < w; ++x) {
+    const struct cell *cell = &row->cells[x];
+    const struct cellattr *attr = &attrs[cell->attr];
+    uint32_t cp = cell->cp || (cell->flags & CELL_WIDE_SPACER) ? cell->cp : ' ';
+    uint64_t glyph = cp | (uint64_t)cell->flags << 21 |
+                     (uint64_t)cell->combining[0] << 32;
+    uint64_t look = attr->fg ^ (uint64_t)attr->bg << 32 ^
+                    (uint64_t)attr->flags << 24;
+    hash = (hash ^ glyph) * 0x9E3779B97F4A7C15u;
+    hash = (hash ^ look ^ hash >> 29) * 0x9E3779B97F4A7C15u;
+  }
+
+  // 0 means not hashed yet
+  return hash ? hash : 1;
+}
+
+// Whether target row ty is what the other end has in row sy.
+static int rows_match(struct diff *d, int ty, int sy) {
+  const struct snapshot_row *want = &d->target[ty];
+  const struct snapshot_row *have = &d->shadow[sy];
+  if (want->dbl_width != have->dbl_width ||
+      want->dbl_height != have->dbl_height) {
+    return 0;
+  }
+
+  // cells shared between snapshots of one vt haven't changed, which catches
+  // most unchanged and scrolled rows without looking at them
+  if (want->cells == have->cells) {
+    return 1;
+  }
+
+  // most rows that differ do so right away, before they'd need hashing
+  int w = row_width(d, want);
+  for (int x = 0; x < w && x < QUICK_CELLS; ++x) {
+    if (!cell_equal(&want->cells[x], d->target_attrs, &have->cells[x],
+                    d->shadow_attrs)) {
+      return 0;
+    }
+  }
+
+  if (!d->target_hash[ty]) {
+    d->target_hash[ty] = row_hash(d, want, d->target_attrs);
+  }
+  if (!d->shadow_hash[sy]) {
+    d->shadow_hash[sy] = row_hash(d, have, d->shadow_attrs);
+  }
+  if (d->target_hash[ty] != d->shadow_hash[sy]) {
+    return 0;
+  }
+
+  for (int x = QUICK_CELLS; x < w; ++x) {
+    if (!cell_equal(&want->cells[x], d->target_attrs, &have->cells[x],
+                    d->shadow_attrs)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Whether the other end already shows cell x of target row y.
+static int cell_sent(const struct diff *d, int y, int x) {
+  return x < d->known &&
+         cell_equal(&d->target[y].cells[x], d->target_attrs,
+                    &d->shadow[y].cells[x], d->shadow_attrs);
+}
+
+static int row_blank(const struct diff *d, int y) {
+  const struct snapshot_row *row = &d->target[y];
+  if (row->dbl_width || row->dbl_height) {
+    return 0;
+  }
+
+  for (int x = 0; x < d->cols; ++x) {
+    const struct cell *cell = &row->cells[x];
+    if (!is_blank(cell) || !attr_equal(&d->target_attrs[cell->attr],
+                                       &d->target_attrs[0])) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void set_shadow_blank(struct diff *d, int y) {
+  memset(&d->shadow[y], 0, sizeof(d->shadow[y]));
+  d->shadow[y].cells = d->blank;
+  d->shadow_hash[y] = 0;
+}
+
+static void move_to(struct diff *d, int x, int y) {
+  if (d->y == y && d->x == x) {
+    return;
+  }
+
+  char cup[32];
+  if (!x && !y) {
+    snprintf(cup, sizeof(cup), "\033[H");
+  } else if (!x) {
+    snprintf(cup, sizeof(cup), "\033[%dH", y + 1);
+  } else {
+    snprintf(cup, sizeof(cup), "\033[%d;%dH", y + 1, x + 1);
+  }
+  size_t cup_len = strlen(cup);
+
+  if (d->x >= 0 && d->y == y && x > d->x && csi_len(x - d->x) < cup_len) {
+    put_csi(d, x - d->x, 'C');
+  } else if (d->x >= 0 && d->y == y && !x) {
+    put(d, "\r", 1);
+  } else if (d->x >= 0 && d->y == y && x < d->x &&
+             csi_len(d->x - x) < cup_len) {
+    put_csi(d, d->x - x, 'D');
+  } else if (d->x >= 0 && d->y + 1 == y && !x) {
+    put(d, "\r\n", 2);
+  } else {
+    put(d, cup, cup_len);
+  }
+
+  d->x = x;
+  d->y = y;
+}
+
+// Parameters of one SGR, split over several if there are too many for the
+// parser.
+struct sgr {
+  char buf[128];
+  size_t len;
+  int count;
+};
+
+static void sgr_flush(struct diff *d, struct sgr *sgr) {
+  if (sgr->count) {
+    putf(d, "\033[%.*sm", (int)sgr->len, sgr->buf);
+  }
+  sgr->len = 0;
+  sgr->count = 0;
+}
+
+// Add a group of n parameters that must stay in one sequence.
+static void sgr_add(struct diff *d, struct sgr *sgr, int n, const char *params) {
+  if (sgr->count + n > SGR_MAX_PARAMS) {
+    sgr_flush(d, sgr);
+  }
+
+  int written = snprintf(sgr->buf + sgr->len, sizeof(sgr->buf) - sgr->len,
+                         "%s%s", sgr->count ? ";" : "", params);
+  sgr->len += (size_t)written;
+  sgr->count += n;
+}
+
+static void sgr_color(struct diff *d, struct sgr *sgr, uint32_t color,
+                      int base) {
+  char params[32];
+  uint32_t value = color & 0xFFFFFF;
+  if (COLOR_TAG(color) == COLOR_INDEXED_TAG && value < 8) {
+    snprintf(params, sizeof(params), "%u", (unsigned)base + value);
+    sgr_add(d, sgr, 1, params);
+  } else if (COLOR_TAG(color) == COLOR_INDEXED_TAG && value < 16) {
+    snprintf(params, sizeof(params), "%u", (unsigned)base + 60 + value - 8);
+    sgr_add(d, sgr, 1, params);
+  } else if (COLOR_TAG(color) == COLOR_INDEXED_TAG) {
+    snprintf(params, sizeof(params), "%d;5;%u", base + 8, (unsigned)value);
+    sgr_add(d, sgr, 3, params);
+  } else if (COLOR_TAG(color) == COLOR_RGB_TAG) {
+    snprintf(params, sizeof(params), "%d;2;%u;%u;%u", base + 8,
+             (unsigned)(value >> 16), (unsigned)((value >> 8) & 0xFF),
+             (unsigned)(value & 0xFF));
+    sgr_add(d, sgr, 5, params);
+  } else {
+    snprintf(params, sizeof(params), "%d", base + 9);
+    sgr_add(d, sgr, 1, params);
+  }
+}
+
+static const struct {
+  uint32_t flag;
+  const char *param;
+} sgr_flags[] = {
+    {ATTR_BOLD, "1"},    {ATTR_DIM, "2"},     {ATTR_ITALIC, "3"},
+    {ATTR_UNDERLINE, "4"}, {ATTR_BLINK, "5"}, {ATTR_REVERSE, "7"},
+    {ATTR_HIDDEN, "8"},  {ATTR_STRIKE, "9"},
+};
+
+static void set_pen(struct diff *d, const struct cellattr *attr) {
+  if (d->pen_known && attr_equal(&d->pen, attr)) {
+    return;
+  }
+
+  struct cellattr from = {0, 0, 0};
+  struct sgr sgr = {.len = 0, .count = 0};
+
+  // turning flags off is left to a reset, as bold and dim go off together
+  if (!d->pen_known || (d->pen.flags & ~attr->flags)) {
+    if (attr_equal(attr, &from)) {
+      put(d, "\033[m", 3);
+      d->pen = *attr;
+      d->pen_known = 1;
+      return;
+    }
+    sgr_add(d, &sgr, 1, "0");
+  } else {
+    from = d->pen;
+  }
+
+  for (size_t i = 0; i < sizeof(sgr_flags) / sizeof(sgr_flags[0]); ++i) {
+    if ((attr->flags & ~from.flags) & sgr_flags[i].flag) {
+      sgr_add(d, &sgr, 1, sgr_flags[i].param);
+    }
+  }
+  if (attr->fg != from.fg) {
+    sgr_color(d, &sgr, attr->fg, 30);
+  }
+  if (attr->bg != from.bg) {
+    sgr_color(d, &sgr, attr->bg, 40);
+  }
+  sgr_flush(d, &sgr);
+
+  d->pen = *attr;
+  d->pen_known = 1;
+}
+
+// Clear the other end's screen, with the default attributes.
+static void send_clear(struct diff *d) {
+  struct cellattr plain = {0, 0, 0};
+  set_pen(d, &plain);
+  put(d, "\033[2J", 4);
+
+  for (int y = 0; y < d->rows; ++y) {
+    set_shadow_blank(d, y);
+  }
+}
+
+// Scroll rows top to bottom of the other end by shift, up if positive.
+static void send_scroll(struct diff *d, int top, int bottom, int shift) {
+  // lines scrolled in take the pen's attributes
+  struct cellattr plain = {0, 0, 0};
+  set_pen(d, &plain);
+
+  int n = shift > 0 ? shift : -shift;
+  if (!top && bottom == d->rows - 1) {
+    // SU/SD
+    put_csi(d, n, shift > 0 ? 'S' : 'T');
+  } else if (bottom == d->rows - 1) {
+    // DL/IL at the top of the region
+    move_to(d, 0, top);
+    put_csi(d, n, shift > 0 ? 'M' : 'L');
+    d->x = -1;
+  } else {
+    // DECSTBM around SU/SD; setting the margins homes the cursor
+    putf(d, "\033[%d;%dr", top + 1, bottom + 1);
+    put_csi(d, n, shift > 0 ? 'S' : 'T');
+    put(d, "\033[r", 3);
+    d->x = 0;
+    d->y = 0;
+  }
+
+  if (shift > 0) {
+    for (int y = top; y <= bottom - n; ++y) {
+      d->shadow[y] = d->shadow[y + n];
+      d->shadow_hash[y] = d->shadow_hash[y + n];
+    }
+    for (int y = bottom - n + 1; y <= bottom; ++y) {
+      set_shadow_blank(d, y);
+    }
+  } else {
+    for (int y = bottom; y >= top + n; --y) {
+      d->shadow[y] = d->shadow[y - n];
+      d->shadow_hash[y] = d->shadow_hash[y - n];
+    }
+    for (int y = top; y < top + n; ++y) {
+      set_shadow_blank(d, y);
+    }
+  }
+}
+
+// How many more rows would be right after scrolling top to bottom by shift.
+static int scroll_gain(struct diff *d, const int *same, int top, int bottom,
+                       int shift) {
+  int gain = 0;
+  for (int y = top; y <= bottom; ++y) {
+    int from = y + shift;
+    int match = from >= top && from <= bottom ? rows_match(d, y, from)
+                                              : d->target_blank[y];
+    gain += match - same[y];
+  }
+  return gain;
+}
+
+// Rough cost in bytes of send_scroll for a region, to choose between regions
+// that do as well as each other.
+static int scroll_cost(struct diff *d, int top, int bottom) {
+  if (!top && bottom == d->rows - 1) {
+    return 0;
+  }
+  return bottom == d->rows - 1 ? 1 : 2;
+}
+
+// Find the scroll that leaves the most rows right, counting only those that
+// were wrong before. Returns how many that is.
+static int find_scroll(struct diff *d, const int *same, int *top, int *bottom,
+                       int *shift) {
+  int best = 0;
+  int best_cost = 0;
+  for (int k = 1 - d->rows; k < d->rows; ++k) {
+    if (!k) {
+      continue;
+    }
+
+    // runs of rows y where row y + k of the other end is what's wanted
+    int y = k > 0 ? 0 : -k;
+    int end = k > 0 ? d->rows - k : d->rows;
+    while (y < end) {
+      if (!rows_match(d, y, y + k)) {
+        ++y;
+        continue;
+      }
+
+      int start = y;
+      while (y < end && rows_match(d, y, y + k)) {
+        ++y;
+      }
+
+      // the smallest region that moves the run, and the same stretched to
+      // the edges of the screen, which is cheaper to send and may do as well
+      int run_top = k > 0 ? start : start + k;
+      int run_bottom = k > 0 ? y - 1 + k : y - 1;
+      int tops[] = {run_top, 0};
+      int bottoms[] = {run_bottom, d->rows - 1};
+      for (int t = 0; t < 2; ++t) {
+        for (int b = 0; b < 2; ++b) {
+          int gain = scroll_gain(d, same, tops[t], bottoms[b], k);
+          int cost = scroll_cost(d, tops[t], bottoms[b]);
+          if (gain > best || (gain == best && cost < best_cost)) {
+            best = gain;
+            best_cost = cost;
+            *top = tops[t];
+            *bottom = bottoms[b];
+            *shift = k;
+          }
+        }
+      }
+    }
+  }
+
+  return best;
+}
+
+// Write the cells from x on, stopping at end or where skipping ahead is
+// cheaper than writing. Returns where it stopped.
+static int draw_run(struct diff *d, int y, int x, int end) {
+  const struct cell *want = d->target[y].cells;
+  int w = row_width(d, &d->target[y]);
+
+  while (x <= end) {
+    // stop at a long enough stretch of cells that are already right
+    int gap = 0;
+    while (x + gap <= end && cell_sent(d, y, x + gap)) {
+      ++gap;
+    }
+    if (gap > GAP_MAX || x + gap > end) {
+      return x + gap;
+    }
+
+    const struct cell *cell = &want[x];
+    const struct cellattr *attr = &d->target_attrs[cell->attr];
+
+    // blanks go out as ECH, after which the cursor is moved past them
+    int run = 0;
+    while (x + run <= end && is_blank(&want[x + run]) &&
+           attr_equal(&d->target_attrs[want[x + run].attr], attr)) {
+      ++run;
+    }
+    if ((size_t)run > csi_len(run) * 2) {
+      set_pen(d, attr);
+      put_csi(d, run, 'X');
+      return x + run;
+    }
+
+    if (cell->flags & CELL_WIDE_SPACER) {
+      // the right half of a character whose left half isn't on the row
+      d->x = -1;
+      return x + 1;
+    }
+
+    set_pen(d, attr);
+
+    char utf8[4 * (1 + CELL_MAX_COMBINING)];
+    size_t n = utf8_encode(cell->cp ? cell->cp : ' ', utf8);
+    for (int i = 0; i < CELL_MAX_COMBINING && cell->combining[i]; ++i) {
+      n += utf8_encode(cell->combining[i], utf8 + n);
+    }
+    put(d, utf8, n);
+
+    int width = (cell->flags & CELL_WIDE) ? 2 : 1;
+    x += width;
+
+    // the same character again is sent as REP
+    if (!cell->combining[0]) {
+      int repeats = 0;
+      while (x + width - 1 <= end && want[x].cp == cell->cp &&
+             want[x].flags == cell->flags && !want[x].combining[0] &&
+             attr_equal(&d->target_attrs[want[x].attr], attr)) {
+        ++repeats;
+        x += width;
+      }
+
+      if (csi_len(repeats) < n * (size_t)repeats) {
+        put_csi(d, repeats, 'b');
+      } else {
+        for (int i = 0; i < repeats; ++i) {
+          put(d, utf8, n);
+        }
+      }
+    }
+
+    // at the end of the row a wrap may be pending
+    d->x = x < w ? x : -1;
+  }
+
+  return x;
+}
+
+static void draw_row(struct diff *d, int y) {
+  struct snapshot_row *want = &d->target[y];
+  struct snapshot_row *have = &d->shadow[y];
+
+  d->known = row_width(d, have);
+  if (want->dbl_width != have->dbl_width ||
+      want->dbl_height != have->dbl_height) {
+    move_to(d, 0, y);
+    if (want->dbl_height) {
+      put(d, want->dbl_height == 1 ? "\033#3" : "\033#4", 3);
+    } else {
+      put(d, want->dbl_width ? "\033#6" : "\033#5", 3);
+    }
+    have->dbl_width = want->dbl_width;
+    have->dbl_height = want->dbl_height;
+  }
+
+  int w = row_width(d, want);
+  int first = 0;
+  while (first < w && cell_sent(d, y, first)) {
+    ++first;
+  }
+  if (first == w) {
+    return;
+  }
+
+  int last = w - 1;
+  while (cell_sent(d, y, last)) {
+    --last;
+  }
+
+  // blanks to the end of the row go out as EL
+  const struct cellattr *tail = &d->target_attrs[want->cells[w - 1].attr];
+  int erase = w;
+  while (erase > first && is_blank(&want->cells[erase - 1]) &&
+         attr_equal(&d->target_attrs[want->cells[erase - 1].attr], tail)) {
+    --erase;
+  }
+  if (last - erase + 1 <= 3) {
+    erase = w;
+  }
+
+  int end = erase < w ? erase - 1 : last;
+  int x = first;
+  while (x <= end) {
+    if (cell_sent(d, y, x)) {
+      ++x;
+      continue;
+    }
+
+    // a right half is written with its left
+    if ((want->cells[x].flags & CELL_WIDE_SPACER) && x > 0) {
+      --x;
+    }
+
+    move_to(d, x, y);
+    x = draw_run(d, y, x, end);
+  }
+
+  if (erase < w) {
+    set_pen(d, tail);
+    move_to(d, erase, y);
+    put(d, "\033[K", 3);
+  }
+}
+
+size_t snapshot_diff(const struct snapshot *from, const struct snapshot *to,
+                     char *buf, size_t cap) {
+  struct diff d;
+  memset(&d, 0, sizeof(d));
+  d.buf = buf;
+  d.cap = cap;
+  d.x = -1;
+  d.y = -1;
+
+  vt_snapshot_size(to, &d.rows, &d.cols);
+
+  int from_rows = 0, from_cols = 0;
+  if (from) {
+    vt_snapshot_size(from, &from_rows, &from_cols);
+    if (from_rows != d.rows || from_cols != d.cols) {
+      from = NULL;
+    }
+  }
+
+  size_t num_attrs = 0;
+  d.target_attrs = vt_snapshot_attrs(to, &num_attrs);
+  d.shadow_attrs = from ? vt_snapshot_attrs(from, &num_attrs) : d.target_attrs;
+
+  size_t rows = (size_t)d.rows;
+  d.target = calloc(rows, sizeof(struct snapshot_row));
+  d.shadow = calloc(rows, sizeof(struct snapshot_row));
+  d.target_hash = calloc(rows, sizeof(uint64_t));
+  d.target_blank = calloc(rows, 1);
+  d.shadow_hash = calloc(rows, sizeof(uint64_t));
+  d.blank = calloc((size_t)d.cols, sizeof(struct cell));
+  int *same = calloc(rows, sizeof(int));
+
+  for (int x = 0; x < d.cols; ++x) {
+    d.blank[x].cp = ' ';
+  }
+
+  for (int y = 0; y < d.rows; ++y) {
+    if (vt_snapshot_row(to, y, &d.target[y]) < 0) {
+      memset(&d.target[y], 0, sizeof(d.target[y]));
+      d.target[y].cells = d.blank;
+    }
+    d.target_blank[y] = (unsigned char)row_blank(&d, y);
+
+    if (!from || vt_snapshot_row(from, y, &d.shadow[y]) < 0) {
+      set_shadow_blank(&d, y);
+    }
+  }
+
+  if (!from) {
+    // an unknown screen: reset the margins, which homes the cursor, and clear
+    put(&d, "\033[r", 3);
+    d.x = 0;
+    d.y = 0;
+    send_clear(&d);
+  }
+
+  // each clear or scroll sent leaves more rows right, so this ends
+  for (;;) {
+    int clear_gain = 0;
+    for (int y = 0; y < d.rows; ++y) {
+      same[y] = rows_match(&d, y, y);
+      clear_gain += d.target_blank[y] - same[y];
+    }
+
+    int top = 0, bottom = 0, shift = 0;
+    int scroll = find_scroll(&d, same, &top, &bottom, &shift);
+    if (clear_gain >= SCROLL_MIN_GAIN && clear_gain >= scroll) {
+      send_clear(&d);
+    } else if (scroll >= SCROLL_MIN_GAIN) {
+      send_scroll(&d, top, bottom, shift);
+    } else {
+      break;
+    }
+  }
+
+  for (int y = 0; y < d.rows; ++y) {
+    if (!rows_match(&d, y, y)) {
+      draw_row(&d, y);
+    }
+  }
+
+  int cx = 0, cy = 0;
+  vt_snapshot_cursor(to, &cx, &cy);
+  move_to(&d, cx, cy);
+
+  free(same);
+  free(d.blank);
+  free(d.shadow_hash);
+  free(d.target_blank);
+  free(d.target_hash);
+  free(d.shadow);
+  free(d.target);
+
+  return d.len;
+}
@@ -0,0 +1,90 @@
+#!/usr/bin/env python3
+"""Generate the two-stage character width tables used by width.h.
+
+Widths come from the Unicode database bundled with Python:
+  0 - combining marks and other zero-width characters
+  1 - everything else
+  2 - East Asian Wide and Fullwidth characters (CJK, most emoji)
+
+Codepoints are split into 256-entry blocks. Identical blocks are stored
+once, packed four widths to a byte, and the first stage maps each block
+number to its stored block.
+
+Usage: gen-width.py [output.c]
+"""
+
+import sys
+import unicodedata
+
+MAX_CODEPOINT = 0x110000
+BLOCK_BITS = 8
+BLOCK_SIZE = 1 << BLOCK_BITS
+
+# unassigned codepoints in these ranges default to wide (UAX #11)
+DEFAULT_WIDE = ((0x3400, 0x4DBF), (0x4E00, 0x9FFF), (0xF900, 0xFAFF),
+                (0x20000, 0x2FFFD), (0x30000, 0x3FFFD))
+
+
+def width(cp):
+    # Hangul medial vowels and final consonants join the preceding syllable
+    if 0x1160 <= cp <= 0x11FF or 0xD7B0 <= cp <= 0xD7FF:
+        return 0
+
+    # zero width space, joiners and marks
+    if 0x200B <= cp <= 0x200F or cp == 0x2060 or cp == 0xFEFF:
+        return 0
+
+    ch = chr(cp)
+    category = unicodedata.category(ch)
+    if category in ("Mn", "Me"):
+        return 0
+
+    # unicodedata reports unassigned codepoints as Fullwidth
+    if category == "Cn":
+        return 2 if any(lo <= cp <= hi for lo, hi in DEFAULT_WIDE) else 1
+
+    if unicodedata.east_asian_width(ch) in ("W", "F"):
+        return 2
+
+    return 1
+
+
+def main():
+    blocks = []
+    block_index = {}
+    stage1 = []
+
+    for base in range(0, MAX_CODEPOINT, BLOCK_SIZE):
+        block = bytearray(BLOCK_SIZE // 4)
+        for i in range(BLOCK_SIZE):
+            block[i >> 2] |= width(base + i) << ((i & 3) * 2)
+
+        block = bytes(block)
+        if block not in block_index:
+            block_index[block] = len(blocks)
+            blocks.append(block)
+        stage1.append(block_index[block])
+
+    if len(blocks) > 256:
+        sys.exit("gen-width.py: too many distinct blocks for uint8_t stage 1")
+
+    out = open(sys.argv[1], "w") if len(sys.argv) > 1 else sys.stdout
+    out.write("// Generated by gen-width.py from Unicode %s. Do not edit.\n\n"
+              % unicodedata.unidata_version)
+    out.write("#include <stdint.h>\n\n")
+    out.write("#include <nihterm/width.h>\n\n")
+
+    out.write("const uint8_t width_stage1[%d] = {\n" % len(stage1))
+    for i in range(0, len(stage1), 16):
+        out.write("    %s,\n" % ", ".join("%d" % b for b in stage1[i:i + 16]))
+    out.write("};\n\n")
+
+    out.write("const uint8_t width_stage2[%d] = {\n" % (len(blocks) * len(blocks[0])))
+    for block in blocks:
+        for i in range(0, len(block), 16):
+            out.write("    %s,\n" % ", ".join("0x%02x" % b for b in block[i:i + 16]))
+    out.write("};\n")
+
+
+if __name__ == "__main__":
+    main()
@@ -4,6 +4,9 @@
 #include <SDL2/SDL.h>
 
 #include <nihterm/gfx.h>
+#include <nihterm/latency.h>
+#include <nihterm/trace.h>
+#include <nihterm/utf8.h>
 #include <nihterm/vt.h>
 
 #include <cairo/cairo.h>
@@ -13,8 +16,83 @@
 #define FONT_REGULAR 0
 #define FONT_DOUBLE 1
 
+// input gathered while draining one batch of events, written in one go
+#define INPUT_BUFFER_SIZE 4096
+
+// rasterized glyphs kept before the cache is flushed
+#define GLYPH_CACHE_BUCKETS 1024
+#define GLYPH_CACHE_MAX 4096
+
+// glyph styles, part of the cache key
+#define GLYPH_BOLD 0x1
+#define GLYPH_ITALIC 0x2
+#define GLYPH_DOUBLE 0x4
+
+// default colors (swapped when inverted)
+#define DEFAULT_FG 0xFFFFFF
+#define DEFAULT_BG 0x000000
+
 static int load_fonts(struct graphics *graphics);
 
+// Keys that send something other than their text.
+enum {
+  KEY_UP,
+  KEY_DOWN,
+  KEY_RIGHT,
+  KEY_LEFT,
+  KEY_PF1,
+  KEY_PF2,
+  KEY_PF3,
+  KEY_PF4,
+  KEY_KP_0,
+  KEY_KP_1,
+  KEY_KP_2,
+  KEY_KP_3,
+  KEY_KP_4,
+  KEY_KP_5,
+  KEY_KP_6,
+  KEY_KP_7,
+  KEY_KP_8,
+  KEY_KP_9,
+  KEY_KP_MINUS,
+  KEY_KP_COMMA,
+  KEY_KP_PERIOD,
+  KEY_KP_ENTER,
+  KEY_RETURN,
+  KEY_BACKSPACE,
+  KEY_TAB,
+  KEY_ESCAPE,
+  NUM_KEYS,
+};
+
+struct keyseq {
+  char seq[4];
+  size_t len;
+  // the key also produces SDL_TEXTINPUT, which must be dropped
+  int has_text;
+};
+
+// What each key sends under one set of VT input modes. Rebuilt only when
+// vt_input_modes() changes.
+struct keymap {
+  int valid;
+  unsigned modes;
+  struct keyseq keys[NUM_KEYS];
+  // ctrl-<key> for keycodes below 128, or -1 if the chord sends nothing
+  int ctrl[128];
+};
+
+// A glyph rasterized once as a coverage mask: white, with coverage in alpha.
+// Drawing tints it to the cell's color, so each glyph is only rasterized once
+// whatever colors it's shown in.
+struct glyph {
+  uint32_t cp;
+  uint32_t combining[CELL_MAX_COMBINING];
+  unsigned style;
+  SDL_Surface *mask;
+  struct glyph *next;
+};
+
 struct graphics {
   SDL_Window *window;
   SDL_Surface *surface;
@@ -31,11 +109,60 @@ struct graphics {
   int dirty;
 
   int inverted;
+
+  struct keymap keymap;
+  int suppress_text;
+
+  char input[INPUT_BUFFER_SIZE];
+  size_t input_len;
+
+  // 256-color palette as 0xRRGGBB
+  uint32_t palette[256];
+
+  struct glyph *glyphs[GLYPH_CACHE_BUCKETS];
+  size_t num_glyphs;
 };
 
-struct graphics *create_graphics() {
-  SDL_Init(SDL_INIT_VIDEO);
+static void init_palette(uint32_t *palette) {
+  // xterm's ANSI colors
+  static const uint32_t ansi[16] = {
+      0x000000, 0xCD0000, 0x00CD00, 0xCDCD00, 0x0000EE, 0xCD00CD,
+      0x00CDCD, 0xE5E5E5, 0x7F7F7F, 0xFF0000, 0x00FF00, 0xFFFF00,
+      0x5C5CFF, 0xFF00FF, 0x00FFFF, 0xFFFFFF,
+  };
+  static const uint32_t levels[6] = {0, 95, 135, 175, 215, 255};
+
+  memcpy(palette, ansi, sizeof(ansi));
+
+  // 6x6x6 color cube
+  for (uint32_t i = 0; i < 216; ++i) {
+    palette[16 + i] =
+        (levels[i / 36] << 16) | (levels[(i / 6) % 6] << 8) | levels[i % 6];
+  }
+
+  // grayscale ramp
+  for (uint32_t i = 0; i < 24; ++i) {
+    uint32_t level = 8 + i * 10;
+    palette[232 + i] = (level << 16) | (level << 8) | level;
+  }
+}
+
+static void glyph_cache_flush(struct graphics *graphics) {
+  for (size_t i = 0; i < GLYPH_CACHE_BUCKETS; ++i) {
+    struct glyph *glyph = graphics->glyphs[i];
+    while (glyph) {
+      struct glyph *next = glyph->next;
+      SDL_FreeSurface(glyph->mask);
+      free(glyph);
+      glyph = next;
+    }
+    graphics->glyphs[i] = NULL;
+  }
+
+  graphics->num_glyphs = 0;
+}
 
+static struct graphics *init_graphics(void) {
   struct graphics *graphics =
       (struct graphics *)calloc(sizeof(struct graphics), 1);
 
@@ -61,22 +188,60 @@ struct graphics *create_graphics() {
 
   pango_font_metrics_unref(metrics);
 
+  init_palette(graphics->palette);
+
+  return graphics;
+}
+
+struct graphics *create_graphics() {
+  SDL_Init(SDL_INIT_VIDEO);
+
+  struct graphics *graphics = init_graphics();
+  if (!graphics) {
+    return NULL;
+  }
+
   graphics->xdim = graphics->cellw * 80;
-  graphics->ydim = graphics->cellh * 25;
+  graphics->ydim = graphics->cellh * 24;
 
   graphics->window = SDL_CreateWindow(
       "nihterm", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
-      (int)graphics->xdim, (int)graphics->ydim, 0);
+      (int)graphics->xdim, (int)graphics->ydim, SDL_WINDOW_RESIZABLE);
 
   graphics->surface = SDL_GetWindowSurface(graphics->window);
   SDL_FillRect(graphics->surface, NULL, 0);
   SDL_UpdateWindowSurface(graphics->window);
 
+  SDL_StartTextInput();
+
   graphics->dirty = 1;
 
   return graphics;
 }
 
+struct graphics *create_graphics_offscreen(int cols, int rows) {
+  struct graphics *graphics = init_graphics();
+  if (!graphics) {
+    return NULL;
+  }
+
+  graphics->xdim = graphics->cellw * (size_t)cols;
+  graphics->ydim = graphics->cellh * (size_t)rows;
+
+  graphics->surface = SDL_CreateRGBSurface(0, (int)graphics->xdim,
+                                           (int)graphics->ydim, 32, 0, 0, 0, 0);
+  if (!graphics->surface) {
+    fprintf(stderr, "nihterm: failed to create offscreen surface: %s\n",
+            SDL_GetError());
+    destroy_graphics(graphics);
+    return NULL;
+  }
+
+  SDL_FillRect(graphics->surface, NULL, 0);
+
+  return graphics;
+}
+
 static int load_fonts(struct graphics *graphics) {
   // already loaded?
   if (graphics->font[0]) {
@@ -103,8 +268,15 @@ static int load_fonts(struct graphics *graphics) {
 }
 
 void destroy_graphics(struct graphics *graphics) {
-  SDL_DestroyWindow(graphics->window);
-  SDL_Quit();
+  if (graphics->window) {
+    SDL_DestroyWindow(graphics->window);
+    SDL_Quit();
+  } else if (graphics->surface) {
+    // offscreen graphics own their surface
+    SDL_FreeSurface(graphics->surface);
+  }
+
+  glyph_cache_flush(graphics);
 
   pango_cairo_font_map_set_default(NULL);
 
@@ -124,138 +296,254 @@ size_t window_width(struct graphics *graphics) { return graphics->xdim; }
 
 size_t window_height(struct graphics *graphics) { return graphics->ydim; }
 
+static void set_key(struct keymap *map, int key, const char *seq,
+                    int has_text) {
+  struct keyseq *keyseq = &map->keys[key];
+  keyseq->len = strlen(seq);
+  memcpy(keyseq->seq, seq, keyseq->len);
+  keyseq->has_text = has_text;
+}
+
+static void build_keymap(struct keymap *map, unsigned modes) {
+  static const char cursor_keys[] = "ABCD";
+  static const char keypad_digits[] = "pqrstuvwxy";
+
+  int vt52 = (modes & VT_INPUT_VT52) != 0;
+  char seq[4];
+
+  memset(map, 0, sizeof(*map));
+  map->modes = modes;
+
+  // cursor keys: ESC [ A normally, ESC O A under DECCKM, ESC A for VT52
+  for (int i = 0; i < 4; ++i) {
+    if (vt52) {
+      snprintf(seq, sizeof(seq), "\033%c", cursor_keys[i]);
+    } else {
+      snprintf(seq, sizeof(seq), "\033%c%c",
+               (modes & VT_INPUT_DECCKM) ? 'O' : '[', cursor_keys[i]);
+    }
+    set_key(map, KEY_UP + i, seq, 0);
+  }
+
+  // F1-F4 stand in for PF1-PF4
+  for (int i = 0; i < 4; ++i) {
+    snprintf(seq, sizeof(seq), vt52 ? "\033%c" : "\033O%c", 'P' + i);
+    set_key(map, KEY_PF1 + i, seq, 0);
+  }
+
+  // in numeric mode the keypad just sends its text
+  if (modes & VT_INPUT_DECKPAM) {
+    const char *prefix = vt52 ? "\033?" : "\033O";
+    for (int i = 0; i < 10; ++i) {
+      snprintf(seq, sizeof(seq), "%s%c", prefix, keypad_digits[i]);
+      set_key(map, KEY_KP_0 + i, seq, 1);
+    }
+
+    snprintf(seq, sizeof(seq), "%sm", prefix);
+    set_key(map, KEY_KP_MINUS, seq, 1);
+    snprintf(seq, sizeof(seq), "%sl", prefix);
+    set_key(map, KEY_KP_COMMA, seq, 1);
+    snprintf(seq, sizeof(seq), "%sn", prefix);
+    set_key(map, KEY_KP_PERIOD, seq, 1);
+    snprintf(seq, sizeof(seq), "%sM", prefix);
+    set_key(map, KEY_KP_ENTER, seq, 0);
+  } else {
+    set_key(map, KEY_KP_ENTER, "\r", 0);
+  }
+
+  set_key(map, KEY_RETURN, "\r", 0);
+  set_key(map, KEY_BACKSPACE, "\b", 0);
+  set_key(map, KEY_TAB, "\t", 0);
+  set_key(map, KEY_ESCAPE, "\033", 0);
+
+  // ctrl-<key> chords
+  for (int c = 0; c < 128; ++c) {
+    map->ctrl[c] = -1;
+    if (c >= 'a' && c <= 'z') {
+      // A = \001, B = \002, etc
+      map->ctrl[c] = c - 'a' + 1;
+    } else if (c >= '[' && c <= '_') {
+      map->ctrl[c] = c - '@';
+    }
+  }
+  map->ctrl[' '] = 0;
+  map->ctrl['2'] = 0;
+  map->ctrl['`'] = 0;
+  map->ctrl['3'] = '\033';
+  map->ctrl['4'] = '\034';
+  map->ctrl['5'] = '\035';
+  map->ctrl['6'] = '\036';
+  map->ctrl['7'] = '\037';
+  map->ctrl['/'] = '\037';
+  map->ctrl['8'] = '\177';
+
+  map->valid = 1;
+}
+
+static int key_index(SDL_Keycode sym) {
+  switch (sym) {
+  case SDLK_UP:
+    return KEY_UP;
+  case SDLK_DOWN:
+    return KEY_DOWN;
+  case SDLK_RIGHT:
+    return KEY_RIGHT;
+  case SDLK_LEFT:
+    return KEY_LEFT;
+  case SDLK_F1:
+  case SDLK_F2:
+  case SDLK_F3:
+  case SDLK_F4:
+    return KEY_PF1 + (sym - SDLK_F1);
+  case SDLK_KP_0:
+    return KEY_KP_0;
+  case SDLK_KP_1:
+  case SDLK_KP_2:
+  case SDLK_KP_3:
+  case SDLK_KP_4:
+  case SDLK_KP_5:
+  case SDLK_KP_6:
+  case SDLK_KP_7:
+  case SDLK_KP_8:
+  case SDLK_KP_9:
+    return KEY_KP_1 + (sym - SDLK_KP_1);
+  case SDLK_KP_MINUS:
+    return KEY_KP_MINUS;
+  case SDLK_KP_COMMA:
+    return KEY_KP_COMMA;
+  case SDLK_KP_PERIOD:
+    return KEY_KP_PERIOD;
+  case SDLK_KP_ENTER:
+    return KEY_KP_ENTER;
+  case SDLK_RETURN:
+  case SDLK_RETURN2:
+    return KEY_RETURN;
+  case SDLK_BACKSPACE:
+    return KEY_BACKSPACE;
+  case SDLK_TAB:
+    return KEY_TAB;
+  case SDLK_ESCAPE:
+    return KEY_ESCAPE;
+  default:
+    return -1;
+  }
+}
+
+static void flush_input(struct graphics *graphics) {
+  if (graphics->input_len) {
+    vt_input(graphics->vt, graphics->input, graphics->input_len);
+    graphics->input_len = 0;
+  }
+}
+
+static void send_input(struct graphics *graphics, const char *buf, size_t len,
+                       Uint32 timestamp) {
+  latency_input((uint64_t)(SDL_GetTicks() - timestamp) * 1000000ULL);
+
+  if (len > INPUT_BUFFER_SIZE - graphics->input_len) {
+    flush_input(graphics);
+    if (len > INPUT_BUFFER_SIZE) {
+      vt_input(graphics->vt, buf, len);
+      return;
+    }
+  }
+
+  memcpy(graphics->input + graphics->input_len, buf, len);
+  graphics->input_len += len;
+}
+
+static void paste_clipboard(struct graphics *graphics) {
+  char *text = SDL_GetClipboardText();
+  if (!text) {
+    return;
+  }
+
+  // keys typed before the paste go first
+  flush_input(graphics);
+  vt_paste(graphics->vt, text, strlen(text));
+  SDL_free(text);
+}
+
+static void handle_keydown(struct graphics *graphics,
+                           SDL_KeyboardEvent *event) {
+  struct keymap *map = &graphics->keymap;
+  unsigned modes = vt_input_modes(graphics->vt);
+  if (!map->valid || map->modes != modes) {
+    build_keymap(map, modes);
+  }
+
+  SDL_Keycode sym = event->keysym.sym;
+
+  // Ctrl+Shift+V or Shift+Insert, neither of which comes with text
+  if (((event->keysym.mod & KMOD_CTRL) && (event->keysym.mod & KMOD_SHIFT) &&
+       sym == SDLK_v) ||
+      ((event->keysym.mod & KMOD_SHIFT) && sym == SDLK_INSERT)) {
+    paste_clipboard(graphics);
+    return;
+  }
+
+  int key = key_index(sym);
+  if (key >= 0 && map->keys[key].len) {
+    struct keyseq *keyseq = &map->keys[key];
+    send_input(graphics, keyseq->seq, keyseq->len, event->timestamp);
+    graphics->suppress_text = keyseq->has_text;
+    return;
+  }
+
+  // printable keys arrive as SDL_TEXTINPUT, except for control chords, whose
+  // unprintable text SDL filters out
+  if ((event->keysym.mod & KMOD_CTRL) && sym >= 0 && sym < 128 &&
+      map->ctrl[sym] >= 0) {
+    char c = (char)map->ctrl[sym];
+    send_input(graphics, &c, 1, event->timestamp);
+  }
+}
+
+// The window changed size, by the user dragging it or from graphics_resize.
+// The terminal gets as many whole cells as fit.
+static void window_resized(struct graphics *graphics, int w, int h) {
+  // resize invalidates the existing surface
+  graphics->surface = SDL_GetWindowSurface(graphics->window);
+  SDL_FillRect(graphics->surface, NULL, graphics->inverted ? 0xFFFFFF : 0);
+  graphics->dirty = 1;
+
+  int cols = w / (int)graphics->cellw;
+  int rows = h / (int)graphics->cellh;
+  if (cols < 1 || rows < 1) {
+    return;
+  }
+
+  graphics->xdim = (size_t)cols * graphics->cellw;
+  graphics->ydim = (size_t)rows * graphics->cellh;
+
+  if (graphics->vt) {
+    vt_resize(graphics->vt, rows, cols);
+  }
+}
+
 int process_queue(struct graphics *graphics) {
   // render any pending updates from the VT
   vt_render(graphics->vt);
 
+  TRACE_BEGIN(poll_start);
+
   SDL_Event event;
   while (SDL_PollEvent(&event)) {
     switch (event.type) {
     case SDL_QUIT:
+      TRACE_END("poll events", poll_start);
       return 1;
-      //case SDL_TEXTINPUT:
-      //fprintf(stderr, "textinput: '%s'\n", event.text.text);
-      //vt_input(graphics->vt, event.text.text, strlen(event.text.text));
-      //break;
-    case SDL_KEYUP:
-      // fprintf(stderr, "sym %d/%c; mod %x\n", event.key.keysym.sym, event.key.keysym.sym, event.key.keysym.mod);
-      switch (event.key.keysym.sym) {
-      case SDLK_RETURN:
-      case SDLK_RETURN2:
-        vt_input(graphics->vt, "\r", 1);
-        break;
-      case SDLK_BACKSPACE:
-        vt_input(graphics->vt, "\b", 1);
-        break;
-      case SDLK_LEFT:
-        // TODO(miselin): there's mode setting at play here
-        vt_input(graphics->vt, "\033[D", 3);
-        break;
-      case SDLK_RIGHT:
-        // TODO(miselin): there's mode setting at play here
-        vt_input(graphics->vt, "\033[C", 3);
-        break;
-      case SDLK_UP:
-        // TODO(miselin): there's mode setting at play here
-        vt_input(graphics->vt, "\033[A", 3);
-        break;
-      case SDLK_DOWN:
-        // TODO(miselin): there's mode setting at play here
-        vt_input(graphics->vt, "\033[B", 3);
+    case SDL_KEYDOWN:
+      handle_keydown(graphics, &event.key);
+      break;
+    case SDL_TEXTINPUT:
+      if (graphics->suppress_text) {
+        // already sent by handle_keydown
+        graphics->suppress_text = 0;
         break;
-      default:
-        if (event.key.keysym.sym >= 0x20 && event.key.keysym.sym <= 0x7F) {
-          char buf[4] = {(char)event.key.keysym.sym, 0, 0, 0};
-          size_t buf_len = 1;
-
-          // ctrl-<key>
-          if (event.key.keysym.mod & (KMOD_LCTRL | KMOD_RCTRL)) {
-            if (buf[0] == ' ') {
-              buf[0] = '\0';
-            } else if (buf[0] == '`') {
-              buf[0] = '\036';
-            } else if (buf[0] == '?') {
-              buf[0] = '\036';
-            } else if (toupper(buf[0]) >= 'A' && toupper(buf[0]) <= ']') {
-              // A = \001, B = \002, etc
-              buf[0] = (char) (toupper(buf[0]) - '@');
-            }
-          } else if (event.key.keysym.mod & KMOD_SHIFT) {
-            if (event.key.keysym.mod & KMOD_CAPS) {
-              buf[0] = (char)tolower(buf[0]);
-            }
-
-            switch (buf[0]) {
-            case '0':
-              buf[0] = ')';
-              break;
-            case '1':
-              buf[0] = '!';
-              break;
-            case '2':
-              buf[0] = '@';
-              break;
-            case '3':
-              buf[0] = '#';
-              break;
-            case '4':
-              buf[0] = '$';
-              break;
-            case '5':
-              buf[0] = '%';
-              break;
-            case '6':
-              buf[0] = '^';
-              break;
-            case '7':
-              buf[0] = '&';
-              break;
-            case '8':
-              buf[0] = '*';
-              break;
-            case '9':
-              buf[0] = '(';
-              break;
-            case '-':
-              buf[0] = '_';
-              break;
-            case '=':
-              buf[0] = '+';
-              break;
-            case '`':
-              buf[0] = '~';
-              break;
-            case '[':
-              buf[0] = '{';
-              break;
-            case ']':
-              buf[0] = '}';
-              break;
-            case ';':
-              buf[0] = ':';
-              break;
-            case '\'':
-              buf[0] = '"';
-              break;
-            case '.':
-              buf[0] = '>';
-              break;
-            case ',':
-              buf[0] = '<';
-              break;
-            case '/':
-              buf[0] = '?';
-              break;
-            default:
-              buf[0] = (char)toupper(buf[0]);
-            }
-          } else if (event.key.keysym.mod & KMOD_CAPS) {
-            buf[0] = (char)toupper(buf[0]);
-          }
-
-          vt_input(graphics->vt, buf, buf_len);
-        }
       }
+      send_input(graphics, event.text.text, strlen(event.text.text),
+                 event.text.timestamp);
       break;
     case SDL_WINDOWEVENT:
       switch (event.window.event) {
@@ -263,13 +551,27 @@ int process_queue(struct graphics *graphics) {
         // requires a redraw
         graphics->dirty = 1;
         break;
+      case SDL_WINDOWEVENT_SIZE_CHANGED:
+        window_resized(graphics, event.window.data1, event.window.data2);
+        break;
       }
       break;
     }
   }
 
-  if (graphics->dirty) {
+  // text input for a key arrives in the same batch as its keydown
+  graphics->suppress_text = 0;
+
+  // one write for everything typed since the last batch
+  flush_input(graphics);
+
+  TRACE_END("poll events", poll_start);
+
+  if (graphics->dirty && graphics->window) {
+    TRACE_BEGIN(present_start);
     SDL_UpdateWindowSurface(graphics->window);
+    TRACE_END("SDL_UpdateWindowSurface", present_start);
+    LATENCY_MARK(LATENCY_WAIT_PRESENT, latency_presented);
     graphics->dirty = 0;
   }
 
@@ -278,126 +580,246 @@ int process_queue(struct graphics *graphics) {
 
 void link_vt(struct graphics *graphics, struct vt *vt) { graphics->vt = vt; }
 
-void char_at(struct graphics *graphics, int x, int y, struct cell *cell,
-             int dblwide, int dblheight) {
-  chars_at(graphics, x, y, cell, 1, dblwide, dblheight);
-}
+// Rasterize a glyph's coverage into a new mask.
+static SDL_Surface *rasterize_glyph(struct graphics *graphics,
+                                    const struct cell *cell, unsigned style) {
+  int w = (int)graphics->cellw;
+  int h = (int)graphics->cellh;
+  if (style & GLYPH_DOUBLE) {
+    w *= 2;
+    h *= 2;
+  }
 
-void chars_at(struct graphics *graphics, int x, int y, struct cell *cells, int count, int dblwide, int dblheight) {
-  int font_type = FONT_REGULAR;
+  // two cells wide, so wide characters and overhangs aren't cut off
+  w *= 2;
 
-  int cellw = (int) graphics->cellw;
-  int cellh = (int) graphics->cellh;
+  SDL_Surface *mask =
+      SDL_CreateRGBSurfaceWithFormat(0, w, h, 32, SDL_PIXELFORMAT_ARGB8888);
+  if (!mask) {
+    fprintf(stderr, "nihterm: failed to create glyph mask: %s\n",
+            SDL_GetError());
+    return NULL;
+  }
 
-  int srcw = cellw;
-  int srch = cellh;
+  SDL_LockSurface(mask);
 
-  if (dblheight) {
-    srch *= 2;
-    srcw *= 2;
+  cairo_surface_t *cairo_surface = cairo_image_surface_create_for_data(
+      mask->pixels, CAIRO_FORMAT_ARGB32, w, h, mask->pitch);
+  cairo_t *cr = cairo_create(cairo_surface);
 
-    // destination is widened and heightened
-    cellw *= 2;
-    cellh *= 2;
+  PangoLayout *layout = pango_cairo_create_layout(cr);
 
-    font_type = FONT_DOUBLE;
-  } else if (dblwide) {
-    // destination is only widened
-    cellw *= 2;
+  PangoAttrList *attrs = pango_attr_list_new();
+  if (style & GLYPH_BOLD) {
+    pango_attr_list_insert(attrs, pango_attr_weight_new(PANGO_WEIGHT_BOLD));
+  }
+  if (style & GLYPH_ITALIC) {
+    pango_attr_list_insert(attrs, pango_attr_style_new(PANGO_STYLE_ITALIC));
+  }
+
+  char text[4 * (1 + CELL_MAX_COMBINING)];
+  size_t text_len = utf8_encode(cell->cp, text);
+  for (int j = 0; j < CELL_MAX_COMBINING && cell->combining[j]; ++j) {
+    text_len += utf8_encode(cell->combining[j], text + text_len);
+  }
 
-    // double-wide source
-    srch *= 2;
-    srcw *= 2;
+  pango_layout_set_attributes(layout, attrs);
+  pango_layout_set_font_description(
+      layout, graphics->font[(style & GLYPH_DOUBLE) ? FONT_DOUBLE : FONT_REGULAR]);
+  pango_layout_set_text(layout, text, (int)text_len);
+  pango_attr_list_unref(attrs);
 
-    // we use the double font but it'll get scaled down to half vertical size
-    // this should look better than the small font scaled _up_ though
-    font_type = FONT_DOUBLE;
+  cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+  cairo_set_source_rgba(cr, 1.0, 1.0, 1.0, 1.0);
+  cairo_move_to(cr, 0, 0);
+  pango_cairo_show_layout(cr, layout);
+  g_object_unref(layout);
+
+  cairo_destroy(cr);
+  cairo_surface_flush(cairo_surface);
+  cairo_surface_destroy(cairo_surface);
+
+  // cairo leaves premultiplied white; make the color plain white so tinting
+  // and blending each apply the coverage once
+  for (int y = 0; y < h; ++y) {
+    uint32_t *row = (uint32_t *)(void *)((uint8_t *)mask->pixels +
+                                         (size_t)y * (size_t)mask->pitch);
+    for (int x = 0; x < w; ++x) {
+      row[x] = (row[x] & 0xFF000000u) | 0x00FFFFFFu;
+    }
   }
-  
-  SDL_Surface *surface =
-    SDL_CreateRGBSurface(0, srcw * count, srch, 32, 0, 0, 0, 0);
 
-  SDL_LockSurface(surface);
+  SDL_UnlockSurface(mask);
 
-  void *pixels = surface->pixels;
-  int pitch = surface->pitch;
+  SDL_SetSurfaceBlendMode(mask, SDL_BLENDMODE_BLEND);
 
-  cairo_surface_t *cairo_surface = cairo_image_surface_create_for_data(pixels, CAIRO_FORMAT_ARGB32, srcw * count, srch, pitch);
+  return mask;
+}
 
-  cairo_t *cr = cairo_create(cairo_surface);
+static SDL_Surface *glyph_mask(struct graphics *graphics,
+                               const struct cell *cell, unsigned style) {
+  uint32_t hash = cell->cp * 0x9E3779B1u;
+  for (int j = 0; j < CELL_MAX_COMBINING; ++j) {
+    hash ^= cell->combining[j] * 0x85EBCA77u;
+  }
+  hash ^= style * 0xC2B2AE3Du;
+  hash ^= hash >> 15;
+
+  struct glyph **bucket = &graphics->glyphs[hash % GLYPH_CACHE_BUCKETS];
+  for (struct glyph *glyph = *bucket; glyph; glyph = glyph->next) {
+    if (glyph->cp == cell->cp && glyph->style == style &&
+        !memcmp(glyph->combining, cell->combining, sizeof(glyph->combining))) {
+      return glyph->mask;
+    }
+  }
 
-  cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
-  if (graphics->inverted) {
-    cairo_set_source_rgba(cr, 1.0, 1.0, 1.0, 1.0);
-  } else {
-    cairo_set_source_rgba(cr, 0.0, 0.0, 0.0, 1.0);
+  if (graphics->num_glyphs >= GLYPH_CACHE_MAX) {
+    glyph_cache_flush(graphics);
   }
 
-  cairo_rectangle(cr, count * cellw, 0, cellw, cellh);
-  cairo_fill(cr);
-    
-  for (int i = 0; i < count; ++i) {
-    PangoLayout *layout = pango_cairo_create_layout(cr);
+  SDL_Surface *mask = rasterize_glyph(graphics, cell, style);
+  if (!mask) {
+    return NULL;
+  }
 
-    struct cell *cell = cells + i;
+  struct glyph *glyph = (struct glyph *)calloc(1, sizeof(struct glyph));
+  glyph->cp = cell->cp;
+  memcpy(glyph->combining, cell->combining, sizeof(glyph->combining));
+  glyph->style = style;
+  glyph->mask = mask;
+  glyph->next = *bucket;
+  *bucket = glyph;
+  ++graphics->num_glyphs;
 
-    PangoAttrList *attrs = pango_attr_list_new();
-    if (cell->attr.bold) {
-      PangoAttribute *attr = pango_attr_weight_new(PANGO_WEIGHT_BOLD);
-      pango_attr_list_insert(attrs, attr);
-    }
-    if (cell->attr.underline) {
-      PangoAttribute *attr = pango_attr_underline_new(PANGO_UNDERLINE_SINGLE);
-      pango_attr_list_insert(attrs, attr);
-    }
+  return mask;
+}
 
-    pango_layout_set_attributes(layout, attrs);
-    pango_layout_set_font_description(layout, graphics->font[font_type]);
-    pango_layout_set_text(layout, cell->cp, cell->cp_len);
-    pango_attr_list_unref(attrs);
-
-    // fix bg color for reversed cell
-    if (cell->attr.reverse) {
-      cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
-      if (graphics->inverted) {
-        cairo_set_source_rgba(cr, 0.0, 0.0, 0.0, 1.0);
-      } else {
-        cairo_set_source_rgba(cr, 1.0, 1.0, 1.0, 1.0);
-      }
+static uint32_t resolve_color(struct graphics *graphics, uint32_t color,
+                              uint32_t def) {
+  switch (COLOR_TAG(color)) {
+  case COLOR_INDEXED_TAG:
+    return graphics->palette[color & 0xFF];
+  case COLOR_RGB_TAG:
+    return color & 0xFFFFFF;
+  default:
+    return def;
+  }
+}
 
-      cairo_rectangle(cr, count * cellw, 0, cellw, cellh);
-      cairo_fill(cr);
-    }
+// Work out the 0xRRGGBB foreground and background for a cell.
+static void cell_colors(struct graphics *graphics, const struct cellattr *attr,
+                        uint32_t *fg, uint32_t *bg) {
+  uint32_t def_fg = graphics->inverted ? DEFAULT_BG : DEFAULT_FG;
+  uint32_t def_bg = graphics->inverted ? DEFAULT_FG : DEFAULT_BG;
 
-    cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
-    if (cell->attr.reverse ^ graphics->inverted) {
-      cairo_set_source_rgba(cr, 0.0, 0.0, 0.0, 1.0);
-    } else {
-      cairo_set_source_rgba(cr, 1.0, 1.0, 1.0, 1.0);
-    }
+  *fg = resolve_color(graphics, attr->fg, def_fg);
+  *bg = resolve_color(graphics, attr->bg, def_bg);
 
-    cairo_move_to(cr, i * srcw, 0);
+  if (attr->flags & ATTR_REVERSE) {
+    uint32_t tmp = *fg;
+    *fg = *bg;
+    *bg = tmp;
+  }
 
-    pango_cairo_show_layout(cr, layout);
-    g_object_unref(layout);
+  if (attr->flags & ATTR_DIM) {
+    *fg = (*fg >> 1) & 0x7F7F7F;
   }
 
-  cairo_destroy(cr);
+  if (attr->flags & ATTR_HIDDEN) {
+    *fg = *bg;
+  }
+}
 
-  cairo_surface_destroy(cairo_surface);
+static Uint32 map_color(SDL_Surface *surface, uint32_t color) {
+  return SDL_MapRGB(surface->format, (Uint8)(color >> 16), (Uint8)(color >> 8),
+                    (Uint8)color);
+}
+
+void char_at(struct graphics *graphics, int x, int y, const struct cell *cell,
+             const struct cellattr *attrs, int dblwide, int dblheight) {
+  chars_at(graphics, x, y, cell, attrs, 1, dblwide, dblheight);
+}
+
+void chars_at(struct graphics *graphics, int x, int y, const struct cell *cells,
+              const struct cellattr *attrs, int count, int dblwide,
+              int dblheight) {
+  TRACE_BEGIN(trace_start);
+
+  SDL_Surface *surface = graphics->surface;
+
+  int cellh = (int)graphics->cellh;
 
-  SDL_UnlockSurface(surface);
+  // double width and double height rows draw each cell twice as wide, from
+  // glyphs rasterized at twice the size
+  int cellw = (int)graphics->cellw;
+  unsigned base_style = 0;
+  if (dblwide || dblheight) {
+    cellw *= 2;
+    base_style = GLYPH_DOUBLE;
+  }
 
-  SDL_Rect target = {(int)(x * cellw), (int)(y * (int)graphics->cellh), count * cellw,
-                     (int)graphics->cellh};
+  int top = y * cellh;
+
+  // backgrounds first, so glyphs overhanging the next cell aren't painted over
+  for (int i = 0; i < count; ++i) {
+    uint32_t fg, bg;
+    cell_colors(graphics, &attrs[cells[i].attr], &fg, &bg);
 
-  SDL_Rect source = {0, dblheight == 2 ? (int)graphics->cellh : 0, count * cellw,
-                     dblwide ? srch : (int)graphics->cellh};
+    SDL_Rect rect = {(x + i) * cellw, top, cellw, cellh};
+    SDL_FillRect(surface, &rect, map_color(surface, bg));
+  }
+
+  for (int i = 0; i < count; ++i) {
+    const struct cell *cell = &cells[i];
+    const struct cellattr *attr = &attrs[cell->attr];
 
-  SDL_BlitSurface(surface, &source, graphics->surface, &target);
-  SDL_FreeSurface(surface);
+    uint32_t fg, bg;
+    cell_colors(graphics, attr, &fg, &bg);
+
+    int left = (x + i) * cellw;
+
+    if (cell->cp && cell->cp != ' ' && !(attr->flags & ATTR_HIDDEN)) {
+      unsigned style = base_style;
+      if (attr->flags & ATTR_BOLD) {
+        style |= GLYPH_BOLD;
+      }
+      if (attr->flags & ATTR_ITALIC) {
+        style |= GLYPH_ITALIC;
+      }
+
+      SDL_Surface *mask = glyph_mask(graphics, cell, style);
+      if (mask) {
+        SDL_SetSurfaceColorMod(mask, (Uint8)(fg >> 16), (Uint8)(fg >> 8),
+                               (Uint8)fg);
+
+        SDL_Rect target = {left, top, mask->w, cellh};
+        if (dblheight) {
+          // top or bottom half of the double size glyph
+          SDL_Rect source = {0, dblheight == 2 ? cellh : 0, mask->w, cellh};
+          SDL_BlitSurface(mask, &source, surface, &target);
+        } else if (dblwide) {
+          // double size glyph squashed to a single row
+          SDL_BlitScaled(mask, NULL, surface, &target);
+        } else {
+          SDL_BlitSurface(mask, NULL, surface, &target);
+        }
+      }
+    }
+
+    // lines are drawn rather than rasterized so glyphs can be shared
+    if ((attr->flags & ATTR_UNDERLINE) && dblheight != 1) {
+      SDL_Rect line = {left, top + cellh - 2, cellw, 1};
+      SDL_FillRect(surface, &line, map_color(surface, fg));
+    }
+    if ((attr->flags & ATTR_STRIKE) && !dblheight) {
+      SDL_Rect line = {left, top + cellh / 2, cellw, 1};
+      SDL_FillRect(surface, &line, map_color(surface, fg));
+    }
+  }
 
   graphics->dirty = 1;
+
+  TRACE_END("chars_at", trace_start);
 }
 
 void graphics_clear(struct graphics *graphics, int x, int y, int w, int h) {
@@ -419,6 +841,13 @@ void graphics_resize(struct graphics *graphics, int cols, int rows) {
   graphics->xdim = new_xdim;
   graphics->ydim = new_ydim;
 
+  if (!graphics->window) {
+    SDL_FreeSurface(graphics->surface);
+    graphics->surface = SDL_CreateRGBSurface(0, (int)new_xdim, (int)new_ydim,
+                                             32, 0, 0, 0, 0);
+    return;
+  }
+
   SDL_SetWindowSize(graphics->window, (int)new_xdim, (int)new_ydim);
 
   // resize invalidates the existing surface
@@ -429,3 +858,55 @@ void graphics_invert(struct graphics *graphics, int invert) {
   graphics->inverted = invert;
   graphics->dirty = 1;
 }
+
+void graphics_draw_image(struct graphics *graphics, const uint32_t *pixels,
+                         int stride, int w, int h, int x, int y) {
+  TRACE_BEGIN(trace_start);
+
+  // wraps the pixels without copying them
+  SDL_Surface *image = SDL_CreateRGBSurfaceWithFormatFrom(
+      (void *)(uintptr_t)pixels, w, h, 32, stride * 4,
+      SDL_PIXELFORMAT_ARGB8888);
+  if (!image) {
+    fprintf(stderr, "nihterm: failed to wrap image: %s\n", SDL_GetError());
+    return;
+  }
+
+  SDL_SetSurfaceBlendMode(image, SDL_BLENDMODE_BLEND);
+
+  SDL_Rect target = {x, y, w, h};
+  SDL_BlitSurface(image, NULL, graphics->surface, &target);
+  SDL_FreeSurface(image);
+
+  graphics->dirty = 1;
+
+  TRACE_END("draw_image", trace_start);
+}
+
+void graphics_set_title(struct graphics *graphics, const char *title) {
+  if (graphics->window) {
+    SDL_SetWindowTitle(graphics->window, title);
+  }
+}
+
+void graphics_set_clipboard(struct graphics *graphics, const char *text) {
+  if (graphics->window) {
+    SDL_SetClipboardText(text);
+  }
+}
+
+char *graphics_get_clipboard(struct graphics *graphics) {
+  if (!graphics->window || !SDL_HasClipboardText()) {
+    return NULL;
+  }
+
+  // SDL's copy has to be released with SDL_free
+  char *text = SDL_GetClipboardText();
+  if (!text) {
+    return NULL;
+  }
+
+  char *copy = strdup(text);
+  SDL_free(text);
+  return copy;
+}
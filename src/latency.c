@@ -0,0 +1,158 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <nihterm/latency.h>
+#include <nihterm/trace.h>
+
+// Each power of two is split into 2^HIST_SUB_BITS linear sub-buckets, which
+// keeps every recorded value within ~3% of its true value.
+#define HIST_SUB_BITS 5
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+// measurements with no echo by now are abandoned (e.g. keys that print
+// nothing)
+#define LATENCY_TIMEOUT_NS 2000000000ULL
+
+struct histogram {
+  const char *name;
+  uint64_t counts[HIST_BUCKETS];
+  uint64_t total;
+  uint64_t min;
+  uint64_t max;
+};
+
+enum {
+  HIST_KEY_TO_WRITE,
+  HIST_WRITE_TO_READ,
+  HIST_READ_TO_DAMAGE,
+  HIST_DAMAGE_TO_PRESENT,
+  HIST_TOTAL,
+  HIST_COUNT,
+};
+
+enum latency_stage latency_stage = LATENCY_IDLE;
+
+static struct histogram histograms[HIST_COUNT] = {
+    {.name = "key -> pty write"},
+    {.name = "pty write -> read"},
+    {.name = "read -> damage"},
+    {.name = "damage -> present"},
+    {.name = "key -> present"},
+};
+
+// timestamp of each stage of the in-flight measurement
+static uint64_t stamps[HIST_COUNT];
+
+static unsigned hist_index(uint64_t value) {
+  if (value < HIST_SUB_COUNT) {
+    return (unsigned)value;
+  }
+
+  unsigned msb = 63 - (unsigned)__builtin_clzll(value);
+  unsigned shift = msb - HIST_SUB_BITS;
+  unsigned sub = (unsigned)(value >> shift) - HIST_SUB_COUNT;
+  return (shift + 1) * HIST_SUB_COUNT + sub;
+}
+
+static uint64_t hist_value(unsigned index) {
+  if (index < HIST_SUB_COUNT) {
+    return index;
+  }
+
+  unsigned shift = index / HIST_SUB_COUNT - 1;
+  uint64_t sub = index % HIST_SUB_COUNT + HIST_SUB_COUNT;
+  return sub << shift;
+}
+
+static void hist_record(struct histogram *hist, uint64_t value) {
+  ++hist->counts[hist_index(value)];
+  if (!hist->total || value < hist->min) {
+    hist->min = value;
+  }
+  if (value > hist->max) {
+    hist->max = value;
+  }
+  ++hist->total;
+}
+
+static uint64_t hist_percentile(struct histogram *hist, double pct) {
+  uint64_t target = (uint64_t)((double)hist->total * pct / 100.0);
+  if (target >= hist->total) {
+    return hist->max;
+  }
+
+  uint64_t seen = 0;
+  for (unsigned i = 0; i < HIST_BUCKETS; ++i) {
+    seen += hist->counts[i];
+    if (seen > target) {
+      return hist_value(i);
+    }
+  }
+
+  return hist->max;
+}
+
+static void advance(enum latency_stage next, int stage) {
+  uint64_t now = trace_now();
+  hist_record(&histograms[stage], now - stamps[stage]);
+  if (stage + 1 < HIST_TOTAL) {
+    stamps[stage + 1] = now;
+  }
+  latency_stage = next;
+}
+
+void latency_input(uint64_t age_ns) {
+  uint64_t now = trace_now();
+  if (latency_stage != LATENCY_IDLE) {
+    if (now - stamps[HIST_KEY_TO_WRITE] < LATENCY_TIMEOUT_NS) {
+      // already following a key
+      return;
+    }
+  }
+
+  stamps[HIST_KEY_TO_WRITE] = now - age_ns;
+  stamps[HIST_TOTAL] = stamps[HIST_KEY_TO_WRITE];
+  latency_stage = LATENCY_WAIT_WRITE;
+}
+
+void latency_written(void) {
+  if (latency_stage == LATENCY_WAIT_WRITE) {
+    advance(LATENCY_WAIT_READ, HIST_KEY_TO_WRITE);
+  }
+}
+
+void latency_read(void) {
+  if (latency_stage == LATENCY_WAIT_READ) {
+    advance(LATENCY_WAIT_DAMAGE, HIST_WRITE_TO_READ);
+  }
+}
+
+void latency_damaged(void) {
+  if (latency_stage == LATENCY_WAIT_DAMAGE) {
+    advance(LATENCY_WAIT_PRESENT, HIST_READ_TO_DAMAGE);
+  }
+}
+
+void latency_presented(void) {
+  if (latency_stage == LATENCY_WAIT_PRESENT) {
+    advance(LATENCY_IDLE, HIST_DAMAGE_TO_PRESENT);
+    hist_record(&histograms[HIST_TOTAL], trace_now() - stamps[HIST_TOTAL]);
+  }
+}
+
+void latency_dump(FILE *fp) {
+  fprintf(fp, "%-20s %8s %10s %10s %10s %10s %10s %10s\n", "latency (us)",
+          "samples", "min", "p50", "p90", "p99", "p99.9", "max");
+  for (int i = 0; i < HIST_COUNT; ++i) {
+    struct histogram *hist = &histograms[i];
+    fprintf(fp, "%-20s %8llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+            hist->name, (unsigned long long)hist->total,
+            (double)hist->min / 1e3, (double)hist_percentile(hist, 50) / 1e3,
+            (double)hist_percentile(hist, 90) / 1e3,
+            (double)hist_percentile(hist, 99) / 1e3,
+            (double)hist_percentile(hist, 99.9) / 1e3,
+            (double)hist->max / 1e3);
+  }
+}
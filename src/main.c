@@ -7,7 +7,6 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <termios.h>
@@ -16,6 +15,9 @@
 #include <time.h>
 
 #include <nihterm/gfx.h>
+#include <nihterm/latency.h>
+#include <nihterm/record.h>
+#include <nihterm/trace.h>
 #include <nihterm/vt.h>
 
 // SIGCHLD handler
@@ -33,9 +35,52 @@ void sigchld(int sig) {
   }
 }
 
+// set by SIGUSR1, the trace is written from the main loop
+static volatile sig_atomic_t trace_dump_requested = 0;
+
+void sigusr1(int sig) {
+  (void) sig;
+  trace_dump_requested = 1;
+}
+
+// set by SIGUSR2, latency stats are printed from the main loop
+static volatile sig_atomic_t stats_dump_requested = 0;
+
+void sigusr2(int sig) {
+  (void) sig;
+  stats_dump_requested = 1;
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr, "usage: %s [-c] [-r recording] [-t trace]\n", argv0);
+  fprintf(stderr, "  -c       let programs read the clipboard with OSC 52\n");
+  fprintf(stderr, "  -r FILE  record all PTY output to FILE for nihterm-replay\n");
+  fprintf(stderr, "  -t FILE  trace phases, written to FILE as Chrome JSON on SIGUSR1 and at exit\n");
+  fprintf(stderr, "send SIGUSR2 to print keypress-to-photon latency stats to stderr\n");
+}
+
 int main(int argc, char *argv[]) {
-  (void) argc;
-  (void) argv;
+  const char *record_path = NULL;
+  const char *trace_path = NULL;
+  int clipboard_read = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "cr:t:h")) != -1) {
+    switch (opt) {
+    case 'c':
+      clipboard_read = 1;
+      break;
+    case 'r':
+      record_path = optarg;
+      break;
+    case 't':
+      trace_path = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
 
   setsid();
 
@@ -60,9 +105,24 @@ int main(int argc, char *argv[]) {
 
   printf("pty is %s\n", name);
 
+  // replies from the parser are drained by the event loop, so never let a
+  // write to the pty block
+  int flags = fcntl(pty, F_GETFL);
+  if (flags < 0 || fcntl(pty, F_SETFL, flags | O_NONBLOCK) < 0) {
+    fprintf(stderr, "nihterm: could not make pty non-blocking: %s\n", strerror(errno));
+    return 1;
+  }
+
   // spin up our SIGCHLD reaper now that we've configured the PTY
   signal(SIGCHLD, sigchld);
 
+  if (trace_path) {
+    trace_enable(1);
+    signal(SIGUSR1, sigusr1);
+  }
+
+  signal(SIGUSR2, sigusr2);
+
   pid_t child = fork();
   if (child == -1) {
     fprintf(stderr, "nihterm: fork failed: %s", strerror(errno));
@@ -87,9 +147,7 @@ int main(int argc, char *argv[]) {
 
     setenv("TERM", "vt102", 1);
 
-    // TODO(miselin): implement UTF8
-    // setenv("LC_ALL", "en_US.UTF-8", 1);
-    setenv("LC_ALL", "C", 1);
+    setenv("LC_ALL", "C.UTF-8", 1);
 
     // execl("/usr/bin/vttest", "/usr/bin/vttest", "-l", NULL);
     execl("/bin/bash", "bash", NULL);
@@ -111,14 +169,22 @@ int main(int argc, char *argv[]) {
   }
 
   vt_set_graphics(vt, graphics);
+  vt_allow_clipboard_read(vt, clipboard_read);
+
+  // tell the shell how big the terminal is; later window resizes do the same
+  vt_resize(vt, 24, 80);
 
-  struct winsize pty_size;
-  memset(&pty_size, 0, sizeof(pty_size));
-  pty_size.ws_col = 80;
-  pty_size.ws_row = 25;
-  pty_size.ws_xpixel = (uint16_t)window_width(graphics);
-  pty_size.ws_ypixel = (uint16_t)window_height(graphics);
-  ioctl(pty, TIOCSWINSZ, &pty_size);
+  // the geometry last written to the recording
+  int rec_rows = 0, rec_cols = 0;
+  vt_size(vt, &rec_rows, &rec_cols);
+
+  struct recorder *recorder = NULL;
+  if (record_path) {
+    recorder = recorder_open(record_path, rec_rows, rec_cols);
+    if (!recorder) {
+      return 1;
+    }
+  }
 
   const size_t maxBuffSize = 32768;
   char *buffer = (char *)malloc(maxBuffSize);
@@ -127,18 +193,30 @@ int main(int argc, char *argv[]) {
     FD_ZERO(&readfds);
     FD_SET(pty, &readfds);
 
+    fd_set writefds;
+    FD_ZERO(&writefds);
+    if (vt_pending(vt)) {
+      FD_SET(pty, &writefds);
+    }
+
     // we'll block for up to 20 ms looking for PTY data
     // this delay affects input latency.
     struct timeval tv;
     tv.tv_sec = 0;
     tv.tv_usec = 20000;
-    int ready = select(pty + 1, &readfds, NULL, NULL, &tv);
+    int ready = select(pty + 1, &readfds, &writefds, NULL, &tv);
     if (ready > 0) {
+      if (FD_ISSET(pty, &writefds)) {
+        vt_flush(vt);
+      }
+
       if (FD_ISSET(pty, &readfds)) {
+        TRACE_BEGIN(read_start);
         ssize_t len = read(pty, buffer, maxBuffSize);
+        TRACE_END("pty read", read_start);
         if (len < 0) {
           // not a real error
-          if (errno == EINTR) {
+          if (errno == EINTR || errno == EAGAIN) {
             continue;
           }
 
@@ -154,12 +232,43 @@ int main(int argc, char *argv[]) {
           break;
         }
 
+        // only a read that got data is a sample; the pty is non-blocking, so
+        // select can wake us for nothing
+        LATENCY_MARK(LATENCY_WAIT_READ, latency_read);
+
         buffer[len] = 0;
 
+        if (recorder) {
+          // the window may have been resized since the last read
+          int rows = 0, cols = 0;
+          vt_size(vt, &rows, &cols);
+          if (rows != rec_rows || cols != rec_cols) {
+            recorder_resize(recorder, rows, cols);
+            rec_rows = rows;
+            rec_cols = cols;
+          }
+
+          recorder_write(recorder, buffer, (size_t)len);
+        }
+
         vt_process(vt, buffer, (size_t) len);
+
+        // send any replies the parser generated now if the pty has room,
+        // the rest goes out once select says it's writable
+        vt_flush(vt);
       }
     }
 
+    if (trace_dump_requested) {
+      trace_dump_requested = 0;
+      trace_dump(trace_path);
+    }
+
+    if (stats_dump_requested) {
+      stats_dump_requested = 0;
+      latency_dump(stderr);
+    }
+
     // regardless of what the PTY side did, we'll now handle SDL events
     if (process_queue(graphics)) {
       // TODO(miselin): do we need to send a SIGKILL if the child fails to terminate?
@@ -172,6 +281,14 @@ int main(int argc, char *argv[]) {
 
   free(buffer);
 
+  if (trace_path) {
+    trace_dump(trace_path);
+  }
+
+  if (recorder) {
+    recorder_close(recorder);
+  }
+
   vt_destroy(vt);
   destroy_graphics(graphics);
 
@@ -0,0 +1,233 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <nihterm/record.h>
+
+#define print_error(...) fprintf(stderr, "nihterm: " __VA_ARGS__);
+
+#define RECORD_MAGIC "NIHREC"
+#define RECORD_MAGIC_LEN 6
+#define RECORD_VERSION 2
+// version 1 had no resize records, so reads the same way
+#define RECORD_VERSION_MIN 1
+
+// magic, version, reserved byte, rows (u16 LE), cols (u16 LE)
+#define RECORD_HEADER_LEN 12
+
+struct recorder {
+  FILE *fp;
+  uint64_t start;
+  uint64_t last;
+};
+
+struct playback {
+  FILE *fp;
+  int rows;
+  int cols;
+  uint64_t timestamp;
+
+  char *buffer;
+  size_t buffer_size;
+};
+
+static uint64_t monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int write_varint(FILE *fp, uint64_t value) {
+  unsigned char buf[10];
+  size_t len = 0;
+  do {
+    unsigned char byte = (unsigned char)(value & 0x7F);
+    value >>= 7;
+    if (value) {
+      byte |= 0x80;
+    }
+    buf[len++] = byte;
+  } while (value);
+
+  return fwrite(buf, 1, len, fp) == len ? 0 : -1;
+}
+
+static int read_varint(FILE *fp, uint64_t *value) {
+  *value = 0;
+  for (unsigned shift = 0; shift < 64; shift += 7) {
+    int c = fgetc(fp);
+    if (c == EOF) {
+      return -1;
+    }
+
+    *value |= (uint64_t)(c & 0x7F) << shift;
+    if (!(c & 0x80)) {
+      return 0;
+    }
+  }
+
+  // too many continuation bytes
+  return -1;
+}
+
+struct recorder *recorder_open(const char *path, int rows, int cols) {
+  FILE *fp = fopen(path, "wb");
+  if (!fp) {
+    print_error("failed to open recording '%s': %s\n", path, strerror(errno));
+    return NULL;
+  }
+
+  unsigned char header[RECORD_HEADER_LEN] = {0};
+  memcpy(header, RECORD_MAGIC, RECORD_MAGIC_LEN);
+  header[6] = RECORD_VERSION;
+  header[8] = (unsigned char)(rows & 0xFF);
+  header[9] = (unsigned char)((rows >> 8) & 0xFF);
+  header[10] = (unsigned char)(cols & 0xFF);
+  header[11] = (unsigned char)((cols >> 8) & 0xFF);
+
+  if (fwrite(header, 1, sizeof(header), fp) != sizeof(header)) {
+    print_error("failed to write recording header: %s\n", strerror(errno));
+    fclose(fp);
+    return NULL;
+  }
+
+  struct recorder *rec = (struct recorder *)calloc(1, sizeof(struct recorder));
+  rec->fp = fp;
+  rec->start = monotonic_ns();
+  rec->last = rec->start;
+  return rec;
+}
+
+int recorder_write(struct recorder *rec, const char *data, size_t length) {
+  // a length of 0 means a resize
+  if (!length) {
+    return 0;
+  }
+
+  uint64_t now = monotonic_ns();
+  uint64_t delta = now - rec->last;
+  rec->last = now;
+
+  if (write_varint(rec->fp, delta) || write_varint(rec->fp, length) ||
+      fwrite(data, 1, length, rec->fp) != length) {
+    print_error("failed to write recording: %s\n", strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+int recorder_resize(struct recorder *rec, int rows, int cols) {
+  uint64_t now = monotonic_ns();
+  uint64_t delta = now - rec->last;
+  rec->last = now;
+
+  if (write_varint(rec->fp, delta) || write_varint(rec->fp, 0) ||
+      write_varint(rec->fp, (uint64_t)rows) ||
+      write_varint(rec->fp, (uint64_t)cols)) {
+    print_error("failed to write recording: %s\n", strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+void recorder_close(struct recorder *rec) {
+  fclose(rec->fp);
+  free(rec);
+}
+
+struct playback *playback_open(const char *path) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    print_error("failed to open recording '%s': %s\n", path, strerror(errno));
+    return NULL;
+  }
+
+  unsigned char header[RECORD_HEADER_LEN];
+  if (fread(header, 1, sizeof(header), fp) != sizeof(header) ||
+      memcmp(header, RECORD_MAGIC, RECORD_MAGIC_LEN) ||
+      header[6] < RECORD_VERSION_MIN || header[6] > RECORD_VERSION) {
+    print_error("'%s' is not a nihterm recording\n", path);
+    fclose(fp);
+    return NULL;
+  }
+
+  struct playback *pb = (struct playback *)calloc(1, sizeof(struct playback));
+  pb->fp = fp;
+  pb->rows = header[8] | (header[9] << 8);
+  pb->cols = header[10] | (header[11] << 8);
+  return pb;
+}
+
+void playback_geometry(struct playback *pb, int *rows, int *cols) {
+  *rows = pb->rows;
+  *cols = pb->cols;
+}
+
+ssize_t playback_next(struct playback *pb, const char **data,
+                      uint64_t *timestamp) {
+  uint64_t delta = 0;
+  uint64_t length = 0;
+
+  do {
+    int c = fgetc(pb->fp);
+    if (c == EOF) {
+      return 0;
+    }
+    ungetc(c, pb->fp);
+
+    if (read_varint(pb->fp, &delta) || read_varint(pb->fp, &length) ||
+        length > SSIZE_MAX) {
+      print_error("corrupt recording\n");
+      return -1;
+    }
+
+    if (!length) {
+      uint64_t rows = 0;
+      uint64_t cols = 0;
+      if (read_varint(pb->fp, &rows) || read_varint(pb->fp, &cols) ||
+          !rows || !cols || rows > INT_MAX || cols > INT_MAX) {
+        print_error("corrupt recording\n");
+        return -1;
+      }
+
+      pb->rows = (int)rows;
+      pb->cols = (int)cols;
+      pb->timestamp += delta;
+    }
+  } while (!length);
+
+  if (length > pb->buffer_size) {
+    char *buffer = (char *)realloc(pb->buffer, (size_t)length);
+    if (!buffer) {
+      print_error("record of %llu bytes is too large\n",
+                  (unsigned long long)length);
+      return -1;
+    }
+
+    pb->buffer = buffer;
+    pb->buffer_size = (size_t)length;
+  }
+
+  if (fread(pb->buffer, 1, (size_t)length, pb->fp) != length) {
+    print_error("truncated recording\n");
+    return -1;
+  }
+
+  pb->timestamp += delta;
+
+  *data = pb->buffer;
+  *timestamp = pb->timestamp;
+  return (ssize_t)length;
+}
+
+void playback_close(struct playback *pb) {
+  fclose(pb->fp);
+  free(pb->buffer);
+  free(pb);
+}
@@ -0,0 +1,189 @@
+// Replays a PTY recording made with `nihterm -r` through the VT and renderer,
+// reporting throughput and per-phase timing. Useful as a repeatable
+// performance fixture for real-world sessions.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <nihterm/gfx.h>
+#include <nihterm/record.h>
+#include <nihterm/trace.h>
+#include <nihterm/vt.h>
+
+struct phase {
+  uint64_t total;
+  uint64_t max;
+};
+
+static uint64_t monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void phase_add(struct phase *phase, uint64_t start) {
+  uint64_t elapsed = monotonic_ns() - start;
+  phase->total += elapsed;
+  if (elapsed > phase->max) {
+    phase->max = elapsed;
+  }
+}
+
+static void phase_report(const char *name, struct phase *phase,
+                         uint64_t frames) {
+  double avg = frames ? (double)phase->total / (double)frames : 0.0;
+  printf("  %-8s total %10.3f ms  avg %8.3f us  max %8.3f us\n", name,
+         (double)phase->total / 1e6, avg / 1e3, (double)phase->max / 1e3);
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr, "usage: %s [-f] [-H] [-t trace] recording\n", argv0);
+  fprintf(stderr, "  -f       replay as fast as possible instead of original pace\n");
+  fprintf(stderr, "  -H       headless, render to an offscreen surface\n");
+  fprintf(stderr, "  -t FILE  write a Chrome trace of the replay to FILE\n");
+}
+
+int main(int argc, char *argv[]) {
+  int fast = 0;
+  int headless = 0;
+  const char *trace_path = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "fHt:h")) != -1) {
+    switch (opt) {
+    case 'f':
+      fast = 1;
+      break;
+    case 'H':
+      headless = 1;
+      break;
+    case 't':
+      trace_path = optarg;
+      trace_enable(1);
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  if (optind >= argc) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  struct playback *pb = playback_open(argv[optind]);
+  if (!pb) {
+    return 1;
+  }
+
+  int rows = 0, cols = 0;
+  playback_geometry(pb, &rows, &cols);
+
+  // replies generated by the VT have nowhere to go
+  int sink = open("/dev/null", O_WRONLY);
+  if (sink < 0) {
+    fprintf(stderr, "nihterm-replay: open /dev/null: %s\n", strerror(errno));
+    return 1;
+  }
+
+  struct vt *vt = vt_create(sink, rows, cols);
+  if (!vt) {
+    fprintf(stderr, "nihterm-replay: failed to initialize vt\n");
+    return 1;
+  }
+
+  struct graphics *graphics =
+      headless ? create_graphics_offscreen(cols, rows) : create_graphics();
+  if (!graphics) {
+    fprintf(stderr, "nihterm-replay: failed to initialize graphics\n");
+    return 1;
+  }
+
+  vt_set_graphics(vt, graphics);
+
+  struct phase process = {0, 0};
+  struct phase render = {0, 0};
+  struct phase present = {0, 0};
+
+  uint64_t bytes = 0;
+  uint64_t frames = 0;
+
+  const char *data = NULL;
+  uint64_t timestamp = 0;
+  ssize_t len = 0;
+
+  uint64_t start = monotonic_ns();
+  while ((len = playback_next(pb, &data, &timestamp)) > 0) {
+    if (!fast) {
+      uint64_t due = start + timestamp;
+      struct timespec ts;
+      ts.tv_sec = (time_t)(due / 1000000000ULL);
+      ts.tv_nsec = (long)(due % 1000000000ULL);
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+             EINTR) {
+      }
+    }
+
+    // the window was resized before this read
+    int new_rows = 0, new_cols = 0;
+    playback_geometry(pb, &new_rows, &new_cols);
+    if (new_rows != rows || new_cols != cols) {
+      rows = new_rows;
+      cols = new_cols;
+      vt_resize(vt, rows, cols);
+      graphics_resize(graphics, cols, rows);
+    }
+
+    // one recorded read is one trip around the main loop, so one frame
+    uint64_t t = monotonic_ns();
+    vt_process(vt, data, (size_t)len);
+    vt_flush(vt);
+    phase_add(&process, t);
+
+    t = monotonic_ns();
+    vt_render(vt);
+    phase_add(&render, t);
+
+    t = monotonic_ns();
+    if (process_queue(graphics)) {
+      break;
+    }
+    phase_add(&present, t);
+
+    bytes += (uint64_t)len;
+    ++frames;
+  }
+
+  uint64_t elapsed = monotonic_ns() - start;
+
+  double seconds = (double)elapsed / 1e9;
+  printf("replayed %llu bytes in %llu frames over %.3f s (%s)\n",
+         (unsigned long long)bytes, (unsigned long long)frames, seconds,
+         fast ? "fast" : "original pace");
+  printf("  throughput %.2f MB/s, %.1f frames/s\n",
+         seconds > 0 ? (double)bytes / seconds / 1e6 : 0.0,
+         seconds > 0 ? (double)frames / seconds : 0.0);
+  phase_report("process", &process, frames);
+  phase_report("render", &render, frames);
+  phase_report("present", &present, frames);
+
+  if (trace_path) {
+    trace_dump(trace_path);
+  }
+
+  playback_close(pb);
+
+  vt_destroy(vt);
+  destroy_graphics(graphics);
+
+  close(sink);
+
+  return len < 0 ? 1 : 0;
+}
@@ -0,0 +1,433 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <nihterm/sixel.h>
+
+enum {
+  SIXEL_GROUND = 0,
+  SIXEL_REPEAT,
+  SIXEL_COLOR,
+  SIXEL_RASTER,
+};
+
+#define SIXEL_MAX_PARAM 99999
+
+// pixels behind transparent sixels when the background isn't transparent
+#define SIXEL_BACKGROUND 0xFF000000u
+
+// VT340 default palette, as RGB percentages
+static const uint8_t default_palette[16][3] = {
+    {0, 0, 0},    {20, 20, 80}, {80, 13, 13}, {20, 80, 20},
+    {80, 20, 80}, {20, 80, 80}, {80, 80, 20}, {53, 53, 53},
+    {26, 26, 26}, {33, 33, 60}, {60, 26, 26}, {33, 60, 33},
+    {60, 33, 60}, {33, 60, 60}, {60, 60, 33}, {80, 80, 80},
+};
+
+static uint32_t rgb_percent(int r, int g, int b) {
+  if (r > 100) {
+    r = 100;
+  }
+  if (g > 100) {
+    g = 100;
+  }
+  if (b > 100) {
+    b = 100;
+  }
+
+  return 0xFF000000u | ((uint32_t)(r * 255 / 100) << 16) |
+         ((uint32_t)(g * 255 / 100) << 8) | (uint32_t)(b * 255 / 100);
+}
+
+static double hue_to_rgb(double m1, double m2, double h) {
+  if (h < 0) {
+    h += 360;
+  } else if (h >= 360) {
+    h -= 360;
+  }
+
+  if (h < 60) {
+    return m1 + (m2 - m1) * h / 60;
+  } else if (h < 180) {
+    return m2;
+  } else if (h < 240) {
+    return m1 + (m2 - m1) * (240 - h) / 60;
+  }
+  return m1;
+}
+
+static uint32_t hls_percent(int hue, int lightness, int saturation) {
+  // DEC puts blue at 0 degrees where the usual HLS model has red
+  double h = (double)((hue + 240) % 360);
+  double l = (double)(lightness > 100 ? 100 : lightness) / 100;
+  double s = (double)(saturation > 100 ? 100 : saturation) / 100;
+
+  double m2 = l <= 0.5 ? l * (1 + s) : l + s - l * s;
+  double m1 = 2 * l - m2;
+
+  int r = (int)(hue_to_rgb(m1, m2, h + 120) * 100 + 0.5);
+  int g = (int)(hue_to_rgb(m1, m2, h) * 100 + 0.5);
+  int b = (int)(hue_to_rgb(m1, m2, h - 120) * 100 + 0.5);
+  return rgb_percent(r, g, b);
+}
+
+void sixel_init(struct sixel_decoder *dec, const char *params) {
+  memset(dec, 0, sizeof(*dec));
+
+  for (int i = 0; i < 16; ++i) {
+    dec->palette[i] = rgb_percent(default_palette[i][0], default_palette[i][1],
+                                  default_palette[i][2]);
+  }
+  dec->color = dec->palette[0];
+
+  // P1 ; P2 ; P3 q - P2 of 1 leaves unset pixels transparent
+  const char *p2 = strchr(params, ';');
+  dec->transparent = p2 && p2[1] == '1';
+}
+
+// Grow the pixel buffer to at least w x h, which are already clipped to the
+// maximum size. Returns 0 on success.
+static int ensure_size(struct sixel_decoder *dec, int w, int h) {
+  if (w <= dec->cap_width && h <= dec->cap_height) {
+    return 0;
+  }
+
+  int cap_w = dec->cap_width ? dec->cap_width : 64;
+  while (cap_w < w) {
+    cap_w *= 2;
+  }
+  if (cap_w > SIXEL_MAX_WIDTH) {
+    cap_w = SIXEL_MAX_WIDTH;
+  }
+
+  int cap_h = dec->cap_height ? dec->cap_height : 48;
+  while (cap_h < h) {
+    cap_h *= 2;
+  }
+  if (cap_h > SIXEL_MAX_HEIGHT) {
+    cap_h = SIXEL_MAX_HEIGHT;
+  }
+
+  uint32_t *pixels =
+      (uint32_t *)calloc((size_t)cap_w * (size_t)cap_h, sizeof(uint32_t));
+  if (!pixels) {
+    return -1;
+  }
+
+  for (int y = 0; y < dec->cap_height; ++y) {
+    memcpy(pixels + (size_t)y * (size_t)cap_w,
+           dec->pixels + (size_t)y * (size_t)dec->cap_width,
+           (size_t)dec->cap_width * sizeof(uint32_t));
+  }
+
+  free(dec->pixels);
+  dec->pixels = pixels;
+  dec->cap_width = cap_w;
+  dec->cap_height = cap_h;
+  return 0;
+}
+
+// Number of the six rows of the current band that fit in the image, and the
+// number of count sixels from x that fit across.
+static int band_rows(struct sixel_decoder *dec) {
+  int rows = SIXEL_MAX_HEIGHT - dec->y;
+  return rows < 0 ? 0 : (rows > 6 ? 6 : rows);
+}
+
+static int band_cols(struct sixel_decoder *dec, size_t count) {
+  int cols = SIXEL_MAX_WIDTH - dec->x;
+  if (cols <= 0) {
+    return 0;
+  }
+  return count < (size_t)cols ? (int)count : cols;
+}
+
+static void extend(struct sixel_decoder *dec, unsigned bits, int rows) {
+  if (dec->x > dec->width) {
+    dec->width = dec->x > SIXEL_MAX_WIDTH ? SIXEL_MAX_WIDTH : dec->x;
+  }
+
+  if (bits) {
+    int top = 31 - __builtin_clz(bits) + 1;
+    if (top > rows) {
+      top = rows;
+    }
+    if (dec->y + top > dec->height) {
+      dec->height = dec->y + top;
+    }
+  }
+}
+
+// Draw a run of sixels, one column each.
+static void draw_sixels(struct sixel_decoder *dec, const char *run,
+                        size_t count) {
+  int rows = band_rows(dec);
+  int cols = band_cols(dec, count);
+
+  if (!rows || !cols || ensure_size(dec, dec->x + cols, dec->y + rows)) {
+    dec->x += (int)count;
+    extend(dec, 0, 0);
+    return;
+  }
+
+  uint32_t *row[6];
+  for (int b = 0; b < 6; ++b) {
+    row[b] = dec->pixels + (size_t)(dec->y + (b < rows ? b : 0)) *
+                               (size_t)dec->cap_width;
+  }
+
+  uint32_t color = dec->color;
+  unsigned mask = (1u << rows) - 1;
+  unsigned seen = 0;
+  int x = dec->x;
+  for (int i = 0; i < cols; ++i, ++x) {
+    unsigned bits = ((unsigned)run[i] - '?') & mask;
+    if (!bits) {
+      continue;
+    }
+
+    seen |= bits;
+    if (bits & 0x01) {
+      row[0][x] = color;
+    }
+    if (bits & 0x02) {
+      row[1][x] = color;
+    }
+    if (bits & 0x04) {
+      row[2][x] = color;
+    }
+    if (bits & 0x08) {
+      row[3][x] = color;
+    }
+    if (bits & 0x10) {
+      row[4][x] = color;
+    }
+    if (bits & 0x20) {
+      row[5][x] = color;
+    }
+  }
+
+  dec->x += (int)count;
+  extend(dec, seen, rows);
+}
+
+// Draw one sixel repeated count times, filling whole spans per row.
+static void fill_sixel(struct sixel_decoder *dec, char c, size_t count) {
+  int rows = band_rows(dec);
+  int cols = band_cols(dec, count);
+  unsigned bits = ((unsigned)c - '?') & ((1u << rows) - 1);
+
+  if (bits && cols && !ensure_size(dec, dec->x + cols, dec->y + rows)) {
+    for (int b = 0; b < rows; ++b) {
+      if (!(bits & (1u << b))) {
+        continue;
+      }
+
+      uint32_t *span = dec->pixels +
+                       (size_t)(dec->y + b) * (size_t)dec->cap_width +
+                       (size_t)dec->x;
+      for (int i = 0; i < cols; ++i) {
+        span[i] = dec->color;
+      }
+    }
+  } else {
+    bits = 0;
+  }
+
+  dec->x += (int)count;
+  extend(dec, bits, rows);
+}
+
+static void finish_params(struct sixel_decoder *dec) {
+  int *params = dec->params;
+  int count = dec->nparams + 1;
+
+  switch (dec->state) {
+  case SIXEL_REPEAT:
+    dec->repeat = params[0] ? params[0] : 1;
+    break;
+  case SIXEL_COLOR: {
+    int index = params[0] % SIXEL_PALETTE_SIZE;
+    if (count >= 5) {
+      if (params[1] == 1) {
+        dec->palette[index] = hls_percent(params[2], params[3], params[4]);
+      } else if (params[1] == 2) {
+        dec->palette[index] = rgb_percent(params[2], params[3], params[4]);
+      }
+    }
+    dec->color = dec->palette[index];
+    break;
+  }
+  case SIXEL_RASTER:
+    // " Pan ; Pad ; Ph ; Pv - the size is a hint we can allocate up front
+    if (count >= 4 && params[2] > 0 && params[3] > 0) {
+      int w = params[2] > SIXEL_MAX_WIDTH ? SIXEL_MAX_WIDTH : params[2];
+      int h = params[3] > SIXEL_MAX_HEIGHT ? SIXEL_MAX_HEIGHT : params[3];
+      if (!ensure_size(dec, w, h)) {
+        if (w > dec->width) {
+          dec->width = w;
+        }
+        if (h > dec->height) {
+          dec->height = h;
+        }
+      }
+    }
+    break;
+  }
+
+  dec->state = SIXEL_GROUND;
+}
+
+static void start_params(struct sixel_decoder *dec, int state) {
+  dec->state = state;
+  dec->nparams = 0;
+  memset(dec->params, 0, sizeof(dec->params));
+}
+
+void sixel_decode(struct sixel_decoder *dec, const char *data, size_t length) {
+  size_t i = 0;
+  while (i < length) {
+    char c = data[i];
+
+    if (dec->state != SIXEL_GROUND) {
+      if (c >= '0' && c <= '9') {
+        int *param = &dec->params[dec->nparams];
+        *param = *param * 10 + (c - '0');
+        if (*param > SIXEL_MAX_PARAM) {
+          *param = SIXEL_MAX_PARAM;
+        }
+        ++i;
+        continue;
+      } else if (c == ';') {
+        if (dec->nparams < 4) {
+          ++dec->nparams;
+        }
+        ++i;
+        continue;
+      }
+
+      // anything else ends the parameters and is handled below
+      finish_params(dec);
+    }
+
+    if (c >= '?' && c <= '~') {
+      if (dec->repeat) {
+        fill_sixel(dec, c, (size_t)dec->repeat);
+        dec->repeat = 0;
+        ++i;
+        continue;
+      }
+
+      // the common case: a run of sixels in the current color
+      size_t end = i + 1;
+      while (end < length && data[end] >= '?' && data[end] <= '~') {
+        ++end;
+      }
+
+      draw_sixels(dec, data + i, end - i);
+      i = end;
+      continue;
+    }
+
+    switch (c) {
+    case '!':
+      // DECGRI - Graphics Repeat Introducer
+      start_params(dec, SIXEL_REPEAT);
+      break;
+    case '#':
+      // DECGCI - Graphics Color Introducer
+      start_params(dec, SIXEL_COLOR);
+      break;
+    case '"':
+      // DECGRA - Set Raster Attributes
+      start_params(dec, SIXEL_RASTER);
+      break;
+    case '$':
+      // DECGCR - Graphics Carriage Return
+      dec->x = 0;
+      break;
+    case '-':
+      // DECGNL - Graphics Next Line
+      dec->x = 0;
+      dec->y += 6;
+      break;
+    }
+
+    ++i;
+  }
+}
+
+struct sixel_image *sixel_finish(struct sixel_decoder *dec) {
+  if (dec->state != SIXEL_GROUND) {
+    finish_params(dec);
+  }
+
+  // sixels that couldn't be drawn still moved the position along
+  if (dec->width > dec->cap_width) {
+    dec->width = dec->cap_width;
+  }
+  if (dec->height > dec->cap_height) {
+    dec->height = dec->cap_height;
+  }
+
+  if (!dec->width || !dec->height || !dec->pixels) {
+    sixel_discard(dec);
+    return NULL;
+  }
+
+  struct sixel_image *image =
+      (struct sixel_image *)malloc(sizeof(struct sixel_image));
+  if (!image) {
+    sixel_discard(dec);
+    return NULL;
+  }
+
+  // squeeze out the unused capacity; rows only move towards the start
+  size_t width = (size_t)dec->width;
+  size_t height = (size_t)dec->height;
+  if (dec->cap_width != dec->width) {
+    for (size_t y = 1; y < height; ++y) {
+      memmove(dec->pixels + y * width,
+              dec->pixels + y * (size_t)dec->cap_width,
+              width * sizeof(uint32_t));
+    }
+  }
+
+  uint32_t *pixels =
+      (uint32_t *)realloc(dec->pixels, width * height * sizeof(uint32_t));
+  if (pixels) {
+    dec->pixels = pixels;
+  }
+
+  if (!dec->transparent) {
+    for (size_t i = 0; i < width * height; ++i) {
+      if (!dec->pixels[i]) {
+        dec->pixels[i] = SIXEL_BACKGROUND;
+      }
+    }
+  }
+
+  image->width = dec->width;
+  image->height = dec->height;
+  image->pixels = dec->pixels;
+
+  dec->pixels = NULL;
+  sixel_discard(dec);
+  return image;
+}
+
+void sixel_discard(struct sixel_decoder *dec) {
+  free(dec->pixels);
+  dec->pixels = NULL;
+  dec->cap_width = 0;
+  dec->cap_height = 0;
+  dec->width = 0;
+  dec->height = 0;
+}
+
+void sixel_image_free(struct sixel_image *image) {
+  if (image) {
+    free(image->pixels);
+    free(image);
+  }
+}
@@ -0,0 +1,126 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <nihterm/trace.h>
+
+#define print_error(...) fprintf(stderr, "nihterm: " __VA_ARGS__);
+
+// spans kept per thread before the oldest are overwritten
+#define TRACE_RING_SIZE 65536
+
+struct trace_event {
+  const char *name;
+  uint64_t start;
+  uint64_t duration;
+};
+
+struct trace_ring {
+  struct trace_event events[TRACE_RING_SIZE];
+  size_t next;
+  size_t count;
+  int tid;
+
+  struct trace_ring *next_ring;
+};
+
+int trace_active = 0;
+
+static __thread struct trace_ring *thread_ring = NULL;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_ring *rings = NULL;
+static int next_tid = 1;
+
+void trace_enable(int enable) { trace_active = enable; }
+
+uint64_t trace_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static struct trace_ring *get_ring(void) {
+  if (thread_ring) {
+    return thread_ring;
+  }
+
+  struct trace_ring *ring =
+      (struct trace_ring *)calloc(1, sizeof(struct trace_ring));
+  if (!ring) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&rings_lock);
+  ring->tid = next_tid++;
+  ring->next_ring = rings;
+  rings = ring;
+  pthread_mutex_unlock(&rings_lock);
+
+  thread_ring = ring;
+  return ring;
+}
+
+void trace_span(const char *name, uint64_t start) {
+  uint64_t end = trace_now();
+
+  struct trace_ring *ring = get_ring();
+  if (!ring) {
+    return;
+  }
+
+  struct trace_event *event = &ring->events[ring->next];
+  event->name = name;
+  event->start = start;
+  event->duration = end - start;
+
+  ring->next = (ring->next + 1) % TRACE_RING_SIZE;
+  if (ring->count < TRACE_RING_SIZE) {
+    ++ring->count;
+  }
+}
+
+int trace_dump(const char *path) {
+  FILE *fp = fopen(path, "w");
+  if (!fp) {
+    print_error("failed to open trace '%s': %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  int pid = (int)getpid();
+  int first = 1;
+
+  fprintf(fp, "{\"traceEvents\":[\n");
+
+  pthread_mutex_lock(&rings_lock);
+  for (struct trace_ring *ring = rings; ring; ring = ring->next_ring) {
+    // oldest first
+    size_t idx = (ring->next + TRACE_RING_SIZE - ring->count) % TRACE_RING_SIZE;
+    for (size_t i = 0; i < ring->count; ++i) {
+      struct trace_event *event = &ring->events[idx];
+      fprintf(fp,
+              "%s{\"name\":\"%s\",\"cat\":\"nihterm\",\"ph\":\"X\","
+              "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d}",
+              first ? "" : ",\n", event->name, (double)event->start / 1e3,
+              (double)event->duration / 1e3, pid, ring->tid);
+      first = 0;
+
+      idx = (idx + 1) % TRACE_RING_SIZE;
+    }
+  }
+  pthread_mutex_unlock(&rings_lock);
+
+  fprintf(fp, "\n],\"displayTimeUnit\":\"ms\"}\n");
+
+  if (fclose(fp)) {
+    print_error("failed to write trace '%s': %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
@@ -1,16 +1,100 @@
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <unistd.h>
 
+#include <nihterm/base64.h>
 #include <nihterm/gfx.h>
+#include <nihterm/latency.h>
+#include <nihterm/sixel.h>
+#include <nihterm/trace.h>
+#include <nihterm/utf8.h>
 #include <nihterm/vt.h>
+#include <nihterm/width.h>
 
 #define print_error(...) fprintf(stderr, "nihterm: " __VA_ARGS__);
 
+// Replies generated by the parser (DA, CPR, ENQ, DECID) are queued here and
+// drained by the event loop, so a slow reader can't stall parsing.
+#define RESPONSE_QUEUE_SIZE 4096
+
+// largest single write of pasted text, and how many of them one vt_flush may
+// do before returning to the event loop
+#define PASTE_CHUNK_SIZE 4096
+#define PASTE_CHUNKS_PER_FLUSH 16
+
+// default cap on the payload of a single OSC/DCS string
+#define DEFAULT_STRING_LIMIT (16 * 1024 * 1024)
+
+// longest OSC number or DCS parameters/final before the payload
+#define STRING_PREFIX_SIZE 32
+
+#define TITLE_SIZE 256
+
+// cell size used to place images when there is no graphics to ask
+#define DEFAULT_CELL_WIDTH 10
+#define DEFAULT_CELL_HEIGHT 20
+
+// largest clipboard OSC 52 may set, after decoding
+#define CLIPBOARD_MAX_SIZE (8 * 1024 * 1024)
+#define CLIPBOARD_SELECTION_SIZE 8
+
+#define PASTE_START "\033[200~"
+#define PASTE_END "\033[201~"
+
+// Cells hold 16-bit attribute indices. When the table fills up, entries no
+// longer used on screen are dropped.
+#define ATTR_TABLE_MAX 65536
+#define ATTR_TABLE_INITIAL 64
+
+// Attribute table storage. Snapshots share it: entries are only appended
+// while it is shared, and compaction moves to a new block first.
+struct attr_block {
+  atomic_int refs;
+  struct cellattr entries[];
+};
+
+// Interned cell attributes, so each cell stores a small index instead of
+// colors and flags.
+struct attr_table {
+  struct attr_block *block;
+  // block->entries
+  struct cellattr *entries;
+  uint32_t count;
+  uint32_t cap;
+  // open-addressed hash of entries, holding index + 1 (0 is empty)
+  uint32_t *slots;
+  uint32_t num_slots;
+};
+
+// CSI parameters beyond these limits are dropped, and values are clamped
+#define CSI_MAX_PARAMS 16
+#define CSI_MAX_INTERMEDIATES 2
+#define CSI_PARAM_MAX 65535
+
+// CSI parameters, collected as the sequence arrives.
+struct csi {
+  int params[CSI_MAX_PARAMS];
+  // parameters seen so far, including empty ones
+  int count;
+  // bit n is set if parameter n followed a ':' rather than a ';'
+  unsigned sub;
+  // more parameters arrived than fit in params
+  int overflow;
+  // '<', '=', '>' or '?' before the parameters, or 0
+  char private_marker;
+  char intermediates[CSI_MAX_INTERMEDIATES];
+  int num_intermediates;
+};
+
 struct damage {
   int x;
   int y;
@@ -19,14 +103,100 @@ struct damage {
   struct damage *next;
 };
 
+// rows are always allocated wide enough for 132-column mode, or for the
+// configured width if that's larger
+#define MIN_ROW_CAPACITY 132
+
+// tab stops are a bitset with one bit per column of row capacity
+#define TABSTOP_WORD_BITS 64
+#define TABSTOP_WORDS(cap) (((cap) + TABSTOP_WORD_BITS - 1) / TABSTOP_WORD_BITS)
+
+// An image shared by every row it covers.
+struct image_layer {
+  int refs;
+  struct sixel_image *image;
+};
+
+// The part of an image drawn over one row, anchored to that row so it moves
+// with it on scrolls and line insertions/deletions. slice is the row of
+// cells within the image.
+struct image_slice {
+  struct image_layer *layer;
+  int col;
+  int slice;
+  struct image_slice *next;
+};
+
+// Cursor state kept by DECSC. Each screen has its own.
+struct saved_cursor {
+  int x;
+  int y;
+  int charset;
+  int lcf;
+  struct cellattr attr;
+};
+
+// The cells of a row. Snapshots share them with the screen, which copies
+// them before making any change while they are shared.
+struct cell_block {
+  atomic_int refs;
+  struct cell cells[];
+};
+
 struct row {
-  struct cell cells[132];
   struct row *next;
   int dirty;
 
+  // the line continues on the next row because autowrap moved it there
+  int wrapped;
+
   int dbl_height;
   int dbl_side; // 0=top, 1=bottom
   int dbl_width;
+
+  // images over this row, composited after the text
+  struct image_slice *images;
+
+  struct cell_block *block;
+  // block->cells, only to be changed through writable_cells
+  struct cell *cells;
+};
+
+// An immutable copy of the screen. The rows' cells are shared with the screen
+// until it changes them.
+struct snapshot {
+  atomic_int refs;
+
+  int rows;
+  int cols;
+  int cx;
+  int cy;
+
+  struct snapshot_row *lines;
+  struct cell_block **blocks;
+
+  struct attr_block *attr_block;
+  const struct cellattr *attrs;
+  size_t num_attrs;
+};
+
+// Kinds of control string. Only OSC and DCS have handlers, the others are
+// consumed and ignored.
+enum string_kind {
+  STRING_NONE = 0,
+  STRING_OSC,
+  STRING_DCS,
+  STRING_IGNORED,
+};
+
+// Receives the payload of one OSC or DCS string as it streams in. start gets
+// the prefix (OSC number or DCS parameters and final byte), data gets the
+// payload in chunks, and end is called once with aborted set if the string
+// was cancelled or went over the size limit.
+struct string_handler {
+  void (*start)(struct vt *vt, const char *prefix);
+  void (*data)(struct vt *vt, const char *data, size_t length);
+  void (*end)(struct vt *vt, int aborted);
 };
 
 struct vt {
@@ -35,6 +205,9 @@ struct vt {
   int rows;
   int cols;
 
+  // number of cells allocated in each row
+  int row_cap;
+
   int cx;
   int cy;
 
@@ -46,6 +219,16 @@ struct vt {
 
   struct row *screen;
 
+  // the screen not being shown, with its saved cursor: the alternate screen
+  // (allocated on first use) while the primary is up, the primary while the
+  // alternate is
+  int alt_active;
+  struct row *other_screen;
+  struct saved_cursor other_saved;
+
+  // rows dropped by scrolls and line deletions, reused for new lines
+  struct row *row_pool;
+
   struct row *margin_top_row;
   struct row *margin_bottom_row;
 
@@ -57,6 +240,54 @@ struct vt {
   int in_sequence;
   char sequence[64];
   int seqidx;
+  struct csi csi;
+
+  // multibyte sequence split across vt_process calls
+  struct utf8_decoder utf8;
+
+  // OSC/DCS string in progress
+  struct {
+    enum string_kind kind;
+    const struct string_handler *handler;
+    char prefix[STRING_PREFIX_SIZE];
+    size_t prefix_len;
+    // prefix is complete and handler->start has been called
+    int started;
+    // saw ESC, which is either the start of ST or cancels the string
+    int esc;
+    size_t len;
+    size_t limit;
+    int overflow;
+  } string;
+
+  struct sixel_decoder sixel;
+
+  char title[TITLE_SIZE];
+  struct {
+    char buf[TITLE_SIZE];
+    size_t len;
+  } pending_title;
+
+  // OSC 52 in progress, decoded as it arrives
+  struct {
+    char selection[CLIPBOARD_SELECTION_SIZE];
+    size_t selection_len;
+    // past the selection parameter
+    int in_payload;
+    int query;
+    int overflow;
+    struct base64_decoder decoder;
+    uint8_t *buf;
+    size_t len;
+    size_t cap;
+  } osc52;
+
+  // clipboard contents last set with OSC 52
+  char *clipboard;
+  size_t clipboard_len;
+  // whether OSC 52 queries are answered; anything that can write to the
+  // terminal could otherwise read the system clipboard
+  int clipboard_read;
 
   struct damage *damage;
 
@@ -76,11 +307,15 @@ struct vt {
     int decarm;
     int decpff;
     int decpex;
+    int deckpam;
+    int bracketed_paste;
   } mode;
 
   // last column flag
   int lcf;
-  int saved_lcf;
+
+  // last graphic character printed, for REP
+  uint32_t last_cp;
 
   // G0/G1
   int charset;
@@ -88,18 +323,42 @@ struct vt {
   int charset_g0;
   int charset_g1;
 
+  // set by SO, cleared by SI
+  int shifted;
+
+  // translation table for the active charset
+  const uint32_t *translate;
+
+  struct attr_table attrs;
   struct cellattr current_attr;
+  // current_attr's index in attrs
+  uint16_t current_attr_id;
+
+  struct saved_cursor saved;
 
-  int saved_x;
-  int saved_y;
-  int saved_charset;
-  struct cellattr saved_attr;
+  uint64_t *tabstops;
+
+  // ring buffer of pending replies to the pty
+  struct {
+    char buf[RESPONSE_QUEUE_SIZE];
+    size_t head;
+    size_t len;
+    int dropping;
+  } responses;
 
-  char tabstops[132];
+  // pasted text still to be written to the pty, after any replies
+  struct {
+    char *buf;
+    size_t off;
+    size_t len;
+    // the end marker still needs to be sent if the paste is cut short
+    int bracketed;
+  } paste;
 };
 
-static void set_char_in_row(struct vt *vt, struct row *row, int x, char c);
-static void insert_char_at(struct vt *vt, int x, int y, char c);
+static void set_char_in_row(struct vt *vt, struct row *row, int x, uint32_t cp);
+static void insert_char_at(struct vt *vt, int x, int y, uint32_t cp);
+static void split_wide(struct vt *vt, struct cell *cells, int x);
 
 static int row_cols(struct vt *vt, struct row *row);
 
@@ -111,9 +370,18 @@ static void cursor_up(struct vt *vt, int count, int scroll);
 static void cursor_to(struct vt *vt, int x, int y, int scroll, int cup);
 static void cursor_sol(struct vt *vt);
 static void cursor_moved(struct vt *vt);
+static void save_cursor(struct vt *vt);
+static void restore_cursor(struct vt *vt);
+
+static void switch_screen(struct vt *vt, int alt);
+static void fit_other_screen(struct vt *vt, int old_cols);
 
 static void process_char(struct vt *vt, char c);
 static void do_sequence(struct vt *vt);
+static void print_char(struct vt *vt, uint32_t cp);
+static size_t print_ascii(struct vt *vt, const char *s, size_t length);
+static void combine_char(struct vt *vt, uint32_t cp);
+static void process_codepoint(struct vt *vt, uint32_t cp);
 static void do_vt52(struct vt *vt);
 static void end_sequence(struct vt *vt);
 
@@ -130,16 +398,30 @@ static void scroll_down(struct vt *vt);
 // sequence handling
 static void handle_bracket_seq(struct vt *vt);
 static void handle_paren_seq(struct vt *vt);
-static void handle_reports_seq(struct vt *vt, int *params, int num_params);
+static void handle_reports_seq(struct vt *vt);
 static void handle_modes(struct vt *vt, int set);
+static void handle_dec_mode(struct vt *vt, int param, int set);
+static void handle_ansi_mode(struct vt *vt, int param, int set);
 static void handle_erases(struct vt *vt, int line, int n);
 static void handle_pound_seq(struct vt *vt);
 
-static void get_params(const char *sequence, int *params, int *num_params);
+static int csi_collect(struct csi *csi, char c);
+static int csi_param(struct vt *vt, int i, int def);
 
 struct row *get_row(struct vt *vt, int y, struct row **prev);
 
 void free_row(struct row *row);
+static void free_rows(struct row *row);
+static void clear_images(struct row *row);
+static struct row *alloc_row(struct vt *vt);
+static void release_row(struct vt *vt, struct row *row);
+static void unref_cells(struct cell_block *block);
+static struct cell *writable_cells(struct vt *vt, struct row *row);
+
+static struct row *reflow_screen(struct vt *vt, struct row **screen, int rows,
+                                 int cols, int rewrap, int *x, int *y);
+static void dispose_rows(struct vt *vt, struct row *row, int reuse);
+static void update_winsize(struct vt *vt);
 
 static struct row *append_line(struct vt *vt, struct row *after);
 static struct row *screen_insert_line(struct vt *vt, struct row *prev);
@@ -148,29 +430,53 @@ static void delete_character(struct vt *vt);
 static void delete_line(struct vt *vt);
 static void insert_line(struct vt *vt);
 
-static int next_tabstop(struct vt *vt, int x);
+static void set_tabstop(struct vt *vt, int x, int set);
+static int next_tabstop(struct vt *vt, int x, int n);
+static int prev_tabstop(struct vt *vt, int x, int n);
 
 static ssize_t write_retry(int fd, const char *buffer, size_t length);
-
-static void set_cp(struct vt *vt, struct cell *cell, char c);
+static void cancel_paste(struct vt *vt);
+static void flush_all(struct vt *vt);
+static void queue_response(struct vt *vt, const char *buffer, size_t length);
+
+static void set_cp(struct vt *vt, struct cell *cell, uint32_t cp);
+
+static void attr_init(struct attr_table *table);
+static void unref_attrs(struct attr_block *block);
+static void writable_attrs(struct attr_table *table, uint32_t cap);
+static uint16_t attr_intern(struct vt *vt, const struct cellattr *attr);
+static void handle_sgr(struct vt *vt);
+static void select_charset(struct vt *vt, int charset);
+static int valid_charset(uint32_t charset);
+
+static void start_string(struct vt *vt, enum string_kind kind);
+static void finish_string(struct vt *vt, int aborted);
+static void place_image(struct vt *vt, struct sixel_image *image);
+static void cell_size(struct vt *vt, int *w, int *h);
+static size_t process_string(struct vt *vt, const char *string, size_t length);
 
 struct vt *vt_create(int pty, int rows, int cols) {
   struct vt *vt = (struct vt *)calloc(sizeof(struct vt), 1);
   vt->pty = pty;
   vt->rows = rows;
   vt->cols = cols;
+  vt->row_cap = cols > MIN_ROW_CAPACITY ? cols : MIN_ROW_CAPACITY;
   vt->margin_top = 0;
   vt->margin_bottom = rows - 1;
   vt->margin_left = 0;
   vt->margin_right = cols;
   vt->screen = NULL;
+  select_charset(vt, 0);
+  attr_init(&vt->attrs);
   struct row *prev = NULL;
   for (int i = 0; i < rows; i++) {
     prev = append_line(vt, prev);
   }
   // set default tab stops (every 8 chars)
-  for (int i = 0; i < 132; i++) {
-    vt->tabstops[i] = (i % 8 == 0);
+  vt->tabstops = (uint64_t *)calloc(TABSTOP_WORDS((size_t)vt->row_cap),
+                                    sizeof(uint64_t));
+  for (int i = 0; i < vt->row_cap; i += 8) {
+    set_tabstop(vt, i, 1);
   }
 
   vt->current_row = vt->screen;
@@ -178,17 +484,23 @@ struct vt *vt_create(int pty, int rows, int cols) {
   // set default modes
   vt->mode.decanm = 1;
 
+  vt->string.limit = DEFAULT_STRING_LIMIT;
+
   return vt;
 }
 
 void vt_destroy(struct vt *vt) {
-  struct row *row = vt->screen;
-  while (row) {
-    struct row *tmp = row;
-    row = row->next;
-    free(tmp);
-  }
-
+  free_rows(vt->screen);
+  free_rows(vt->other_screen);
+  free_rows(vt->row_pool);
+
+  sixel_discard(&vt->sixel);
+  free(vt->paste.buf);
+  free(vt->osc52.buf);
+  free(vt->clipboard);
+  free(vt->tabstops);
+  unref_attrs(vt->attrs.block);
+  free(vt->attrs.slots);
   free(vt);
 }
 
@@ -197,36 +509,440 @@ void vt_set_graphics(struct vt *vt, struct graphics *graphics) {
   link_vt(graphics, vt);
 }
 
+void vt_resize(struct vt *vt, int rows, int cols) {
+  if (rows < 1 || cols < 1) {
+    print_error("invalid terminal size %dx%d\n", cols, rows);
+    return;
+  }
+
+  if (rows != vt->rows || cols != vt->cols) {
+    int grown = cols > vt->row_cap;
+    if (grown) {
+      // every row is reallocated wider, so pooled rows are no use
+      free_rows(vt->row_pool);
+      vt->row_pool = NULL;
+
+      size_t old_words = TABSTOP_WORDS((size_t)vt->row_cap);
+      size_t words = TABSTOP_WORDS((size_t)cols);
+      vt->tabstops = realloc(vt->tabstops, words * sizeof(uint64_t));
+      memset(vt->tabstops + old_words, 0,
+             (words - old_words) * sizeof(uint64_t));
+      for (int x = vt->row_cap + 7 - (vt->row_cap + 7) % 8; x < cols; x += 8) {
+        set_tabstop(vt, x, 1);
+      }
+
+      vt->row_cap = cols;
+    }
+
+    // only the primary screen is rewrapped; full screen applications redraw
+    // the alternate screen themselves
+    struct row *old = reflow_screen(vt, &vt->screen, rows, cols,
+                                    !vt->alt_active, &vt->cx, &vt->cy);
+    struct row *old_other = NULL;
+    if (vt->other_screen) {
+      old_other = reflow_screen(vt, &vt->other_screen, rows, cols,
+                                vt->alt_active, &vt->other_saved.x,
+                                &vt->other_saved.y);
+    }
+
+    // rows narrower than the new capacity can't go back in the pool
+    dispose_rows(vt, old, !grown);
+    dispose_rows(vt, old_other, !grown);
+
+    vt->rows = rows;
+    vt->cols = cols;
+
+    if (vt->saved.x >= cols) {
+      vt->saved.x = cols - 1;
+    }
+    if (vt->saved.y >= rows) {
+      vt->saved.y = rows - 1;
+    }
+
+    vt->margin_top = 0;
+    vt->margin_bottom = rows - 1;
+    vt->margin_left = 0;
+    vt->margin_right = cols;
+    vt->lcf = 0;
+
+    vt->cached_y = vt->cy;
+    vt->current_row = get_row(vt, vt->cy, NULL);
+
+    // pending damage may be outside the new screen
+    while (vt->damage) {
+      struct damage *next = vt->damage->next;
+      free(vt->damage);
+      vt->damage = next;
+    }
+  }
+
+  // the window contents are gone either way
+  mark_damage(vt, 0, 0, vt->cols, vt->rows);
+
+  update_winsize(vt);
+}
+
 int vt_process(struct vt *vt, const char *string, size_t length) {
-  for (size_t i = 0; i < length; i++) {
-    process_char(vt, string[i]);
+  TRACE_BEGIN(trace_start);
+
+  for (size_t i = 0; i < length;) {
+    if (vt->string.kind) {
+      // control strings are passed on in chunks rather than byte by byte
+      i += process_string(vt, string + i, length - i);
+      continue;
+    }
+
+    if (!vt->utf8.remaining) {
+      // ASCII goes straight to the parser; a control string may start
+      // partway through the run
+      size_t end = i + utf8_ascii_run(string + i, length - i);
+      while (i < end && !vt->string.kind) {
+        if (!vt->in_sequence && string[i] >= ' ' && string[i] < '\177') {
+          i += print_ascii(vt, string + i, end - i);
+        } else {
+          process_char(vt, string[i++]);
+        }
+      }
+
+      if (vt->string.kind || i == length) {
+        continue;
+      }
+    }
+
+    uint32_t cp;
+    switch (utf8_decode(&vt->utf8, (uint8_t)string[i], &cp)) {
+    case UTF8_ACCEPT:
+      ++i;
+      process_codepoint(vt, cp);
+      break;
+    case UTF8_REJECT:
+      // the byte that broke the sequence starts over
+      process_codepoint(vt, cp);
+      break;
+    default:
+      ++i;
+    }
   }
 
+  TRACE_END("vt_process", trace_start);
   return 0;
 }
 
 ssize_t vt_input(struct vt *vt, const char *string, size_t length) {
+  // typing interrupts a paste in progress
+  cancel_paste(vt);
+
+  // anything already queued was generated before this input arrived
+  flush_all(vt);
+
   ssize_t n = 0;
-  for (size_t i = 0; i < length; ++i) {
-    n += write_retry(vt->pty, &string[i], 1);
+  if (!vt->mode.lnm || !memchr(string, '\r', length)) {
+    n = write_retry(vt->pty, string, length);
+  } else {
+    // LNM mode: send line feed on RETURN key
+    char buf[1024];
+    size_t len = 0;
+    for (size_t i = 0; i < length; ++i) {
+      if (len + 2 > sizeof(buf)) {
+        n += write_retry(vt->pty, buf, len);
+        len = 0;
+      }
 
-    if (string[i] == '\r' && vt->mode.lnm) {
-      // LNM mode: send line feed on RETURN key
-      n += write_retry(vt->pty, "\n", 1);
+      buf[len++] = string[i];
+      if (string[i] == '\r') {
+        buf[len++] = '\n';
+      }
     }
+
+    n += write_retry(vt->pty, buf, len);
   }
 
+  LATENCY_MARK(LATENCY_WAIT_WRITE, latency_written);
+
   return n;
 }
 
+static int flush_responses(struct vt *vt) {
+  while (vt->responses.len) {
+    size_t chunk = RESPONSE_QUEUE_SIZE - vt->responses.head;
+    if (chunk > vt->responses.len) {
+      chunk = vt->responses.len;
+    }
+
+    ssize_t rc = write(vt->pty, vt->responses.buf + vt->responses.head, chunk);
+    if (rc < 0) {
+      if (errno == EINTR) {
+        continue;
+      } else if (errno == EAGAIN) {
+        return 0;
+      }
+
+      print_error("failed to flush responses: %s\n", strerror(errno));
+      return -1;
+    }
+
+    vt->responses.head = (vt->responses.head + (size_t)rc) % RESPONSE_QUEUE_SIZE;
+    vt->responses.len -= (size_t)rc;
+  }
+
+  return 0;
+}
+
+static int flush_paste(struct vt *vt) {
+  for (int i = 0; i < PASTE_CHUNKS_PER_FLUSH && vt->paste.off < vt->paste.len;) {
+    size_t chunk = vt->paste.len - vt->paste.off;
+    if (chunk > PASTE_CHUNK_SIZE) {
+      chunk = PASTE_CHUNK_SIZE;
+    }
+
+    ssize_t rc = write(vt->pty, vt->paste.buf + vt->paste.off, chunk);
+    if (rc < 0) {
+      if (errno == EINTR) {
+        continue;
+      } else if (errno == EAGAIN) {
+        return 0;
+      }
+
+      print_error("failed to write paste: %s\n", strerror(errno));
+      return -1;
+    }
+
+    vt->paste.off += (size_t)rc;
+    ++i;
+  }
+
+  if (vt->paste.off == vt->paste.len) {
+    free(vt->paste.buf);
+    memset(&vt->paste, 0, sizeof(vt->paste));
+  }
+
+  return 0;
+}
+
+ssize_t vt_flush(struct vt *vt) {
+  if (flush_responses(vt) < 0) {
+    return -1;
+  }
+
+  // replies go out before any more of a paste
+  if (!vt->responses.len && vt->paste.buf) {
+    if (flush_paste(vt) < 0) {
+      return -1;
+    }
+  }
+
+  return (ssize_t)vt_pending(vt);
+}
+
+size_t vt_pending(struct vt *vt) {
+  return vt->responses.len + (vt->paste.len - vt->paste.off);
+}
+
+int vt_paste(struct vt *vt, const char *text, size_t length) {
+  int bracketed = vt->mode.bracketed_paste;
+
+  // a new paste queues up behind the rest of the previous one
+  size_t remaining = vt->paste.len - vt->paste.off;
+  size_t cap = remaining + length;
+  if (bracketed) {
+    cap += strlen(PASTE_START) + strlen(PASTE_END);
+  }
+
+  char *buf = (char *)malloc(cap);
+  if (!buf) {
+    print_error("failed to allocate %zu bytes for paste\n", cap);
+    return -1;
+  }
+
+  size_t len = 0;
+  if (remaining) {
+    memcpy(buf, vt->paste.buf + vt->paste.off, remaining);
+    len = remaining;
+  }
+
+  if (bracketed) {
+    memcpy(buf + len, PASTE_START, strlen(PASTE_START));
+    len += strlen(PASTE_START);
+  }
+
+  for (size_t i = 0; i < length; ++i) {
+    char c = text[i];
+    if (c == '\n') {
+      // pasted lines end the way typed ones do
+      if (i && text[i - 1] == '\r') {
+        continue;
+      }
+      c = '\r';
+    } else if (c == '\033' && bracketed) {
+      // never let the pasted text end the paste early
+      continue;
+    }
+
+    buf[len++] = c;
+  }
+
+  if (bracketed) {
+    memcpy(buf + len, PASTE_END, strlen(PASTE_END));
+    len += strlen(PASTE_END);
+  }
+
+  free(vt->paste.buf);
+  vt->paste.buf = buf;
+  vt->paste.off = 0;
+  vt->paste.len = len;
+  vt->paste.bracketed = bracketed;
+
+  return 0;
+}
+
+static void cancel_paste(struct vt *vt) {
+  if (!vt->paste.buf) {
+    return;
+  }
+
+  // the start marker may already be out, so finish with the end marker
+  if (vt->paste.bracketed && vt->paste.off) {
+    size_t start_len = strlen(PASTE_START);
+    size_t end_len = strlen(PASTE_END);
+    if (vt->paste.off < start_len &&
+        !memcmp(vt->paste.buf, PASTE_START, start_len)) {
+      // only part of the start marker went out; the rest has to follow it
+      // or the program sees a broken sequence
+      size_t rest = start_len - vt->paste.off;
+      memcpy(vt->paste.buf, PASTE_START + vt->paste.off, rest);
+      memcpy(vt->paste.buf + rest, PASTE_END, end_len);
+      vt->paste.off = 0;
+      vt->paste.len = rest + end_len;
+      return;
+    }
+
+    if (vt->paste.len - vt->paste.off > end_len) {
+      memcpy(vt->paste.buf, PASTE_END, end_len);
+      vt->paste.off = 0;
+      vt->paste.len = end_len;
+      return;
+    }
+
+    // already down to (part of) the end marker
+    return;
+  }
+
+  free(vt->paste.buf);
+  memset(&vt->paste, 0, sizeof(vt->paste));
+}
+
+static void flush_all(struct vt *vt) {
+  while (vt_pending(vt)) {
+    if (vt_flush(vt) < 0) {
+      return;
+    }
+
+    if (vt_pending(vt)) {
+      struct pollfd pfd = {vt->pty, POLLOUT, 0};
+      poll(&pfd, 1, -1);
+    }
+  }
+}
+
+void vt_size(struct vt *vt, int *rows, int *cols) {
+  *rows = vt->rows;
+  *cols = vt->cols;
+}
+
+const char *vt_title(struct vt *vt) { return vt->title; }
+
+const char *vt_clipboard(struct vt *vt, size_t *length) {
+  if (length) {
+    *length = vt->clipboard_len;
+  }
+  return vt->clipboard;
+}
+
+void vt_set_string_limit(struct vt *vt, size_t limit) {
+  vt->string.limit = limit;
+}
+
+void vt_allow_clipboard_read(struct vt *vt, int allow) {
+  vt->clipboard_read = allow;
+}
+
+unsigned vt_input_modes(struct vt *vt) {
+  unsigned modes = 0;
+  if (vt->mode.decckm) {
+    modes |= VT_INPUT_DECCKM;
+  }
+  if (vt->mode.deckpam) {
+    modes |= VT_INPUT_DECKPAM;
+  }
+  if (!vt->mode.decanm) {
+    modes |= VT_INPUT_VT52;
+  }
+  return modes;
+}
+
+// Composite the image slices on a row over the damaged columns.
+static void render_images(struct vt *vt, struct row *row, int y, int x, int w) {
+  int cw, ch;
+  cell_size(vt, &cw, &ch);
+
+  int clip_left = x * cw;
+  int clip_right = (x + w) * cw;
+
+  for (struct image_slice *slice = row->images; slice; slice = slice->next) {
+    struct sixel_image *image = slice->layer->image;
+
+    int src_y = slice->slice * ch;
+    int h = image->height - src_y;
+    if (h > ch) {
+      h = ch;
+    }
+
+    int left = slice->col * cw;
+    int right = left + image->width;
+    if (left < clip_left) {
+      left = clip_left;
+    }
+    if (right > clip_right) {
+      right = clip_right;
+    }
+    if (left >= right || h <= 0) {
+      continue;
+    }
+
+    const uint32_t *pixels = image->pixels + (size_t)src_y * (size_t)image->width +
+                             (size_t)(left - slice->col * cw);
+    graphics_draw_image(vt->graphics, pixels, image->width, right - left, h,
+                        left, y * ch);
+  }
+}
+
 void vt_render(struct vt *vt) {
+  TRACE_BEGIN(trace_start);
+
   struct damage *damage = vt->damage;
   while (damage) {
     if (vt->graphics) {
       for (int y = damage->y; y < (damage->y + damage->h); ++y) {
         struct row *row = get_row(vt, y, NULL);
-          chars_at(vt->graphics, damage->x, y, &row->cells[damage->x], damage->w, row->dbl_width,
-            row->dbl_height ? row->dbl_side + 1 : 0);
+
+        // wide characters are drawn whole, so widen the damage to cover
+        // both halves
+        int x = damage->x;
+        int w = damage->w;
+        if (x > 0 && (row->cells[x].flags & CELL_WIDE_SPACER)) {
+          --x;
+          ++w;
+        }
+        if (x + w < vt->cols && (row->cells[x + w - 1].flags & CELL_WIDE)) {
+          ++w;
+        }
+
+        chars_at(vt->graphics, x, y, &row->cells[x], vt->attrs.entries, w,
+                 row->dbl_width, row->dbl_height ? row->dbl_side + 1 : 0);
+
+        if (row->images) {
+          render_images(vt, row, y, damage->x, damage->w);
+        }
       }
     }
 
@@ -236,6 +952,8 @@ void vt_render(struct vt *vt) {
   }
 
   vt->damage = NULL;
+
+  TRACE_END("vt_render", trace_start);
 }
 
 static void process_char(struct vt *vt, char c) {
@@ -254,7 +972,7 @@ static void process_char(struct vt *vt, char c) {
   switch (c) {
   case '\005':
     // ENQ: Enquiry
-    write_retry(vt->pty, "\033[?1;2c", 7);
+    queue_response(vt, "\033[?1;2c", 7);
     break;
   case '\010':
     cursor_back(vt, 1);
@@ -274,18 +992,20 @@ static void process_char(struct vt *vt, char c) {
     vt->lcf = 0;
     break;
   case '\t':
-    cursor_to(vt, next_tabstop(vt, vt->cx), vt->cy, 0, 0);
+    cursor_to(vt, next_tabstop(vt, vt->cx, 1), vt->cy, 0, 0);
     vt->lcf = 0;
     break;
   case '\016':
     // Shift-Out (SO)
     // TODO: invoke G1 character set
-    vt->charset = vt->charset_g1;
+    vt->shifted = 1;
+    select_charset(vt, vt->charset_g1);
     break;
   case '\017':
     // Shift-In (SI)
     // TODO: invoke G0 character set
-    vt->charset = vt->charset_g0;
+    vt->shifted = 0;
+    select_charset(vt, vt->charset_g0);
     break;
   default:
     // fprintf(stderr, "nihterm: unknown character: %c/%d\n", c, c);
@@ -309,6 +1029,31 @@ static void process_char(struct vt *vt, char c) {
       return;
     }
 
+    if (vt->seqidx == 0 && vt->mode.decanm) {
+      switch (c) {
+      case ']':
+        // OSC - Operating System Command
+        start_string(vt, STRING_OSC);
+        return;
+      case 'P':
+        // DCS - Device Control String
+        start_string(vt, STRING_DCS);
+        return;
+      case 'X':
+      case '^':
+      case '_':
+        // SOS, PM, APC
+        start_string(vt, STRING_IGNORED);
+        return;
+      }
+    }
+
+    if ((size_t)vt->seqidx >= sizeof(vt->sequence) - 1) {
+      print_error("sequence too long, ignoring: %s\n", vt->sequence);
+      end_sequence(vt);
+      return;
+    }
+
     vt->sequence[vt->seqidx++] = c;
 
     if (!vt->mode.decanm) {
@@ -316,52 +1061,216 @@ static void process_char(struct vt *vt, char c) {
       return;
     }
 
-    if (vt->seqidx == 1 && !isalpha(c) && !iscntrl(c) && !isdigit(c)) {
+    if (vt->seqidx == 1 && c == '[') {
+      memset(&vt->csi, 0, sizeof(vt->csi));
+    }
+
+    if (vt->seqidx == 1 && !isalpha(c) && !iscntrl(c) && !isdigit(c) &&
+        c != '=' && c != '>') {
       return;
     }
 
     // CSI sequences have more parameters, ESC sequences are complete here.
-    if (vt->sequence[0] == '[') {
-      if (isdigit(c) || c == ';' || c == '?' || c == '#') {
-        return;
-      }
+    if (vt->sequence[0] == '[' && vt->seqidx > 1 && !csi_collect(&vt->csi, c)) {
+      return;
     }
 
     do_sequence(vt);
   } else if (c == '\033') {
     vt->in_sequence = 1;
   } else if (isprint(c)) {
-    // handle wrapping now that we have a printable
-    if (vt->mode.decawm && vt->lcf) {
-      // move to first column of next line, scrolling if needed
-      cursor_sol(vt);
-      cursor_down(vt, 1, 1);
-      vt->lcf = 0;
-    }
-
-    if (vt->mode.irm) {
-      insert_char_at(vt, vt->cx, vt->cy, c);
-      mark_damage(vt, vt->cx, vt->cy, vt->cols - vt->cx, 1);
-    } else {
-      set_char_in_row(vt, vt->current_row, vt->cx, c);
-      mark_damage(vt, vt->cx, vt->cy, 1, 1);
+    print_char(vt, (uint32_t)c);
+  } else {
+    fprintf(stderr, "nihterm: unknown character: %c/%d\n", c, c);
+  }
+}
+
+static void print_char(struct vt *vt, uint32_t cp) {
+  int width = cp < 0x80 ? 1 : unicode_width(cp);
+  if (width == 0) {
+    combine_char(vt, cp);
+    return;
+  }
+
+  vt->last_cp = cp;
+
+  // handle wrapping now that we have a printable
+  if (vt->mode.decawm && vt->lcf) {
+    // move to first column of next line, scrolling if needed
+    vt->current_row->wrapped = 1;
+    cursor_sol(vt);
+    cursor_down(vt, 1, 1);
+    vt->lcf = 0;
+  }
+
+  if (width == 2) {
+    int right = row_cols(vt, vt->current_row);
+    if (right > vt->margin_right) {
+      right = vt->margin_right;
     }
 
-    if (!vt->mode.decawm) {
-      cursor_fwd(vt, 1, 0);
-    } else {
-      // we don't advance the cursor past the right-most column until the _next_
-      // printable
-      if ((vt->cx + 1) == vt->margin_right) {
-        vt->lcf = 1;
+    if (right < 2) {
+      // nowhere to put the second half
+      width = 1;
+    } else if (vt->cx + 1 >= right) {
+      // both halves must be on the same line
+      if (vt->mode.decawm) {
+        vt->current_row->wrapped = 1;
+        cursor_sol(vt);
+        cursor_down(vt, 1, 1);
       } else {
-        cursor_fwd(vt, 1, 0);
+        cursor_to(vt, right - 2, vt->cy, 0, 0);
       }
     }
-    // fprintf(stderr, "cursor: %d, %d\n", vt->cx, vt->cy);
+  }
+
+  if (vt->mode.irm) {
+    for (int i = 0; i < width; ++i) {
+      insert_char_at(vt, vt->cx, vt->cy, cp);
+    }
+    mark_damage(vt, vt->cx, vt->cy, vt->cols - vt->cx, 1);
   } else {
-    fprintf(stderr, "nihterm: unknown character: %c/%d\n", c, c);
+    // right half first, so it can't split the new left half
+    if (width == 2) {
+      set_char_in_row(vt, vt->current_row, vt->cx + 1, cp);
+    }
+    set_char_in_row(vt, vt->current_row, vt->cx, cp);
+    mark_damage(vt, vt->cx, vt->cy, width, 1);
+  }
+
+  if (width == 2) {
+    struct cell *cells = &writable_cells(vt, vt->current_row)[vt->cx];
+    cells[0].flags = CELL_WIDE;
+    cells[1].cp = 0;
+    cells[1].flags = CELL_WIDE_SPACER;
+  }
+
+  if (!vt->mode.decawm) {
+    // at the right margin the cursor stays on the character just written,
+    // which is where a combining mark goes, but never wraps
+    vt->lcf = vt->cx + width >= vt->margin_right;
+    cursor_fwd(vt, width, 0);
+  } else {
+    // we don't advance the cursor past the right-most column until the _next_
+    // printable
+    if ((vt->cx + width) == vt->margin_right) {
+      cursor_fwd(vt, width - 1, 0);
+      vt->lcf = 1;
+    } else {
+      cursor_fwd(vt, width, 0);
+    }
+  }
+}
+
+// Print a run of printable ASCII, a row at a time, returning how much of it
+// was used. Anything print_char does that this doesn't is left to it.
+static size_t print_ascii(struct vt *vt, const char *s, size_t length) {
+  size_t done = 0;
+  while (done < length && s[done] >= ' ' && s[done] < '\177') {
+    if (vt->mode.decawm && vt->lcf) {
+      vt->current_row->wrapped = 1;
+      cursor_sol(vt);
+      cursor_down(vt, 1, 1);
+      vt->lcf = 0;
+    }
+
+    // outside the margins the cursor is pulled back in as it moves
+    if (vt->mode.irm || vt->cx < vt->margin_left ||
+        vt->cx >= vt->margin_right || vt->current_row->dbl_width ||
+        vt->current_row->dbl_height) {
+      print_char(vt, (uint32_t)s[done]);
+      ++done;
+      continue;
+    }
+
+    // with autowrap the run stops at the right margin, without it the rest
+    // of the run lands on the last column and only its final byte stays
+    int x = vt->cx;
+    size_t fit = (size_t)(vt->margin_right - x);
+    size_t end = done;
+    while (end < length && (!vt->mode.decawm || end - done < fit) &&
+           s[end] >= ' ' && s[end] < '\177') {
+      ++end;
+    }
+    int n = (int)(end - done < fit ? end - done : fit);
+
+    struct row *row = vt->current_row;
+    struct cell *cells = writable_cells(vt, row);
+
+    // the ends may cut through wide characters
+    split_wide(vt, cells, x);
+    if (x + n < vt->cols) {
+      split_wide(vt, cells, x + n);
+    }
+
+    struct cell blank;
+    memset(&blank, 0, sizeof(blank));
+    blank.attr = vt->current_attr_id;
+    for (int i = 0; i < n; ++i) {
+      cells[x + i] = blank;
+      cells[x + i].cp = vt->translate[(unsigned char)s[done + (size_t)i]];
+    }
+    cells[x + n - 1].cp = vt->translate[(unsigned char)s[end - 1]];
+
+    row->dirty = 1;
+    mark_damage(vt, x, vt->cy, n, 1);
+
+    vt->last_cp = (uint32_t)s[end - 1];
+    done = end;
+
+    if (!vt->mode.decawm) {
+      vt->lcf = x + n >= vt->margin_right;
+      cursor_fwd(vt, n, 0);
+    } else if (x + n == vt->margin_right) {
+      // as in print_char, the cursor waits on the last column for the next
+      // printable
+      cursor_fwd(vt, n - 1, 0);
+      vt->lcf = 1;
+    } else {
+      cursor_fwd(vt, n, 0);
+    }
+  }
+
+  return done;
+}
+
+// Attach a zero-width character to the one before the cursor.
+static void combine_char(struct vt *vt, uint32_t cp) {
+  // with a pending wrap the cursor is still on the last character
+  int x = vt->lcf ? vt->cx : vt->cx - 1;
+  struct row *row = vt->current_row;
+  if (x < 0 || x >= row_cols(vt, row)) {
+    return;
+  }
+
+  if ((row->cells[x].flags & CELL_WIDE_SPACER) && x > 0) {
+    --x;
+  }
+
+  struct cell *cell = &writable_cells(vt, row)[x];
+  for (int i = 0; i < CELL_MAX_COMBINING; ++i) {
+    if (!cell->combining[i]) {
+      cell->combining[i] = cp;
+      row->dirty = 1;
+      mark_damage(vt, x, vt->cy, (cell->flags & CELL_WIDE) ? 2 : 1, 1);
+      return;
+    }
+  }
+}
+
+// A complete non-ASCII codepoint arrived.
+static void process_codepoint(struct vt *vt, uint32_t cp) {
+  if (cp >= 0x80 && cp <= 0x9F) {
+    // C1 controls are only recognized in their 7-bit forms
+    return;
+  }
+
+  if (vt->in_sequence) {
+    // not part of any sequence; drop the sequence and show the character
+    end_sequence(vt);
   }
+
+  print_char(vt, cp);
 }
 
 static void do_sequence(struct vt *vt) {
@@ -398,28 +1307,27 @@ static void do_sequence(struct vt *vt) {
   case 'Z':
     // DECID - Identify Terminal
     // Graphics option + Advanced video option
-    write_retry(vt->pty, "\033[?1;6c", 7);
+    queue_response(vt, "\033[?1;6c", 7);
     break;
   case 'H':
     // HTS - Horizontal Tabulation Set
-    vt->tabstops[vt->cx] = 1;
+    set_tabstop(vt, vt->cx, 1);
+    break;
+  case '=':
+    // DECKPAM - Keypad Application Mode
+    vt->mode.deckpam = 1;
+    break;
+  case '>':
+    // DECKPNM - Keypad Numeric Mode
+    vt->mode.deckpam = 0;
     break;
   case '7':
     // DECSC - Save Cursor
-    vt->saved_x = vt->cx;
-    vt->saved_y = vt->cy;
-    vt->saved_attr = vt->current_attr;
-    vt->saved_charset = vt->charset;
-    vt->saved_lcf = vt->lcf;
+    save_cursor(vt);
     break;
   case '8':
     // DECRC - Restore Cursor
-    vt->cx = vt->saved_x;
-    vt->cy = vt->saved_y;
-    vt->current_attr = vt->saved_attr;
-    vt->charset = vt->saved_charset;
-    vt->lcf = vt->saved_lcf;
-    cursor_moved(vt);
+    restore_cursor(vt);
     break;
   default:
     fprintf(stderr, "nihterm: unhandled sequence: %s\n", vt->sequence);
@@ -428,6 +1336,86 @@ static void do_sequence(struct vt *vt) {
   end_sequence(vt);
 }
 
+static void save_cursor(struct vt *vt) {
+  vt->saved.x = vt->cx;
+  vt->saved.y = vt->cy;
+  vt->saved.attr = vt->current_attr;
+  vt->saved.charset = vt->charset;
+  vt->saved.lcf = vt->lcf;
+}
+
+static void restore_cursor(struct vt *vt) {
+  // the screen may have shrunk since the cursor was saved
+  vt->cx = vt->saved.x < vt->cols ? vt->saved.x : vt->cols - 1;
+  vt->cy = vt->saved.y < vt->rows ? vt->saved.y : vt->rows - 1;
+  vt->current_attr = vt->saved.attr;
+  vt->current_attr_id = attr_intern(vt, &vt->current_attr);
+  select_charset(vt, vt->saved.charset);
+  vt->lcf = vt->saved.lcf;
+  cursor_moved(vt);
+}
+
+// Show the alternate (alt = 1) or primary screen. The screens are swapped by
+// pointer, so switching costs the same whatever is on them.
+static void switch_screen(struct vt *vt, int alt) {
+  if (vt->alt_active == alt) {
+    return;
+  }
+
+  struct row *screen = vt->screen;
+  vt->screen = vt->other_screen;
+  vt->other_screen = screen;
+
+  struct saved_cursor saved = vt->saved;
+  vt->saved = vt->other_saved;
+  vt->other_saved = saved;
+
+  vt->alt_active = alt;
+
+  if (!vt->screen) {
+    // first use of the alternate screen
+    struct row *prev = NULL;
+    for (int i = 0; i < vt->rows; i++) {
+      prev = screen_insert_line(vt, prev);
+    }
+  }
+
+  vt->current_row = get_row(vt, vt->cached_y, NULL);
+
+  mark_damage(vt, 0, 0, vt->cols, vt->rows);
+}
+
+// DECCOLM changed the width under the hidden screen. Blank the columns it
+// gains and split wide characters cut by the new edge, and bring both saved
+// cursors inside.
+static void fit_other_screen(struct vt *vt, int old_cols) {
+  struct cell blank;
+  memset(&blank, 0, sizeof(blank));
+  set_cp(vt, &blank, ' ');
+
+  for (struct row *row = vt->other_screen; row; row = row->next) {
+    int half = row->dbl_width || row->dbl_height;
+    int from = half ? old_cols / 2 : old_cols;
+    int to = row_cols(vt, row);
+
+    struct cell *cells = writable_cells(vt, row);
+    for (int x = from; x < to; ++x) {
+      cells[x] = blank;
+    }
+    if (to < vt->row_cap) {
+      split_wide(vt, cells, to);
+    }
+    row->dirty = 1;
+  }
+
+  struct saved_cursor *saved[] = {&vt->saved, &vt->other_saved};
+  for (size_t i = 0; i < sizeof(saved) / sizeof(saved[0]); ++i) {
+    if (saved[i]->x >= vt->cols) {
+      saved[i]->x = vt->cols - 1;
+    }
+  }
+}
+
 static void cursor_fwd(struct vt *vt, int num, int scroll) {
   cursor_to(vt, vt->cx + num, vt->cy, scroll, 0);
 }
@@ -514,6 +1502,8 @@ static void mark_damage(struct vt *vt, int x, int y, int w, int h) {
   int top = y;
   int bottom = y + h;
 
+  LATENCY_MARK(LATENCY_WAIT_DAMAGE, latency_damaged);
+
   struct damage *dmg = vt->damage;
   while (dmg) {
     // fully enclosed?
@@ -568,63 +1558,95 @@ static void mark_damage(struct vt *vt, int x, int y, int w, int h) {
   vt->damage = damage;
 }
 
-static void get_params(const char *sequence, int *params, int *num_params) {
-  int i = 0;
-  int num = 0;
-  int has_digit = 0;
-  while (sequence[i]) {
-    if (isdigit(sequence[i])) {
-      num = num * 10 + (sequence[i] - '0');
-      has_digit = 1;
-    } else if (sequence[i] == ';') {
-      params[(*num_params)++] = num;
-      num = 0;
-      has_digit = 0;
-    } else {
-      if (has_digit) {
-        params[(*num_params)++] = num;
+// Add one byte of a CSI sequence to the collected parameters. Returns 1 if
+// it was the final byte.
+static int csi_collect(struct csi *csi, char c) {
+  if (c >= '0' && c <= '9') {
+    if (!csi->count) {
+      csi->count = 1;
+    }
+
+    if (!csi->overflow) {
+      int *param = &csi->params[csi->count - 1];
+      *param = *param * 10 + (c - '0');
+      if (*param > CSI_PARAM_MAX) {
+        *param = CSI_PARAM_MAX;
       }
-      return;
+    }
+  } else if (c == ';' || c == ':') {
+    if (!csi->count) {
+      // leading empty parameter
+      csi->count = 1;
     }
 
-    ++i;
+    if (csi->count < CSI_MAX_PARAMS) {
+      if (c == ':') {
+        csi->sub |= 1u << csi->count;
+      }
+      ++csi->count;
+    } else {
+      csi->overflow = 1;
+    }
+  } else if (c >= '<' && c <= '?') {
+    csi->private_marker = c;
+  } else if (c >= ' ' && c <= '/') {
+    if (csi->num_intermediates < CSI_MAX_INTERMEDIATES) {
+      csi->intermediates[csi->num_intermediates++] = c;
+    }
+  } else {
+    return 1;
   }
 
-  params[(*num_params)++] = num;
+  return 0;
 }
 
-static void handle_bracket_seq(struct vt *vt) {
-  int params[6] = {1, 1, 1, 1, 1, 1};
-  int num_params = 0;
+// Parameter i of the current CSI sequence, or def if it's missing or 0.
+static int csi_param(struct vt *vt, int i, int def) {
+  if (i >= vt->csi.count || !vt->csi.params[i]) {
+    return def;
+  }
 
-  get_params(vt->sequence + 1, params, &num_params);
+  return vt->csi.params[i];
+}
 
-  /*
-  fprintf(stderr, "params: count=%d %d %d %d %d %d %d\n", num_params, params[0],
-          params[1], params[2], params[3], params[4], params[5]);
-  */
+static void handle_bracket_seq(struct vt *vt) {
+  struct csi *csi = &vt->csi;
 
   char last = vt->sequence[vt->seqidx - 1];
+
+  if (csi->num_intermediates ||
+      (csi->private_marker && csi->private_marker != '?')) {
+    // nothing with intermediates or other private markers is supported
+    fprintf(stderr, "unhandled bracket sequence %s\n", vt->sequence);
+    return;
+  }
+
   switch (last) {
   case 'g':
     // TBC - Tabulation Clear
-    if (num_params == 0 || params[0] == 0) {
-      vt->tabstops[vt->cx] = 0;
-    } else if (params[0] == 3) {
-      memset(vt->tabstops, 0, (size_t)vt->cols);
+    if (csi_param(vt, 0, 0) == 0) {
+      set_tabstop(vt, vt->cx, 0);
+    } else if (csi_param(vt, 0, 0) == 3) {
+      memset(vt->tabstops, 0,
+             TABSTOP_WORDS((size_t)vt->row_cap) * sizeof(uint64_t));
     }
     break;
+  case 'I':
+    // CHT - Cursor Horizontal Forward Tabulation
+    cursor_to(vt, next_tabstop(vt, vt->cx, csi_param(vt, 0, 1)), vt->cy, 0,
+              0);
+    vt->lcf = 0;
+    break;
+  case 'Z':
+    // CBT - Cursor Backward Tabulation
+    cursor_to(vt, prev_tabstop(vt, vt->cx, csi_param(vt, 0, 1)), vt->cy, 0,
+              0);
+    vt->lcf = 0;
+    break;
   case 'r':
-    // fprintf(stderr, "DECSTBM: num=%d %d %d [%s]\n", num_params, params[0], params[1], vt->sequence);
-    if (num_params == 0) {
-      vt->margin_top = 0;
-      vt->margin_bottom = vt->rows - 1;
-    } else if (num_params != 2) {
-      print_error("DECSTBM: expected 0 or 2 parameters: %s\n", vt->sequence);
-    } else {
-      vt->margin_top = params[0] - 1;
-      vt->margin_bottom = params[1] - 1;
-    }
+    // missing parameters default to the whole screen
+    vt->margin_top = csi_param(vt, 0, 1) - 1;
+    vt->margin_bottom = csi_param(vt, 1, vt->rows) - 1;
 
     if (vt->margin_top > vt->margin_bottom) {
       vt->margin_top = 0;
@@ -645,7 +1667,7 @@ static void handle_bracket_seq(struct vt *vt) {
     // K: EL - Erase in Line
 
     // fprintf(stderr, "cursor: %d, %d\n", vt->cx, vt->cy);
-    handle_erases(vt, last == 'J' ? 0 : 1, num_params == 1 ? params[0] : 0);
+    handle_erases(vt, last == 'J' ? 0 : 1, csi_param(vt, 0, 0));
 
     // erase cancel wrap as there is no longer a character at the cursor
     vt->lcf = 0;
@@ -657,31 +1679,31 @@ static void handle_bracket_seq(struct vt *vt) {
   case 'c':
     // DA - Device Attributes
     // Graphics option + Advanced video option
-    write_retry(vt->pty, "\033[?1;6c", 7);
+    queue_response(vt, "\033[?1;6c", 7);
     break;
   case 'n':
-    handle_reports_seq(vt, params, num_params);
+    handle_reports_seq(vt);
     break;
   case 'A':
-    cursor_up(vt, params[0] ? params[0] : 1, 0);
+    cursor_up(vt, csi_param(vt, 0, 1), 0);
     vt->lcf = 0;
     break;
   case 'B':
-    cursor_down(vt, params[0] ? params[0] : 1, 0);
+    cursor_down(vt, csi_param(vt, 0, 1), 0);
     vt->lcf = 0;
     break;
   case 'C':
-    cursor_fwd(vt, params[0] ? params[0] : 1, 0);
+    cursor_fwd(vt, csi_param(vt, 0, 1), 0);
     vt->lcf = 0;
     break;
   case 'D':
-    cursor_back(vt, params[0] ? params[0] : 1);
+    cursor_back(vt, csi_param(vt, 0, 1));
     vt->lcf = 0;
     break;
   case 'H':
     // fall through
   case 'f':
-    if (vt->seqidx == 2) {
+    if (!csi->count) {
       // CUP/HVP: Home
       cursor_home(vt);
     } else {
@@ -704,77 +1726,389 @@ static void handle_bracket_seq(struct vt *vt) {
         // Absolute mode
       }
 
-      cursor_to(vt, left_addend + (params[1] - 1), top_addend + (params[0] - 1),
-                0, cup);
+      cursor_to(vt, left_addend + (csi_param(vt, 1, 1) - 1),
+                top_addend + (csi_param(vt, 0, 1) - 1), 0, cup);
     }
     vt->lcf = 0;
     break;
   case 'm':
-    vt->current_attr.bold = 0;
-    vt->current_attr.blink = 0;
-    vt->current_attr.reverse = 0;
-    vt->current_attr.underline = 0;
-    for (int i = 0; i < num_params; ++i) {
-      if (params[i] == 1) {
-        vt->current_attr.bold = 1;
-      } else if (params[i] == 4) {
-        vt->current_attr.underline = 1;
-      } else if (params[i] == 5) {
-        vt->current_attr.blink = 1;
-      } else if (params[i] == 7) {
-        vt->current_attr.reverse = 1;
-      } else if (params[i] == 0) {
-        vt->current_attr.bold = 0;
-        vt->current_attr.blink = 0;
-        vt->current_attr.reverse = 0;
-        vt->current_attr.underline = 0;
-      }
-    }
+    handle_sgr(vt);
     break;
   case 'P':
     // DCH: Delete Character
-    for (int i = 0; i < params[0]; ++i) {
+    for (int i = 0; i < csi_param(vt, 0, 1); ++i) {
       delete_character(vt);
     }
     vt->lcf = 0;
     break;
   case 'L':
     // IL: Insert Line
-    for (int i = 0; i < params[0]; ++i) {
+    for (int i = 0; i < csi_param(vt, 0, 1); ++i) {
       insert_line(vt);
     }
     break;
   case 'M':
     // DL: Delete Line
-    for (int i = 0; i < params[0]; ++i) {
+    for (int i = 0; i < csi_param(vt, 0, 1); ++i) {
       delete_line(vt);
     }
     break;
+  case 'S':
+  case 'T': {
+    // S: SU - Scroll Up
+    // T: SD - Scroll Down
+    if (last == 'T' && csi->count > 1) {
+      // xterm's mouse highlight tracking, which isn't supported
+      break;
+    }
+
+    int n = csi_param(vt, 0, 1);
+    int height = vt->margin_bottom - vt->margin_top + 1;
+    for (int i = 0; i < n && i < height; ++i) {
+      if (last == 'S') {
+        scroll_up(vt);
+      } else {
+        scroll_down(vt);
+      }
+    }
+  } break;
+  case 'X': {
+    // ECH: Erase Character, leaving the cursor where it is
+    int end = vt->cx + csi_param(vt, 0, 1);
+    if (end > row_cols(vt, vt->current_row)) {
+      end = row_cols(vt, vt->current_row);
+    }
+    for (int x = vt->cx; x < end; ++x) {
+      set_char_in_row(vt, vt->current_row, x, ' ');
+    }
+    mark_damage(vt, vt->cx, vt->cy, end - vt->cx, 1);
+
+    vt->lcf = 0;
+  } break;
+  case 'b':
+    // REP: repeat the last graphic character
+    if (vt->last_cp) {
+      for (int i = 0; i < csi_param(vt, 0, 1); ++i) {
+        print_char(vt, vt->last_cp);
+      }
+    }
+    break;
   default:
     fprintf(stderr, "unhandled bracket sequence %c\n", last);
   }
 }
 
-static void handle_reports_seq(struct vt *vt, int *params, int num_params) {
-  (void)num_params;
+// Flags set and cleared by the SGR codes below 30. Colors and reset are
+// handled separately.
+struct sgr_op {
+  uint32_t set;
+  uint32_t clear;
+};
+
+static const struct sgr_op sgr_ops[30] = {
+    [1] = {ATTR_BOLD, 0},
+    [2] = {ATTR_DIM, 0},
+    [3] = {ATTR_ITALIC, 0},
+    [4] = {ATTR_UNDERLINE, 0},
+    [5] = {ATTR_BLINK, 0},
+    [6] = {ATTR_BLINK, 0},
+    [7] = {ATTR_REVERSE, 0},
+    [8] = {ATTR_HIDDEN, 0},
+    [9] = {ATTR_STRIKE, 0},
+    [21] = {ATTR_UNDERLINE, 0},
+    [22] = {0, ATTR_BOLD | ATTR_DIM},
+    [23] = {0, ATTR_ITALIC},
+    [24] = {0, ATTR_UNDERLINE},
+    [25] = {0, ATTR_BLINK},
+    [27] = {0, ATTR_REVERSE},
+    [28] = {0, ATTR_HIDDEN},
+    [29] = {0, ATTR_STRIKE},
+};
+
+static int csi_is_sub(struct csi *csi, int i) {
+  return i < csi->count && (csi->sub & (1u << i));
+}
+
+static uint32_t clamp_byte(int value) {
+  return value > 255 ? 255 : (uint32_t)value;
+}
+
+// Parse the extended color starting at parameter *i (38 or 48), in either
+// the ';' or ':' form. Leaves *i on the last parameter used and returns 1 if
+// a color was found.
+static int sgr_color(struct csi *csi, int *i, uint32_t *color) {
+  int *params = csi->params;
+  int start = *i;
+
+  if (csi_is_sub(csi, start + 1)) {
+    // 38:5:n or 38:2:[colorspace]:r:g:b, all as sub-parameters
+    int end = start + 1;
+    while (csi_is_sub(csi, end + 1)) {
+      ++end;
+    }
+    *i = end;
+
+    int n = end - start;
+    if (params[start + 1] == 5 && n >= 2) {
+      *color = color_indexed(clamp_byte(params[start + 2]));
+      return 1;
+    } else if (params[start + 1] == 2 && n >= 4) {
+      int rgb = end - 2;
+      *color = color_rgb(clamp_byte(params[rgb]), clamp_byte(params[rgb + 1]),
+                         clamp_byte(params[rgb + 2]));
+      return 1;
+    }
+    return 0;
+  }
+
+  if (start + 2 < csi->count && params[start + 1] == 5) {
+    *color = color_indexed(clamp_byte(params[start + 2]));
+    *i = start + 2;
+    return 1;
+  } else if (start + 4 < csi->count && params[start + 1] == 2) {
+    *color = color_rgb(clamp_byte(params[start + 2]),
+                       clamp_byte(params[start + 3]),
+                       clamp_byte(params[start + 4]));
+    *i = start + 4;
+    return 1;
+  }
+
+  // malformed; the rest of the sequence can't be trusted
+  *i = csi->count;
+  return 0;
+}
+
+// SGR - Select Graphic Rendition
+static void handle_sgr(struct vt *vt) {
+  struct csi *csi = &vt->csi;
+  struct cellattr *attr = &vt->current_attr;
+
+  if (!csi->count) {
+    memset(attr, 0, sizeof(*attr));
+  }
+
+  for (int i = 0; i < csi->count; ++i) {
+    int param = csi->params[i];
+    uint32_t color;
+
+    if (param == 0) {
+      memset(attr, 0, sizeof(*attr));
+    } else if (param == 4 && csi_is_sub(csi, i + 1)) {
+      // 4:0 turns underline off, any other style turns it on
+      if (csi->params[i + 1]) {
+        attr->flags |= ATTR_UNDERLINE;
+      } else {
+        attr->flags &= ~(uint32_t)ATTR_UNDERLINE;
+      }
+    } else if (param < 30) {
+      attr->flags = (attr->flags & ~sgr_ops[param].clear) | sgr_ops[param].set;
+    } else if (param <= 37) {
+      attr->fg = color_indexed((uint32_t)param - 30);
+    } else if (param == 38) {
+      if (sgr_color(csi, &i, &color)) {
+        attr->fg = color;
+      }
+    } else if (param == 39) {
+      attr->fg = COLOR_DEFAULT;
+    } else if (param >= 40 && param <= 47) {
+      attr->bg = color_indexed((uint32_t)param - 40);
+    } else if (param == 48) {
+      if (sgr_color(csi, &i, &color)) {
+        attr->bg = color;
+      }
+    } else if (param == 49) {
+      attr->bg = COLOR_DEFAULT;
+    } else if (param >= 90 && param <= 97) {
+      attr->fg = color_indexed((uint32_t)param - 90 + 8);
+    } else if (param >= 100 && param <= 107) {
+      attr->bg = color_indexed((uint32_t)param - 100 + 8);
+    }
+
+    // skip sub-parameters nothing above consumed
+    while (csi_is_sub(csi, i + 1)) {
+      ++i;
+    }
+  }
+
+  vt->current_attr_id = attr_intern(vt, attr);
+}
+
+static struct attr_block *alloc_attrs(uint32_t cap) {
+  struct attr_block *block =
+      calloc(1, sizeof(struct attr_block) + cap * sizeof(struct cellattr));
+  atomic_init(&block->refs, 1);
+  return block;
+}
+
+static void unref_attrs(struct attr_block *block) {
+  if (atomic_fetch_sub_explicit(&block->refs, 1, memory_order_acq_rel) == 1) {
+    free(block);
+  }
+}
+
+// Make the table's entries safe to change, with room for cap of them. If a
+// snapshot shares them, the entries in use are copied to a new block.
+static void writable_attrs(struct attr_table *table, uint32_t cap) {
+  struct attr_block *block = table->block;
+  if (atomic_load_explicit(&block->refs, memory_order_acquire) > 1) {
+    table->block = alloc_attrs(cap);
+    memcpy(table->block->entries, block->entries,
+           table->count * sizeof(struct cellattr));
+    unref_attrs(block);
+  } else if (cap != table->cap) {
+    table->block = realloc(block, sizeof(struct attr_block) +
+                                      cap * sizeof(struct cellattr));
+  }
+
+  table->cap = cap;
+  table->entries = table->block->entries;
+}
+
+static void attr_init(struct attr_table *table) {
+  table->cap = ATTR_TABLE_INITIAL;
+  table->block = alloc_attrs(table->cap);
+  table->entries = table->block->entries;
+  table->num_slots = table->cap * 2;
+  table->slots = calloc(table->num_slots, sizeof(uint32_t));
+
+  // index 0 is the default attributes, which calloc'd cells already use
+  table->count = 1;
+  table->slots[0] = 1;
+}
+
+static uint32_t attr_hash(const struct cellattr *attr) {
+  uint32_t hash = attr->fg * 0x9E3779B1u;
+  hash ^= attr->bg * 0x85EBCA77u;
+  hash ^= attr->flags * 0xC2B2AE3Du;
+  return hash ^ (hash >> 15);
+}
+
+static int attr_equal(const struct cellattr *a, const struct cellattr *b) {
+  return a->fg == b->fg && a->bg == b->bg && a->flags == b->flags;
+}
+
+static void attr_rehash(struct attr_table *table) {
+  memset(table->slots, 0, table->num_slots * sizeof(uint32_t));
+
+  uint32_t mask = table->num_slots - 1;
+  for (uint32_t id = 0; id < table->count; ++id) {
+    uint32_t i = attr_hash(&table->entries[id]) & mask;
+    while (table->slots[i]) {
+      i = (i + 1) & mask;
+    }
+    table->slots[i] = id + 1;
+  }
+}
+
+// Drop entries that no cell refers to, renumbering the rest.
+static void attr_compact(struct vt *vt) {
+  struct attr_table *table = &vt->attrs;
+
+  // old index -> new index + 1, or 0 if unused
+  uint32_t *remap = calloc(table->count, sizeof(uint32_t));
+  remap[0] = 1;
+
+  // the hidden screen keeps its attributes too
+  struct row *screens[] = {vt->screen, vt->other_screen};
+  for (size_t i = 0; i < sizeof(screens) / sizeof(screens[0]); ++i) {
+    for (struct row *row = screens[i]; row; row = row->next) {
+      for (int x = 0; x < vt->row_cap; ++x) {
+        remap[row->cells[x].attr] = 1;
+      }
+    }
+  }
+
+  // snapshots keep the old numbering
+  writable_attrs(table, table->cap);
+
+  uint32_t count = 0;
+  for (uint32_t id = 0; id < table->count; ++id) {
+    if (remap[id]) {
+      table->entries[count] = table->entries[id];
+      remap[id] = ++count;
+    }
+  }
+
+  for (size_t i = 0; i < sizeof(screens) / sizeof(screens[0]); ++i) {
+    for (struct row *row = screens[i]; row; row = row->next) {
+      // rows shared with a snapshot are only copied if they change
+      struct cell *cells = row->cells;
+      for (int x = 0; x < vt->row_cap; ++x) {
+        uint16_t attr = (uint16_t)(remap[cells[x].attr] - 1);
+        if (attr != cells[x].attr) {
+          cells = writable_cells(vt, row);
+          cells[x].attr = attr;
+        }
+      }
+    }
+  }
+
+  table->count = count;
+  attr_rehash(table);
+
+  free(remap);
+}
+
+// Find or add attr in the attribute table, returning its index.
+static uint16_t attr_intern(struct vt *vt, const struct cellattr *attr) {
+  struct attr_table *table = &vt->attrs;
+
+  uint32_t hash = attr_hash(attr);
+  uint32_t mask = table->num_slots - 1;
+  for (uint32_t i = hash & mask; table->slots[i]; i = (i + 1) & mask) {
+    uint32_t id = table->slots[i] - 1;
+    if (attr_equal(&table->entries[id], attr)) {
+      return (uint16_t)id;
+    }
+  }
+
+  if (table->count == ATTR_TABLE_MAX) {
+    attr_compact(vt);
+    if (table->count == ATTR_TABLE_MAX) {
+      print_error("attribute table full, using default attributes\n");
+      return 0;
+    }
+  }
 
-  char question = vt->sequence[1];
-  if (question == '?') {
-    switch (params[0]) {
+  if (table->count == table->cap) {
+    writable_attrs(table, table->cap * 2);
+    table->num_slots = table->cap * 2;
+    table->slots = realloc(table->slots, table->num_slots * sizeof(uint32_t));
+    attr_rehash(table);
+  }
+
+  uint32_t id = table->count++;
+  table->entries[id] = *attr;
+
+  // compaction or growth may have moved everything, so probe afresh
+  mask = table->num_slots - 1;
+  uint32_t i = hash & mask;
+  while (table->slots[i]) {
+    i = (i + 1) & mask;
+  }
+  table->slots[i] = id + 1;
+
+  return (uint16_t)id;
+}
+
+static void handle_reports_seq(struct vt *vt) {
+  int param = csi_param(vt, 0, 0);
+  if (vt->csi.private_marker == '?') {
+    switch (param) {
     case 15:
       // Device Status Report (Printer)
       // report no printer
-      write_retry(vt->pty, "\033[?13n", 6);
+      queue_response(vt, "\033[?13n", 6);
       break;
     default:
       fprintf(stderr, "nihterm: unknown DSR request: %s\n", vt->sequence);
     }
   } else {
-    switch (params[0]) {
+    switch (param) {
     case 5:
       // Device Status Report (VT102)
       // report OK
-      write_retry(vt->pty, "\033[0n", 4);
+      queue_response(vt, "\033[0n", 4);
       break;
     case 6: {
       // Device Status Report (cursor position)
@@ -783,8 +2117,8 @@ static void handle_reports_seq(struct vt *vt, int *params, int num_params) {
       if (n < 0) {
         print_error("failed to sprintf cursor position report: %s\n",
                     strerror(errno));
-      } else if (write_retry(vt->pty, buf, (size_t)n) <= 0) {
-        print_error("failed to write cursor position: %s\n", strerror(errno));
+      } else {
+        queue_response(vt, buf, (size_t)n);
       }
     } break;
     }
@@ -792,98 +2126,128 @@ static void handle_reports_seq(struct vt *vt, int *params, int num_params) {
 }
 
 static void handle_modes(struct vt *vt, int set) {
-  if (vt->sequence[1] == '?') {
-    int param = 0;
-    int count = sscanf(vt->sequence, "[?%d", &param);
-    if (count != 1) {
-      print_error("failed to parse DEC mode sequence '%s'\n", vt->sequence);
-    }
+  if (!vt->csi.count) {
+    print_error("no modes given to set/reset: '%s'\n", vt->sequence);
+    return;
+  }
 
-    // fprintf(stderr, "DEC mode %d: %d\n", set, param);
+  // each parameter is a separate mode
+  for (int i = 0; i < vt->csi.count; ++i) {
+    if (vt->csi.private_marker == '?') {
+      handle_dec_mode(vt, vt->csi.params[i], set);
+    } else {
+      handle_ansi_mode(vt, vt->csi.params[i], set);
+    }
+  }
+}
 
-    switch (param) {
-    case 1:
-      // DECCKM (set = Application, reset = Cursor)
-      vt->mode.decckm = set;
-      break;
-    case 2:
-      // DECANM (set = ANSI, reset = VT52)
-      vt->mode.decanm = set;
-      break;
-    case 3:
-      // DECCOLM (set = 132, reset = 80)
-      vt->mode.deccolm = set;
-      if (vt->mode.deccolm) {
-        vt->cols = 132;
-      } else {
-        vt->cols = 80;
-      }
-      erase_screen(vt);
-      cursor_home(vt);
-      if (vt->graphics) {
-        graphics_resize(vt->graphics, vt->cols, vt->rows);
-      }
-      vt->margin_right = vt->cols;
+static void handle_dec_mode(struct vt *vt, int param, int set) {
+  switch (param) {
+  case 1:
+    // DECCKM (set = Application, reset = Cursor)
+    vt->mode.decckm = set;
+    break;
+  case 2:
+    // DECANM (set = ANSI, reset = VT52)
+    vt->mode.decanm = set;
+    break;
+  case 3: {
+    // DECCOLM (set = 132, reset = 80)
+    vt->mode.deccolm = set;
+    int old_cols = vt->cols;
+    if (vt->mode.deccolm) {
+      vt->cols = 132;
+    } else {
+      vt->cols = 80;
+    }
+    erase_screen(vt);
+    fit_other_screen(vt, old_cols);
+    cursor_home(vt);
+    if (vt->graphics) {
+      graphics_resize(vt->graphics, vt->cols, vt->rows);
+    }
+    vt->margin_right = vt->cols;
+    update_winsize(vt);
 
-      vt->lcf = 0;
-      break;
-    case 4:
-      // DECSCLM (set = Smooth, reset = Jump)
-      vt->mode.decsclm = set;
-      break;
-    case 5:
-      // DECSCNM (set = Reverse, reset = Normal)
-      vt->mode.decscnm = set;
+    vt->lcf = 0;
+  } break;
+  case 4:
+    // DECSCLM (set = Smooth, reset = Jump)
+    vt->mode.decsclm = set;
+    break;
+  case 5:
+    // DECSCNM (set = Reverse, reset = Normal)
+    vt->mode.decscnm = set;
 
-      if (vt->graphics) {
-        graphics_invert(vt->graphics, set);
-      }
+    if (vt->graphics) {
+      graphics_invert(vt->graphics, set);
+    }
 
-      mark_damage(vt, 0, 0, vt->cols, vt->rows);
-      break;
-    case 6:
-      // DECOM (set = Relative, reset = Absolute)
-      vt->mode.decom = set;
+    mark_damage(vt, 0, 0, vt->cols, vt->rows);
+    break;
+  case 6:
+    // DECOM (set = Relative, reset = Absolute)
+    vt->mode.decom = set;
 
-      vt->lcf = 0;
+    vt->lcf = 0;
 
-      // when changing DECOM, the cursor is homed
-      cursor_home(vt);
-      break;
-    case 7:
-      // DECAWM (set = Wrap, reset = No Wrap)
-      vt->mode.decawm = set;
+    // when changing DECOM, the cursor is homed
+    cursor_home(vt);
+    break;
+  case 7:
+    // DECAWM (set = Wrap, reset = No Wrap)
+    if (!set || !vt->mode.decawm) {
+      // a character written at the margin without wrap doesn't wrap later
+      vt->lcf = 0;
+    }
 
-      if (!set) {
-        vt->lcf = 0;
-      }
+    vt->mode.decawm = set;
 
-      break;
-    case 8:
-      // DECARM (set = On, reset = Off)
-      vt->mode.decarm = set;
-      break;
-    case 18:
-      // DECPFF (set = On, reset = Off)
-      vt->mode.decpff = set;
-      break;
-    case 19:
-      // DECPEX (set = On, reset = Off)
-      vt->mode.decpex = set;
-      break;
-    default:
-      print_error("unknown DEC mode %d\n", param);
+    break;
+  case 8:
+    // DECARM (set = On, reset = Off)
+    vt->mode.decarm = set;
+    break;
+  case 18:
+    // DECPFF (set = On, reset = Off)
+    vt->mode.decpff = set;
+    break;
+  case 19:
+    // DECPEX (set = On, reset = Off)
+    vt->mode.decpex = set;
+    break;
+  case 47:
+    // alternate screen
+    switch_screen(vt, set);
+    break;
+  case 1047:
+    // alternate screen, cleared on the way out
+    if (!set && vt->alt_active) {
+      erase_screen(vt);
     }
-    return;
-  }
-
-  int param = 0;
-  int count = sscanf(vt->sequence, "[%d", &param);
-  if (count != 1) {
-    print_error("failed to parse mode sequence '%s'\n", vt->sequence);
-    return;
+    switch_screen(vt, set);
+    break;
+  case 1049:
+    // DECSC and a cleared alternate screen, DECRC on the way out
+    if (set && !vt->alt_active) {
+      save_cursor(vt);
+      switch_screen(vt, 1);
+      erase_screen(vt);
+    } else if (!set && vt->alt_active) {
+      switch_screen(vt, 0);
+      restore_cursor(vt);
+    }
+    break;
+  case 2004:
+    // Bracketed paste (set = On, reset = Off)
+    vt->mode.bracketed_paste = set;
+    break;
+  default:
+    print_error("unknown DEC mode %d\n", param);
   }
+}
 
+static void handle_ansi_mode(struct vt *vt, int param, int set) {
   switch (param) {
   case 2:
     // KAM (set = Locked, reset = Unlocked)
@@ -937,6 +2301,8 @@ static void handle_erases(struct vt *vt, int line, int n) {
 
 static void erase_line(struct vt *vt) {
   struct row *row = get_row(vt, vt->cy, NULL);
+  clear_images(row);
+  row->wrapped = 0;
 
   for (int x = 0; x < row_cols(vt, row); ++x) {
     set_char_in_row(vt, row, x, ' ');
@@ -946,14 +2312,24 @@ static void erase_line(struct vt *vt) {
 }
 
 static void erase_screen(struct vt *vt) {
-  for (int y = 0; y < vt->rows; ++y) {
-    struct row *row = get_row(vt, y, NULL);
+  // whole rows are blanked, so no wide characters are left half erased
+  struct cell blank;
+  memset(&blank, 0, sizeof(blank));
+  set_cp(vt, &blank, ' ');
+  blank.attr = vt->current_attr_id;
+
+  struct row *row = vt->screen;
+  for (int y = 0; y < vt->rows && row; ++y, row = row->next) {
     row->dbl_width = 0;
     row->dbl_height = 0;
+    row->wrapped = 0;
+    clear_images(row);
 
-    for (int x = 0; x < row_cols(vt, row); ++x) {
-      set_char_in_row(vt, row, x, ' ');
+    struct cell *cells = writable_cells(vt, row);
+    for (int x = 0; x < vt->cols; ++x) {
+      cells[x] = blank;
     }
+    row->dirty = 1;
   }
 
   mark_damage(vt, 0, 0, vt->cols, vt->rows);
@@ -979,6 +2355,8 @@ static void erase_screen_cursor(struct vt *vt, int before) {
     struct row *row = get_row(vt, y, NULL);
     row->dbl_width = 0;
     row->dbl_height = 0;
+    row->wrapped = 0;
+    clear_images(row);
 
     for (int x = 0; x < row_cols(vt, row); ++x) {
       set_char_in_row(vt, row, x, ' ');
@@ -992,19 +2370,27 @@ static void erase_screen_cursor(struct vt *vt, int before) {
   mark_damage(vt, 0, sy, vt->cols, ey - sy);
 }
 
-static void set_char_in_row(struct vt *vt, struct row *row, int x, char c) {
+static void set_char_in_row(struct vt *vt, struct row *row, int x, uint32_t cp) {
   if (x >= row_cols(vt, row)) {
     print_error("set_char_at out of bounds (x %d)\n", x);
     return;
   }
 
-  set_cp(vt, &row->cells[x], c);
-  row->cells[x].attr = vt->current_attr;
+  // overwriting either half of a wide character blanks the other half
+  struct cell *cell = &writable_cells(vt, row)[x];
+  if ((cell->flags & CELL_WIDE_SPACER) && x > 0) {
+    set_cp(vt, cell - 1, ' ');
+  } else if ((cell->flags & CELL_WIDE) && x + 1 < row_cols(vt, row)) {
+    set_cp(vt, cell + 1, ' ');
+  }
+
+  set_cp(vt, cell, cp);
+  cell->attr = vt->current_attr_id;
 
   row->dirty = 1;
 }
 
-static void insert_char_at(struct vt *vt, int x, int y, char c) {
+static void insert_char_at(struct vt *vt, int x, int y, uint32_t cp) {
   if (x >= vt->cols || y >= vt->rows) {
     print_error("insert_char_at out of bounds (%d, %d)\n", x, y);
     return;
@@ -1016,20 +2402,37 @@ static void insert_char_at(struct vt *vt, int x, int y, char c) {
     return;
   }
 
+  int right = row_cols(vt, row);
+  if (x >= right) {
+    print_error("insert_char_at out of bounds (x %d)\n", x);
+    return;
+  }
+
   // move characters right. last character is lost.
-  memmove(&row->cells[x + 1], &row->cells[x],
-          sizeof(struct cell) * (size_t)(vt->cols - x - 1));
+  struct cell *cells = writable_cells(vt, row);
+  split_wide(vt, cells, x);
+  split_wide(vt, cells, right - 1);
+  memmove(&cells[x + 1], &cells[x],
+          sizeof(struct cell) * (size_t)(right - x - 1));
 
-  set_cp(vt, &row->cells[x], c);
-  row->cells[x].attr = vt->current_attr;
+  set_cp(vt, &cells[x], cp);
+  cells[x].attr = vt->current_attr_id;
 
   row->dirty = 1;
 }
 
+// Blanks a wide character whose right half is cell x, before the row is
+// shifted apart there and the halves would end up on their own.
+static void split_wide(struct vt *vt, struct cell *cells, int x) {
+  if (x > 0 && (cells[x].flags & CELL_WIDE_SPACER)) {
+    set_cp(vt, &cells[x - 1], ' ');
+    set_cp(vt, &cells[x], ' ');
+  }
+}
+
 static void scroll_up(struct vt *vt) {
   struct row *prev = NULL;
   struct row *row = get_row(vt, vt->margin_top, &prev);
-  struct row *bottom_row = get_row(vt, vt->margin_bottom, NULL);
 
   if (prev) {
     prev->next = row->next;
@@ -1037,8 +2440,12 @@ static void scroll_up(struct vt *vt) {
     vt->screen = row->next;
   }
 
-  free_row(row);
+  release_row(vt, row);
 
+  // a one-line region's bottom line is the one just released
+  struct row *bottom_row = vt->margin_bottom > 0
+                               ? get_row(vt, vt->margin_bottom - 1, NULL)
+                               : NULL;
   screen_insert_line(vt, bottom_row);
 
   mark_damage(vt, 0, vt->margin_top, vt->cols, vt->margin_bottom);
@@ -1049,8 +2456,12 @@ static void scroll_down(struct vt *vt) {
   get_row(vt, vt->margin_top, &prev);
   struct row *last_row = get_row(vt, vt->margin_bottom, &last_prev);
 
-  last_prev->next = last_row->next;
-  free_row(last_row);
+  if (last_prev) {
+    last_prev->next = last_row->next;
+  } else {
+    vt->screen = last_row->next;
+  }
+  release_row(vt, last_row);
 
   screen_insert_line(vt, prev);
 
@@ -1098,9 +2509,10 @@ static void handle_pound_seq(struct vt *vt) {
     {
       struct row *row = vt->screen;
       while (row) {
+        struct cell *cells = writable_cells(vt, row);
         for (int x = 0; x < row_cols(vt, row); ++x) {
-          set_cp(vt, &row->cells[x], 'E');
-          row->cells[x].attr = vt->current_attr;
+          set_cp(vt, &cells[x], 'E');
+          cells[x].attr = vt->current_attr_id;
         }
 
         row = row->next;
@@ -1117,6 +2529,13 @@ static void handle_pound_seq(struct vt *vt) {
     if (vt->cx >= vt->margin_right) {
       vt->cx = vt->margin_right - 1;
     }
+
+    // a wide character across the new right edge can't be shown whole
+    struct row *row = get_row(vt, vt->cy, NULL);
+    int right = row_cols(vt, row);
+    if (right < vt->cols && (row->cells[right].flags & CELL_WIDE_SPACER)) {
+      split_wide(vt, writable_cells(vt, row), right);
+    }
   }
 }
 
@@ -1151,10 +2570,10 @@ static struct row *append_line(struct vt *vt, struct row *after) {
 }
 
 static struct row *screen_insert_line(struct vt *vt, struct row *prev) {
-  struct row *new_row = calloc(1, sizeof(struct row));
+  struct row *new_row = alloc_row(vt);
   for (int x = 0; x < vt->cols; ++x) {
     set_cp(vt, &new_row->cells[x], ' ');
-    new_row->cells[x].attr = vt->current_attr;
+    new_row->cells[x].attr = vt->current_attr_id;
   }
 
   if (prev) {
@@ -1173,12 +2592,23 @@ static struct row *screen_insert_line(struct vt *vt, struct row *prev) {
 static void delete_character(struct vt *vt) {
   struct row *row = get_row(vt, vt->cy, NULL);
 
-  memmove(&row->cells[vt->cx], &row->cells[vt->cx + 1],
-          sizeof(struct cell) * (size_t)(vt->cols - vt->cx - 1));
+  // a double-width line ends halfway, and what's past that stays put
+  int right = row_cols(vt, row);
+  if (vt->cx >= right) {
+    return;
+  }
+
+  struct cell *cells = writable_cells(vt, row);
+  split_wide(vt, cells, vt->cx);
+  if (vt->cx + 1 < right) {
+    split_wide(vt, cells, vt->cx + 1);
+  }
+  memmove(&cells[vt->cx], &cells[vt->cx + 1],
+          sizeof(struct cell) * (size_t)(right - vt->cx - 1));
 
   // TODO(miselin): I think this actually is meant to be the rightmost attribute
-  set_cp(vt, &row->cells[vt->cols - 1], ' ');
-  row->cells[vt->cols - 1].attr = vt->current_attr;
+  set_cp(vt, &cells[right - 1], ' ');
+  cells[right - 1].attr = vt->current_attr_id;
 
   row->dirty = 1;
 
@@ -1194,17 +2624,19 @@ static void delete_line(struct vt *vt) {
   struct row *prev = NULL;
   struct row *row = get_row(vt, vt->cy, &prev);
 
-  struct row *bottom_prev = NULL;
-  struct row *bottom = get_row(vt, vt->margin_bottom, &bottom_prev);
-
   if (!prev) {
     vt->screen = row->next;
   } else {
     prev->next = row->next;
   }
 
-  free_row(row);
+  release_row(vt, row);
 
+  // the blank line goes in at the bottom of the region, which is now one line
+  // shorter; the cursor's line may have been the bottom one itself
+  struct row *bottom = vt->margin_bottom > 0
+                           ? get_row(vt, vt->margin_bottom - 1, NULL)
+                           : NULL;
   screen_insert_line(vt, bottom);
 
   mark_damage(vt, 0, vt->cy, vt->cols, vt->rows - vt->cy);
@@ -1216,13 +2648,10 @@ static void insert_line(struct vt *vt) {
     return;
   }
 
-  struct row *prev = NULL;
-  if (vt->cy > 0) {
-    prev = get_row(vt, vt->cy, NULL);
-  }
-
+  // the bottom line of the region drops off, and a blank one goes in above
+  // the cursor's line
   struct row *bottom_prev = NULL;
-  struct row *bottom = get_row(vt, vt->margin_bottom - 2, &bottom_prev);
+  struct row *bottom = get_row(vt, vt->margin_bottom, &bottom_prev);
 
   if (bottom_prev) {
     bottom_prev->next = bottom->next;
@@ -1230,7 +2659,10 @@ static void insert_line(struct vt *vt) {
     vt->screen = bottom->next;
   }
 
-  free(bottom);
+  release_row(vt, bottom);
+
+  struct row *prev = NULL;
+  get_row(vt, vt->cy, &prev);
 
   screen_insert_line(vt, prev);
 
@@ -1245,8 +2677,13 @@ void vt_fill(struct vt *vt, char **buffer) {
   while (row && y < vt->rows) {
     int x;
     for (x = 0; x < vt->cols; ++x) {
-      (*buffer)[(y * (vt->cols + 1)) + x] =
-          row->cells[x].cp[0]; // TODO: breaks for real utf-8 chars
+      // one byte per cell, so anything outside ASCII shows as '?'
+      struct cell *cell = &row->cells[x];
+      char c = cell->cp < 0x80 ? (char)cell->cp : '?';
+      if (cell->flags & CELL_WIDE_SPACER) {
+        c = ' ';
+      }
+      (*buffer)[(y * (vt->cols + 1)) + x] = c;
     }
 
     (*buffer)[(y * (vt->cols + 1)) + x] = '\n';
@@ -1256,370 +2693,1719 @@ void vt_fill(struct vt *vt, char **buffer) {
   }
 }
 
-static ssize_t write_retry(int fd, const char *buffer, size_t length) {
-  while (1) {
-    ssize_t rc = write(fd, buffer, length);
-    if (rc < 0) {
-      if (errno == EINTR) {
-        continue;
-      }
+// Text for vt_fill_into, written as far as it fits and counted in full.
+struct fill_out {
+  char *buf;
+  size_t cap;
+  size_t len;
+  // bytes in buf; stops growing at the first character that doesn't fit
+  size_t written;
+};
 
-      fprintf(stderr, "nihterm: write_retry failed: %s\n", strerror(errno));
-    }
+static void fill_put(struct fill_out *out, const char *data, size_t length) {
+  // leave room for the NUL
+  if (out->written == out->len && out->len + length < out->cap) {
+    memcpy(out->buf + out->written, data, length);
+    out->written += length;
+  }
+  out->len += length;
+}
 
-    return rc;
+static void fill_cell(struct fill_out *out, const struct cell *cell) {
+  char utf8[4 * (1 + CELL_MAX_COMBINING)];
+  size_t n = utf8_encode(cell->cp ? cell->cp : ' ', utf8);
+  for (int i = 0; i < CELL_MAX_COMBINING && cell->combining[i]; ++i) {
+    n += utf8_encode(cell->combining[i], utf8 + n);
   }
+  fill_put(out, utf8, n);
 }
 
-void free_row(struct row *row) { free(row); }
+// Copy the plain ASCII cells from cells[from] on, as long as they fit,
+// returning where it stopped. Most of the screen goes through here.
+static int fill_ascii(struct fill_out *out, const struct cell *cells, int from,
+                      int to) {
+  if (out->written != out->len || out->len + 1 >= out->cap) {
+    return from;
+  }
 
-static int next_tabstop(struct vt *vt, int x) {
-  struct row *row = get_row(vt, vt->cy, NULL);
+  // leave room for the NUL
+  size_t room = out->cap - out->len - 1;
+  if ((size_t)(to - from) > room) {
+    to = from + (int)room;
+  }
 
-  int width = row_cols(vt, row);
-  for (int i = x + 1; i < width; ++i) {
-    if (vt->tabstops[i]) {
-      return i;
+  char *p = out->buf + out->written;
+  int x = from;
+  for (; x < to; ++x) {
+    const struct cell *cell = &cells[x];
+    if (cell->cp >= 0x80 || !cell->cp || cell->combining[0] || cell->flags) {
+      break;
     }
+    *p++ = (char)cell->cp;
   }
 
-  return width - 1;
+  out->written += (size_t)(x - from);
+  out->len += (size_t)(x - from);
+  return x;
 }
 
-static void do_vt52(struct vt *vt) {
-  // fprintf(stderr, "vt52: %s\n", vt->sequence);
+static int fill_blank(const struct cell *cell) {
+  return (cell->cp == ' ' || !cell->cp) && !cell->combining[0] &&
+         !(cell->flags & CELL_WIDE_SPACER);
+}
 
-  switch (vt->sequence[0]) {
-  case 'A':
-    cursor_up(vt, 1, 0);
-    vt->lcf = 0;
-    break;
-  case 'B':
-    cursor_down(vt, 1, 0);
-    vt->lcf = 0;
-    break;
-  case 'C':
-    cursor_fwd(vt, 1, 0);
-    vt->lcf = 0;
-    break;
-  case 'D':
-    cursor_back(vt, 1);
-    vt->lcf = 0;
-    break;
-  case 'F':
-    // Select Special Graphics character set
-    vt->charset = 1;
-    break;
-  case 'G':
-    // Select ASCII character set
-    vt->charset = 0;
-    break;
-  case 'H':
-    cursor_home(vt);
-    break;
-  case 'I':
-    cursor_up(vt, 1, 1);
-    break;
-  case 'J':
-    erase_screen_cursor(vt, 0);
-    break;
-  case 'K':
-    erase_line_cursor(vt, 0);
-    break;
-  case 'Y':
-    // Direct cursor address - has two params
-    if (vt->seqidx < 3) {
-      return;
+size_t vt_fill_into(struct vt *vt, char *buf, size_t cap, unsigned flags) {
+  return vt_fill_region(vt, 0, 0, vt->cols, vt->rows, buf, cap, flags);
+}
+
+size_t vt_fill_region(struct vt *vt, int x, int y, int w, int h, char *buf,
+                      size_t cap, unsigned flags) {
+  struct fill_out out = {buf, cap, 0, 0};
+
+  int left = x < 0 ? 0 : x;
+  int top = y < 0 ? 0 : y;
+  int right = x + w > vt->cols ? vt->cols : x + w;
+  int bottom = y + h > vt->rows ? vt->rows : y + h;
+
+  struct row *row = get_row(vt, top, NULL);
+  for (int ry = top; ry < bottom && row; ++ry, row = row->next) {
+    int end = right < row_cols(vt, row) ? right : row_cols(vt, row);
+    if (flags & VT_FILL_TRIM) {
+      while (end > left && fill_blank(&row->cells[end - 1])) {
+        --end;
+      }
     }
 
-    char l = vt->sequence[1];
-    char c = vt->sequence[2];
-    cursor_to(vt, c - 037 - 1, l - 037 - 1, 0, 0);
-    break;
-  case 'Z':
-    // Identify
-    write_retry(vt->pty, "\033/Z", 3);
-    break;
-  case '=':
-    // Enter alternate keypad mode
-    break;
-  case '>':
-    // Exit alternate keypad mode
-    break;
-  case '<':
-    // Enter ANSI mode
-    vt->mode.decanm = 1;
-    break;
-  default:
-    print_error("unknown vt52 sequence: %s\n", vt->sequence);
+    for (int rx = left; rx < end; ++rx) {
+      rx = fill_ascii(&out, row->cells, rx, end);
+      if (rx == end) {
+        break;
+      }
+
+      const struct cell *cell = &row->cells[rx];
+      if (cell->flags & CELL_WIDE_SPACER) {
+        // the character was written with its left half, unless that's
+        // outside the region
+        if (rx == left) {
+          fill_put(&out, " ", 1);
+        }
+        continue;
+      }
+
+      fill_cell(&out, cell);
+    }
+
+    fill_put(&out, "\n", 1);
   }
 
-  end_sequence(vt);
-}
+  if (cap) {
+    buf[out.written] = 0;
+  }
 
-static void end_sequence(struct vt *vt) {
-  vt->in_sequence = 0;
-  vt->seqidx = 0;
-  memset(vt->sequence, 0, sizeof(vt->sequence));
+  return out.len;
 }
 
-static void handle_paren_seq(struct vt *vt) {
-  if (vt->seqidx < 2) {
-    return;
+struct cellattr vt_attr(struct vt *vt, int x, int y) {
+  struct cellattr attr = {0, 0, 0};
+  if (x < 0 || x >= vt->cols || y < 0 || y >= vt->rows) {
+    return attr;
   }
 
-  // fprintf(stderr, "paren: %s\n", vt->sequence);
+  return vt->attrs.entries[get_row(vt, y, NULL)->cells[x].attr];
+}
 
-  int new_charset = 0;
-  switch (vt->sequence[1]) {
-  case 'A':
-    // UK
-    new_charset = 2;
-    break;
-  case 'B':
-    // ASCII
-    new_charset = 0;
-    break;
-  case '0':
-    // special graphics
-    new_charset = 1;
-    break;
-  case '1':
-    // alternate standard characters
-    new_charset = 0;
-    break;
-  case '2':
-    // alternate special graphics
-    new_charset = 1;
-    break;
+uint32_t vt_codepoint(struct vt *vt, int x, int y) {
+  if (x < 0 || x >= vt->cols || y < 0 || y >= vt->rows) {
+    return 0;
   }
 
-  if (vt->sequence[0] == '(') {
-    vt->charset_g0 = new_charset;
-  } else {
-    vt->charset_g1 = new_charset;
+  return get_row(vt, y, NULL)->cells[x].cp;
+}
+
+struct snapshot *vt_snapshot(struct vt *vt) {
+  struct snapshot *snap = calloc(1, sizeof(struct snapshot));
+  atomic_init(&snap->refs, 1);
+  snap->rows = vt->rows;
+  snap->cols = vt->cols;
+  snap->cx = vt->cx;
+  snap->cy = vt->cy;
+
+  snap->lines = calloc((size_t)vt->rows, sizeof(struct snapshot_row));
+  snap->blocks = calloc((size_t)vt->rows, sizeof(struct cell_block *));
+
+  struct row *row = vt->screen;
+  for (int y = 0; y < vt->rows && row; ++y, row = row->next) {
+    atomic_fetch_add_explicit(&row->block->refs, 1, memory_order_relaxed);
+    snap->blocks[y] = row->block;
+
+    snap->lines[y].cells = row->cells;
+    snap->lines[y].dbl_width = row->dbl_width;
+    snap->lines[y].dbl_height = row->dbl_height ? row->dbl_side + 1 : 0;
+    snap->lines[y].wrapped = row->wrapped;
   }
 
-  // fprintf(stderr, " -> G0 %d, G1 %d\n", vt->charset_g0, vt->charset_g1);
+  // entries up to count don't change while the block is shared
+  atomic_fetch_add_explicit(&vt->attrs.block->refs, 1, memory_order_relaxed);
+  snap->attr_block = vt->attrs.block;
+  snap->attrs = vt->attrs.entries;
+  snap->num_attrs = vt->attrs.count;
+
+  return snap;
 }
 
-void set_cp(struct vt *vt, struct cell *cell, char c) {
-  memset(cell->cp, 0, 5);
+struct snapshot *vt_snapshot_ref(struct snapshot *snap) {
+  atomic_fetch_add_explicit(&snap->refs, 1, memory_order_relaxed);
+  return snap;
+}
 
-  // standard charset
-  if (vt->charset == 0 || vt->charset == 2) {
-    if (vt->charset == 2 && c == '#') {
-      // UK character set: pound sign instead of #
-      cell->cp[0] = '\xc2';
-      cell->cp[1] = '\xa3';
-      cell->cp_len = 2;
-    } else {
-      cell->cp[0] = c;
-      cell->cp[1] = 0;
-      cell->cp_len = 1;
-    }
+void vt_snapshot_release(struct snapshot *snap) {
+  if (atomic_fetch_sub_explicit(&snap->refs, 1, memory_order_acq_rel) != 1) {
     return;
   }
 
-  // graphics charset
-  int set = 1;
-  switch (c) {
-  case 0x5f:
-    set = 0;
-    c = ' ';
-    break;
-  case 0x60:
-    cell->cp[0] = '\xe2';
-    cell->cp[1] = '\x97';
-    cell->cp[2] = '\x86';
-    cell->cp_len = 3;
-    break;
-  case 0x61:
-    cell->cp[0] = '\xe2';
-    cell->cp[1] = '\x96';
-    cell->cp[2] = '\x92';
-    cell->cp_len = 3;
-    break;
-  case 0x62:
-    cell->cp[0] = '\xe2';
-    cell->cp[1] = '\x90';
-    cell->cp[2] = '\x89';
-    cell->cp_len = 3;
-    break;
-  case 0x63:
-    cell->cp[0] = '\xe2';
-    cell->cp[1] = '\x90';
-    cell->cp[2] = '\x8c';
-    cell->cp_len = 3;
-    break;
-  case 0x64:
-    cell->cp[0] = '\xe2';
-    cell->cp[1] = '\x90';
-    cell->cp[2] = '\x8d';
-    cell->cp_len = 3;
-    break;
-  case 0x65:
-    cell->cp[0] = '\xe2';
-    cell->cp[1] = '\x90';
-    cell->cp[2] = '\x8a';
-    cell->cp_len = 3;
-    break;
-  case 0x66:
-    cell->cp[0] = '\xc2';
-    cell->cp[1] = '\xb0';
-    cell->cp_len = 2;
-    break;
-  case 0x67:
-    cell->cp[0] = '\xc2';
-    cell->cp[1] = '\xb1';
-    cell->cp_len = 2;
-    break;
-  case 0x68:
-    cell->cp[0] = '\xe2';
-    cell->cp[1] = '\x90';
-    cell->cp[2] = '\xa4';
-    cell->cp_len = 3;
-    break;
-  case 0x69:
-    cell->cp[0] = '\xe2';
-    cell->cp[1] = '\x90';
-    cell->cp[2] = '\x8b';
-    cell->cp_len = 3;
-    break;
-  case 0x6a:
-    cell->cp[0] = '\xe2';
-    cell->cp[1] = '\x94';
-    cell->cp[2] = '\x98';
-    cell->cp_len = 3;
-    break;
-  case 0x6b:
-    cell->cp[0] = '\xe2';
-    cell->cp[1] = '\x94';
-    cell->cp[2] = '\x90';
-    cell->cp_len = 3;
-    break;
-  case 0x6c:
-    cell->cp[0] = '\xe2';
-    cell->cp[1] = '\x94';
-    cell->cp[2] = '\x8c';
-    cell->cp_len = 3;
-    break;
-  case 0x6d:
-    cell->cp[0] = '\xe2';
-    cell->cp[1] = '\x94';
-    cell->cp[2] = '\x94';
-    cell->cp_len = 3;
-    break;
-  case 0x6e:
-    cell->cp[0] = '\xe2';
-    cell->cp[1] = '\x94';
-    cell->cp[2] = '\xbc';
-    cell->cp_len = 3;
-    break;
-  case 0x6f:
-    cell->cp[0] = '\xe2';
-    cell->cp[1] = '\x8e';
-    cell->cp[2] = '\xba';
-    cell->cp_len = 3;
-    break;
-  case 0x70:
-    cell->cp[0] = '\xe2';
-    cell->cp[1] = '\x8e';
-    cell->cp[2] = '\xbb';
-    cell->cp_len = 3;
-    break;
-  case 0x71:
-    cell->cp[0] = '\xe2';
-    cell->cp[1] = '\x94';
-    cell->cp[2] = '\x80';
-    cell->cp_len = 3;
-    break;
-  case 0x72:
-    cell->cp[0] = '\xe2';
-    cell->cp[1] = '\x8e';
-    cell->cp[2] = '\xbc';
-    cell->cp_len = 3;
-    break;
-  case 0x73:
-    cell->cp[0] = '\xe2';
-    cell->cp[1] = '\x8e';
-    cell->cp[2] = '\xbd';
-    cell->cp_len = 3;
-    break;
-  case 0x74:
-    cell->cp[0] = '\xe2';
-    cell->cp[1] = '\x94';
-    cell->cp[2] = '\x9c';
-    cell->cp_len = 3;
-    break;
-  case 0x75:
-    cell->cp[0] = '\xe2';
-    cell->cp[1] = '\x94';
-    cell->cp[2] = '\xa4';
-    cell->cp_len = 3;
-    break;
-  case 0x76:
-    cell->cp[0] = '\xe2';
-    cell->cp[1] = '\x94';
-    cell->cp[2] = '\xb4';
-    cell->cp_len = 3;
-    break;
-  case 0x77:
-    cell->cp[0] = '\xe2';
-    cell->cp[1] = '\x94';
-    cell->cp[2] = '\xac';
-    cell->cp_len = 3;
-    break;
-  case 0x78:
-    cell->cp[0] = '\xe2';
-    cell->cp[1] = '\x94';
-    cell->cp[2] = '\x82';
-    cell->cp_len = 3;
-    break;
-  case 0x79:
-    cell->cp[0] = '\xe2';
-    cell->cp[1] = '\x89';
-    cell->cp[2] = '\xa4';
-    cell->cp_len = 3;
-    break;
-  case 0x7a:
-    cell->cp[0] = '\xe2';
-    cell->cp[1] = '\x89';
-    cell->cp[2] = '\xa5';
-    cell->cp_len = 3;
-    break;
-  case 0x7b:
-    cell->cp[0] = '\xcf';
-    cell->cp[1] = '\x80';
-    cell->cp_len = 2;
-    break;
-  case 0x7c:
-    cell->cp[0] = '\xe2';
-    cell->cp[1] = '\x89';
-    cell->cp[2] = '\xa0';
-    cell->cp_len = 3;
-    break;
-  case 0x7d:
-    cell->cp[0] = '\xc2';
-    cell->cp[1] = '\xa3';
-    cell->cp_len = 2;
-    break;
-  case 0x7e:
-    cell->cp[0] = '\xc2';
-    cell->cp[1] = '\xb7';
-    cell->cp_len = 2;
-    break;
-  default:
-    set = 0;
-    ;
+  for (int y = 0; y < snap->rows; ++y) {
+    if (snap->blocks[y]) {
+      unref_cells(snap->blocks[y]);
+    }
   }
 
-  if (!set) {
-    cell->cp[0] = c;
-    cell->cp_len = 1;
+  free(snap->lines);
+  free(snap->blocks);
+  unref_attrs(snap->attr_block);
+  free(snap);
+}
+
+void vt_snapshot_size(const struct snapshot *snap, int *rows, int *cols) {
+  *rows = snap->rows;
+  *cols = snap->cols;
+}
+
+void vt_snapshot_cursor(const struct snapshot *snap, int *x, int *y) {
+  *x = snap->cx;
+  *y = snap->cy;
+}
+
+int vt_snapshot_row(const struct snapshot *snap, int y,
+                    struct snapshot_row *row) {
+  if (y < 0 || y >= snap->rows || !snap->lines[y].cells) {
+    return -1;
   }
 
-  cell->cp[cell->cp_len] = '\0';
+  *row = snap->lines[y];
+  return 0;
+}
+
+const struct cellattr *vt_snapshot_attrs(const struct snapshot *snap,
+                                         size_t *count) {
+  *count = snap->num_attrs;
+  return snap->attrs;
+}
+
+// Saved state (vt_save). Integers are little-endian whatever the host:
+//   header     magic, version, field count, the u32 fields of enum
+//              state_field, then the title
+//   attributes num_attrs x (fg, bg, flags) as u32
+//   tab stops  TABSTOP_WORDS(cols) x u64
+//   screens    the primary screen, then the alternate if it has been used,
+//              each rows x (u32 row flags, u32 reserved, cols x cell)
+// A cell is cp and the combining marks as u32, then flags and attr as u16,
+// the layout of struct cell. Sections start 8-byte aligned at offsets given in
+// the header, so a mapped file can be read in place.
+#define STATE_MAGIC "NIHSTATE"
+#define STATE_MAGIC_LEN 8
+#define STATE_VERSION 1
+
+#define STATE_ALIGN(n) (((n) + 7) & ~(size_t)7)
+#define STATE_ATTR_SIZE 12
+#define STATE_CELL_SIZE 16
+#define STATE_ROW_HEADER_SIZE 8
+
+// x, y, charset, lcf, fg, bg, flags
+#define STATE_SAVED_FIELDS 7
+
+enum state_field {
+  STATE_ROWS,
+  STATE_COLS,
+  STATE_CX,
+  STATE_CY,
+  STATE_LCF,
+  STATE_MARGIN_TOP,
+  STATE_MARGIN_BOTTOM,
+  STATE_MARGIN_LEFT,
+  STATE_MARGIN_RIGHT,
+  // bit n is state_modes[n]
+  STATE_MODES,
+  STATE_CHARSET,
+  STATE_CHARSET_G0,
+  STATE_CHARSET_G1,
+  STATE_SHIFTED,
+  STATE_ATTR_FG,
+  STATE_ATTR_BG,
+  STATE_ATTR_FLAGS,
+  // the saved cursors of the primary and alternate screens
+  STATE_SAVED,
+  STATE_ALT_SAVED = STATE_SAVED + STATE_SAVED_FIELDS,
+  STATE_ALT_ACTIVE = STATE_ALT_SAVED + STATE_SAVED_FIELDS,
+  STATE_HAS_ALT,
+  STATE_NUM_ATTRS,
+  STATE_ATTRS_OFFSET,
+  STATE_TABS_OFFSET,
+  STATE_SCREENS_OFFSET,
+  STATE_NUM_FIELDS,
+};
+
+#define STATE_FIELDS_OFFSET (STATE_MAGIC_LEN + 8)
+#define STATE_TITLE_OFFSET (STATE_FIELDS_OFFSET + 4 * STATE_NUM_FIELDS)
+#define STATE_HEADER_SIZE STATE_ALIGN(STATE_TITLE_OFFSET + TITLE_SIZE)
+
+// row flags
+#define STATE_ROW_WRAPPED 0x1
+#define STATE_ROW_DBL_WIDTH 0x2
+#define STATE_ROW_DBL_HEIGHT 0x4
+#define STATE_ROW_DBL_BOTTOM 0x8
+
+// the mode struct, in STATE_MODES bit order; new modes go on the end
+static const size_t state_modes[] = {
+    offsetof(struct vt, mode.kam),     offsetof(struct vt, mode.irm),
+    offsetof(struct vt, mode.srm),     offsetof(struct vt, mode.lnm),
+    offsetof(struct vt, mode.decckm),  offsetof(struct vt, mode.decanm),
+    offsetof(struct vt, mode.deccolm), offsetof(struct vt, mode.decsclm),
+    offsetof(struct vt, mode.decscnm), offsetof(struct vt, mode.decom),
+    offsetof(struct vt, mode.decawm),  offsetof(struct vt, mode.decarm),
+    offsetof(struct vt, mode.decpff),  offsetof(struct vt, mode.decpex),
+    offsetof(struct vt, mode.deckpam), offsetof(struct vt, mode.bracketed_paste),
+};
+
+static void put_u16(uint8_t *p, uint16_t v) {
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
+}
+
+static void put_u32(uint8_t *p, uint32_t v) {
+  put_u16(p, (uint16_t)v);
+  put_u16(p + 2, (uint16_t)(v >> 16));
+}
+
+static void put_u64(uint8_t *p, uint64_t v) {
+  put_u32(p, (uint32_t)v);
+  put_u32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint16_t get_u16(const uint8_t *p) {
+  return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+  return get_u16(p) | (uint32_t)get_u16(p + 2) << 16;
+}
+
+static uint64_t get_u64(const uint8_t *p) {
+  return get_u32(p) | (uint64_t)get_u32(p + 4) << 32;
+}
+
+static void save_cursor_fields(uint32_t *fields,
+                               const struct saved_cursor *saved) {
+  fields[0] = (uint32_t)saved->x;
+  fields[1] = (uint32_t)saved->y;
+  fields[2] = (uint32_t)saved->charset;
+  fields[3] = (uint32_t)saved->lcf;
+  fields[4] = saved->attr.fg;
+  fields[5] = saved->attr.bg;
+  fields[6] = saved->attr.flags;
+}
+
+// DECCOLM can leave a saved cursor off the screen, so it is clamped rather
+// than rejected.
+static void load_cursor_fields(struct vt *vt, struct saved_cursor *saved,
+                               const uint32_t *fields) {
+  saved->x = fields[0] < (uint32_t)vt->cols ? (int)fields[0] : vt->cols - 1;
+  saved->y = fields[1] < (uint32_t)vt->rows ? (int)fields[1] : vt->rows - 1;
+  saved->charset = (int)fields[2];
+  saved->lcf = fields[3] != 0;
+  saved->attr.fg = fields[4];
+  saved->attr.bg = fields[5];
+  saved->attr.flags = fields[6];
+}
+
+static size_t state_row_size(int cols) {
+  return STATE_ROW_HEADER_SIZE + (size_t)cols * STATE_CELL_SIZE;
+}
+
+static uint8_t *save_screen(struct vt *vt, struct row *row, uint8_t *out) {
+  for (int y = 0; y < vt->rows; ++y, row = row->next) {
+    uint32_t flags = 0;
+    if (row->wrapped) {
+      flags |= STATE_ROW_WRAPPED;
+    }
+    if (row->dbl_width) {
+      flags |= STATE_ROW_DBL_WIDTH;
+    }
+    if (row->dbl_height) {
+      flags |= STATE_ROW_DBL_HEIGHT;
+      if (row->dbl_side) {
+        flags |= STATE_ROW_DBL_BOTTOM;
+      }
+    }
+    put_u32(out, flags);
+    put_u32(out + 4, 0);
+    out += STATE_ROW_HEADER_SIZE;
+
+    for (int x = 0; x < vt->cols; ++x, out += STATE_CELL_SIZE) {
+      const struct cell *cell = &row->cells[x];
+      put_u32(out, cell->cp);
+      put_u32(out + 4, cell->combining[0]);
+      put_u32(out + 8, cell->combining[1]);
+      put_u16(out + 12, cell->flags);
+      put_u16(out + 14, cell->attr);
+    }
+  }
+
+  return out;
+}
+
+size_t vt_save(struct vt *vt, void *buf, size_t cap) {
+  struct row *primary = vt->alt_active ? vt->other_screen : vt->screen;
+  struct row *alt = vt->alt_active ? vt->screen : vt->other_screen;
+
+  size_t attrs_offset = STATE_HEADER_SIZE;
+  size_t tabs_offset =
+      STATE_ALIGN(attrs_offset + vt->attrs.count * STATE_ATTR_SIZE);
+  size_t tab_words = TABSTOP_WORDS((size_t)vt->cols);
+  size_t screens_offset = tabs_offset + tab_words * sizeof(uint64_t);
+  size_t size = screens_offset +
+                (alt ? 2 : 1) * (size_t)vt->rows * state_row_size(vt->cols);
+  if (cap < size) {
+    return size;
+  }
+
+  uint32_t fields[STATE_NUM_FIELDS];
+  fields[STATE_ROWS] = (uint32_t)vt->rows;
+  fields[STATE_COLS] = (uint32_t)vt->cols;
+  fields[STATE_CX] = (uint32_t)vt->cx;
+  fields[STATE_CY] = (uint32_t)vt->cy;
+  fields[STATE_LCF] = (uint32_t)vt->lcf;
+  fields[STATE_MARGIN_TOP] = (uint32_t)vt->margin_top;
+  fields[STATE_MARGIN_BOTTOM] = (uint32_t)vt->margin_bottom;
+  fields[STATE_MARGIN_LEFT] = (uint32_t)vt->margin_left;
+  fields[STATE_MARGIN_RIGHT] = (uint32_t)vt->margin_right;
+  fields[STATE_MODES] = 0;
+  for (size_t i = 0; i < sizeof(state_modes) / sizeof(state_modes[0]); ++i) {
+    if (*(const int *)((const char *)vt + state_modes[i])) {
+      fields[STATE_MODES] |= 1u << i;
+    }
+  }
+  fields[STATE_CHARSET] = (uint32_t)vt->charset;
+  fields[STATE_CHARSET_G0] = (uint32_t)vt->charset_g0;
+  fields[STATE_CHARSET_G1] = (uint32_t)vt->charset_g1;
+  fields[STATE_SHIFTED] = (uint32_t)vt->shifted;
+  fields[STATE_ATTR_FG] = vt->current_attr.fg;
+  fields[STATE_ATTR_BG] = vt->current_attr.bg;
+  fields[STATE_ATTR_FLAGS] = vt->current_attr.flags;
+  save_cursor_fields(&fields[STATE_SAVED],
+                     vt->alt_active ? &vt->other_saved : &vt->saved);
+  save_cursor_fields(&fields[STATE_ALT_SAVED],
+                     vt->alt_active ? &vt->saved : &vt->other_saved);
+  fields[STATE_ALT_ACTIVE] = (uint32_t)vt->alt_active;
+  fields[STATE_HAS_ALT] = alt != NULL;
+  fields[STATE_NUM_ATTRS] = vt->attrs.count;
+  fields[STATE_ATTRS_OFFSET] = (uint32_t)attrs_offset;
+  fields[STATE_TABS_OFFSET] = (uint32_t)tabs_offset;
+  fields[STATE_SCREENS_OFFSET] = (uint32_t)screens_offset;
+
+  uint8_t *out = buf;
+  // zero the title and padding
+  memset(out, 0, screens_offset);
+
+  memcpy(out, STATE_MAGIC, STATE_MAGIC_LEN);
+  put_u32(out + STATE_MAGIC_LEN, STATE_VERSION);
+  put_u32(out + STATE_MAGIC_LEN + 4, STATE_NUM_FIELDS);
+  for (int i = 0; i < STATE_NUM_FIELDS; ++i) {
+    put_u32(out + STATE_FIELDS_OFFSET + 4 * i, fields[i]);
+  }
+  memcpy(out + STATE_TITLE_OFFSET, vt->title, strnlen(vt->title, TITLE_SIZE));
+
+  for (uint32_t id = 0; id < vt->attrs.count; ++id) {
+    uint8_t *p = out + attrs_offset + id * STATE_ATTR_SIZE;
+    put_u32(p, vt->attrs.entries[id].fg);
+    put_u32(p + 4, vt->attrs.entries[id].bg);
+    put_u32(p + 8, vt->attrs.entries[id].flags);
+  }
+
+  for (size_t i = 0; i < tab_words; ++i) {
+    put_u64(out + tabs_offset + i * sizeof(uint64_t), vt->tabstops[i]);
+  }
+
+  uint8_t *p = save_screen(vt, primary, out + screens_offset);
+  if (alt) {
+    save_screen(vt, alt, p);
+  }
+
+  return size;
+}
+
+// Returns 1 if the section of count items of size bytes at offset is aligned
+// and inside the blob.
+static int state_section_ok(uint32_t offset, uint64_t count, size_t size,
+                            size_t length) {
+  return offset % 8 == 0 && offset >= STATE_HEADER_SIZE &&
+         offset <= length && count * size <= length - offset;
+}
+
+// Check everything vt_load relies on before it changes anything.
+static int state_valid(const uint8_t *in, size_t length,
+                       const uint32_t *fields) {
+  uint32_t rows = fields[STATE_ROWS];
+  uint32_t cols = fields[STATE_COLS];
+  if (rows < 1 || rows > USHRT_MAX || cols < 1 || cols > USHRT_MAX) {
+    return 0;
+  }
+
+  if (fields[STATE_CX] >= cols || fields[STATE_CY] >= rows ||
+      fields[STATE_MARGIN_TOP] > fields[STATE_MARGIN_BOTTOM] ||
+      fields[STATE_MARGIN_BOTTOM] >= rows ||
+      fields[STATE_MARGIN_LEFT] >= fields[STATE_MARGIN_RIGHT] ||
+      fields[STATE_MARGIN_RIGHT] > cols) {
+    return 0;
+  }
+
+  if (!valid_charset(fields[STATE_CHARSET]) ||
+      !valid_charset(fields[STATE_CHARSET_G0]) ||
+      !valid_charset(fields[STATE_CHARSET_G1]) ||
+      !valid_charset(fields[STATE_SAVED + 2]) ||
+      !valid_charset(fields[STATE_ALT_SAVED + 2])) {
+    return 0;
+  }
+
+  if (fields[STATE_ALT_ACTIVE] && !fields[STATE_HAS_ALT]) {
+    return 0;
+  }
+
+  uint32_t num_attrs = fields[STATE_NUM_ATTRS];
+  uint64_t num_rows = (uint64_t)rows * (fields[STATE_HAS_ALT] ? 2 : 1);
+  size_t row_size = state_row_size((int)cols);
+  if (num_attrs < 1 || num_attrs > ATTR_TABLE_MAX ||
+      !state_section_ok(fields[STATE_ATTRS_OFFSET], num_attrs,
+                        STATE_ATTR_SIZE, length) ||
+      !state_section_ok(fields[STATE_TABS_OFFSET], TABSTOP_WORDS(cols),
+                        sizeof(uint64_t), length) ||
+      !state_section_ok(fields[STATE_SCREENS_OFFSET], num_rows, row_size,
+                        length)) {
+    return 0;
+  }
+
+  // cells must not index past the attribute table
+  const uint8_t *p = in + fields[STATE_SCREENS_OFFSET];
+  for (uint64_t y = 0; y < num_rows; ++y, p += row_size) {
+    const uint8_t *cell = p + STATE_ROW_HEADER_SIZE;
+    for (uint32_t x = 0; x < cols; ++x, cell += STATE_CELL_SIZE) {
+      if (get_u16(cell + 14) >= num_attrs) {
+        return 0;
+      }
+    }
+  }
+
+  return 1;
+}
+
+static struct row *load_screen(struct vt *vt, const uint8_t *in) {
+  struct row *screen = NULL;
+  struct row *prev = NULL;
+  for (int y = 0; y < vt->rows; ++y) {
+    struct row *row = alloc_row(vt);
+    uint32_t flags = get_u32(in);
+    row->wrapped = (flags & STATE_ROW_WRAPPED) != 0;
+    row->dbl_width = (flags & STATE_ROW_DBL_WIDTH) != 0;
+    row->dbl_height = (flags & STATE_ROW_DBL_HEIGHT) != 0;
+    row->dbl_side = (flags & STATE_ROW_DBL_BOTTOM) != 0;
+    in += STATE_ROW_HEADER_SIZE;
+
+    for (int x = 0; x < vt->cols; ++x, in += STATE_CELL_SIZE) {
+      struct cell *cell = &row->cells[x];
+      cell->cp = get_u32(in);
+      cell->combining[0] = get_u32(in + 4);
+      cell->combining[1] = get_u32(in + 8);
+      cell->flags = get_u16(in + 12);
+      cell->attr = get_u16(in + 14);
+    }
+
+    if (prev) {
+      prev->next = row;
+    } else {
+      screen = row;
+    }
+    prev = row;
+  }
+
+  return screen;
+}
+
+int vt_load(struct vt *vt, const void *blob, size_t length) {
+  const uint8_t *in = blob;
+  if (length < STATE_HEADER_SIZE ||
+      memcmp(in, STATE_MAGIC, STATE_MAGIC_LEN) != 0) {
+    print_error("not a saved terminal state\n");
+    return -1;
+  }
+
+  uint32_t version = get_u32(in + STATE_MAGIC_LEN);
+  if (version != STATE_VERSION ||
+      get_u32(in + STATE_MAGIC_LEN + 4) != STATE_NUM_FIELDS) {
+    print_error("unsupported terminal state version %u\n", version);
+    return -1;
+  }
+
+  uint32_t fields[STATE_NUM_FIELDS];
+  for (int i = 0; i < STATE_NUM_FIELDS; ++i) {
+    fields[i] = get_u32(in + STATE_FIELDS_OFFSET + 4 * i);
+  }
+
+  if (!state_valid(in, length, fields)) {
+    print_error("saved terminal state is damaged\n");
+    return -1;
+  }
+
+  int rows = (int)fields[STATE_ROWS];
+  int cols = (int)fields[STATE_COLS];
+  int resized = rows != vt->rows || cols != vt->cols;
+
+  // a sequence or string cut off by the save can't be finished now
+  if (vt->string.kind != STRING_NONE) {
+    finish_string(vt, 1);
+  }
+  end_sequence(vt);
+  memset(&vt->utf8, 0, sizeof(vt->utf8));
+
+  // sizes the tab stops and rows, and tells the pty
+  vt_resize(vt, rows, cols);
+
+  dispose_rows(vt, vt->screen, 1);
+  dispose_rows(vt, vt->other_screen, 1);
+
+  const uint8_t *screens = in + fields[STATE_SCREENS_OFFSET];
+  struct row *primary = load_screen(vt, screens);
+  struct row *alt = NULL;
+  if (fields[STATE_HAS_ALT]) {
+    alt = load_screen(vt, screens + (size_t)rows * state_row_size(cols));
+  }
+
+  vt->alt_active = (int)fields[STATE_ALT_ACTIVE];
+  vt->screen = vt->alt_active ? alt : primary;
+  vt->other_screen = vt->alt_active ? primary : alt;
+  load_cursor_fields(vt, vt->alt_active ? &vt->other_saved : &vt->saved,
+                     &fields[STATE_SAVED]);
+  load_cursor_fields(vt, vt->alt_active ? &vt->saved : &vt->other_saved,
+                     &fields[STATE_ALT_SAVED]);
+
+  struct attr_table *table = &vt->attrs;
+  uint32_t num_attrs = fields[STATE_NUM_ATTRS];
+  uint32_t cap = table->cap;
+  while (cap < num_attrs) {
+    cap *= 2;
+  }
+  writable_attrs(table, cap);
+  if (table->num_slots < cap * 2) {
+    table->num_slots = cap * 2;
+    table->slots = realloc(table->slots, table->num_slots * sizeof(uint32_t));
+  }
+  const uint8_t *attrs = in + fields[STATE_ATTRS_OFFSET];
+  for (uint32_t id = 0; id < num_attrs; ++id) {
+    const uint8_t *p = attrs + id * STATE_ATTR_SIZE;
+    table->entries[id].fg = get_u32(p);
+    table->entries[id].bg = get_u32(p + 4);
+    table->entries[id].flags = get_u32(p + 8);
+  }
+  table->count = num_attrs;
+  attr_rehash(table);
+
+  const uint8_t *tabs = in + fields[STATE_TABS_OFFSET];
+  for (size_t i = 0; i < TABSTOP_WORDS((size_t)cols); ++i) {
+    vt->tabstops[i] = get_u64(tabs + i * sizeof(uint64_t));
+  }
+
+  for (size_t i = 0; i < sizeof(state_modes) / sizeof(state_modes[0]); ++i) {
+    *(int *)((char *)vt + state_modes[i]) = (fields[STATE_MODES] >> i) & 1;
+  }
+
+  vt->cx = (int)fields[STATE_CX];
+  vt->cy = (int)fields[STATE_CY];
+  vt->lcf = fields[STATE_LCF] != 0;
+  vt->margin_top = (int)fields[STATE_MARGIN_TOP];
+  vt->margin_bottom = (int)fields[STATE_MARGIN_BOTTOM];
+  vt->margin_left = (int)fields[STATE_MARGIN_LEFT];
+  vt->margin_right = (int)fields[STATE_MARGIN_RIGHT];
+
+  vt->charset_g0 = (int)fields[STATE_CHARSET_G0];
+  vt->charset_g1 = (int)fields[STATE_CHARSET_G1];
+  vt->shifted = fields[STATE_SHIFTED] != 0;
+  select_charset(vt, (int)fields[STATE_CHARSET]);
+
+  vt->current_attr.fg = fields[STATE_ATTR_FG];
+  vt->current_attr.bg = fields[STATE_ATTR_BG];
+  vt->current_attr.flags = fields[STATE_ATTR_FLAGS];
+  vt->current_attr_id = attr_intern(vt, &vt->current_attr);
+
+  memcpy(vt->title, in + STATE_TITLE_OFFSET, TITLE_SIZE);
+  vt->title[TITLE_SIZE - 1] = '\0';
+
+  vt->cached_y = vt->cy;
+  vt->current_row = get_row(vt, vt->cy, NULL);
+
+  if (vt->graphics) {
+    if (resized) {
+      graphics_resize(vt->graphics, vt->cols, vt->rows);
+    }
+    graphics_invert(vt->graphics, vt->mode.decscnm);
+    graphics_set_title(vt->graphics, vt->title);
+  }
+  mark_damage(vt, 0, 0, vt->cols, vt->rows);
+
+  return 0;
+}
+
+static ssize_t write_retry(int fd, const char *buffer, size_t length) {
+  size_t written = 0;
+  while (written < length) {
+    ssize_t rc = write(fd, buffer + written, length - written);
+    if (rc < 0) {
+      if (errno == EINTR) {
+        continue;
+      } else if (errno == EAGAIN) {
+        // non-blocking pty is full, wait for the reader to catch up
+        struct pollfd pfd = {fd, POLLOUT, 0};
+        poll(&pfd, 1, -1);
+        continue;
+      }
+
+      fprintf(stderr, "nihterm: write_retry failed: %s\n", strerror(errno));
+      return rc;
+    }
+
+    written += (size_t)rc;
+  }
+
+  return (ssize_t)written;
+}
+
+static void queue_response(struct vt *vt, const char *buffer, size_t length) {
+  if (length > RESPONSE_QUEUE_SIZE - vt->responses.len) {
+    // the other side isn't reading replies; drop rather than block the parser
+    if (!vt->responses.dropping) {
+      print_error("response queue full, dropping replies\n");
+      vt->responses.dropping = 1;
+    }
+    return;
+  }
+
+  vt->responses.dropping = 0;
+
+  size_t tail = (vt->responses.head + vt->responses.len) % RESPONSE_QUEUE_SIZE;
+  size_t first = RESPONSE_QUEUE_SIZE - tail;
+  if (first > length) {
+    first = length;
+  }
+
+  memcpy(vt->responses.buf + tail, buffer, first);
+  memcpy(vt->responses.buf, buffer + first, length - first);
+
+  vt->responses.len += length;
+}
+
+static void clear_images(struct row *row) {
+  struct image_slice *slice = row->images;
+  while (slice) {
+    struct image_slice *next = slice->next;
+    if (!--slice->layer->refs) {
+      sixel_image_free(slice->layer->image);
+      free(slice->layer);
+    }
+    free(slice);
+    slice = next;
+  }
+
+  row->images = NULL;
+}
+
+void free_row(struct row *row) {
+  clear_images(row);
+  if (row->block) {
+    unref_cells(row->block);
+  }
+  free(row);
+}
+
+static void free_rows(struct row *row) {
+  while (row) {
+    struct row *next = row->next;
+    free_row(row);
+    row = next;
+  }
+}
+
+static struct cell_block *alloc_cells(struct vt *vt) {
+  struct cell_block *block = calloc(
+      1, sizeof(struct cell_block) + sizeof(struct cell) * (size_t)vt->row_cap);
+  atomic_init(&block->refs, 1);
+  return block;
+}
+
+static void unref_cells(struct cell_block *block) {
+  if (atomic_fetch_sub_explicit(&block->refs, 1, memory_order_acq_rel) == 1) {
+    free(block);
+  }
+}
+
+// A zeroed row, from the pool if there is one.
+static struct row *alloc_row(struct vt *vt) {
+  struct row *row = vt->row_pool;
+  if (!row) {
+    row = calloc(1, sizeof(struct row));
+    row->block = alloc_cells(vt);
+  } else {
+    vt->row_pool = row->next;
+
+    struct cell_block *block = row->block;
+    memset(row, 0, sizeof(*row));
+    if (block) {
+      memset(block->cells, 0, sizeof(struct cell) * (size_t)vt->row_cap);
+    } else {
+      block = alloc_cells(vt);
+    }
+    row->block = block;
+  }
+
+  row->cells = row->block->cells;
+  return row;
+}
+
+static void release_row(struct vt *vt, struct row *row) {
+  clear_images(row);
+
+  // cells still in a snapshot stay with it
+  if (atomic_load_explicit(&row->block->refs, memory_order_acquire) > 1) {
+    unref_cells(row->block);
+    row->block = NULL;
+  }
+
+  row->next = vt->row_pool;
+  vt->row_pool = row;
+}
+
+// The row's cells, ready to be changed. If a snapshot shares them they are
+// copied first. Only the thread feeding the vt takes new references, so a
+// count of one can't go up behind our back.
+static struct cell *writable_cells(struct vt *vt, struct row *row) {
+  struct cell_block *block = row->block;
+  if (atomic_load_explicit(&block->refs, memory_order_acquire) > 1) {
+    struct cell_block *copy = alloc_cells(vt);
+    memcpy(copy->cells, block->cells, sizeof(struct cell) * (size_t)vt->row_cap);
+    unref_cells(block);
+
+    row->block = copy;
+    row->cells = copy->cells;
+  }
+
+  return row->cells;
+}
+
+// Rows of a screen being laid out at a new width.
+struct reflow {
+  struct vt *vt;
+  int cols;
+  struct row *head;
+  struct row *tail;
+  int count;
+  // next column in tail
+  int x;
+};
+
+static void reflow_add_row(struct reflow *out) {
+  struct row *row = alloc_row(out->vt);
+  for (int x = 0; x < out->cols; ++x) {
+    row->cells[x].cp = ' ';
+  }
+
+  if (out->tail) {
+    out->tail->next = row;
+  } else {
+    out->head = row;
+  }
+  out->tail = row;
+  out->count++;
+  out->x = 0;
+}
+
+// Blank cells in the default attributes, which are padding rather than text
+// when they end a line.
+static int is_blank(const struct cell *cell) {
+  return cell->cp == ' ' && !cell->attr && !cell->flags &&
+         !cell->combining[0];
+}
+
+// Lay out a screen at a new size in new rows, returning the old ones. With
+// rewrap set, rows joined by autowrap are treated as one line and wrapped
+// again at the new width; otherwise each row is cut or padded. *x and *y move
+// with the cell they point at. If that would put them below the new last row,
+// lines are dropped off the top as there is no scrollback to hold them.
+static struct row *reflow_screen(struct vt *vt, struct row **screen, int rows,
+                                 int cols, int rewrap, int *x, int *y) {
+  struct reflow out = {vt, cols, NULL, NULL, 0, 0};
+
+  int new_x = *x < cols ? *x : cols - 1;
+  int new_y = 0;
+  int continued = 0;
+
+  struct row *row = *screen;
+  for (int oy = 0; row && oy < vt->rows; ++oy, row = row->next) {
+    int dbl = row->dbl_width || row->dbl_height;
+    int width = dbl ? vt->cols / 2 : vt->cols;
+    int limit = dbl ? cols / 2 : cols;
+
+    if (!continued || dbl) {
+      reflow_add_row(&out);
+      out.tail->dbl_width = row->dbl_width;
+      out.tail->dbl_height = row->dbl_height;
+      out.tail->dbl_side = row->dbl_side;
+    }
+
+    // images stay with the row they were placed on
+    struct image_slice **images = &out.tail->images;
+    while (*images) {
+      images = &(*images)->next;
+    }
+    *images = row->images;
+    row->images = NULL;
+
+    int wraps = rewrap && !dbl && row->wrapped;
+
+    int len = width;
+    if (rewrap && !wraps) {
+      while (len > 0 && is_blank(&row->cells[len - 1])) {
+        --len;
+      }
+    }
+    if (oy == *y) {
+      // keep everything up to the cursor, even if blank
+      new_y = out.count - 1;
+      if (len <= *x) {
+        len = *x < width ? *x + 1 : width;
+      }
+    }
+
+    for (int ox = 0; ox < len; ++ox) {
+      const struct cell *cell = &row->cells[ox];
+      if (cell->flags & CELL_WIDE_SPACER) {
+        // copied with its left half
+        continue;
+      }
+
+      int w = (cell->flags & CELL_WIDE) ? 2 : 1;
+      if (out.x + w > limit) {
+        if (!rewrap || dbl || w > limit) {
+          break;
+        }
+
+        out.tail->wrapped = 1;
+        reflow_add_row(&out);
+      }
+
+      if (oy == *y && (ox == *x || (w == 2 && ox + 1 == *x))) {
+        new_x = out.x;
+        new_y = out.count - 1;
+      }
+
+      out.tail->cells[out.x] = *cell;
+      if (w == 2) {
+        out.tail->cells[out.x + 1] = cell[1];
+      }
+      out.x += w;
+    }
+
+    continued = wraps;
+  }
+
+  // keep the cursor on screen
+  for (; new_y >= rows; --new_y) {
+    struct row *next = out.head->next;
+    release_row(vt, out.head);
+    out.head = next;
+    out.count--;
+  }
+
+  while (out.count < rows) {
+    reflow_add_row(&out);
+  }
+
+  struct row *last = out.head;
+  for (int i = 1; i < rows; ++i) {
+    last = last->next;
+  }
+  dispose_rows(vt, last->next, 1);
+  last->next = NULL;
+
+  struct row *old = *screen;
+  *screen = out.head;
+  *x = new_x;
+  *y = new_y;
+  return old;
+}
+
+static void dispose_rows(struct vt *vt, struct row *row, int reuse) {
+  while (row) {
+    struct row *next = row->next;
+    if (reuse) {
+      release_row(vt, row);
+    } else {
+      free_row(row);
+    }
+    row = next;
+  }
+}
+
+// Tell the application on the pty how big the terminal is now. The kernel
+// sends it SIGWINCH.
+static void update_winsize(struct vt *vt) {
+  struct winsize size;
+  memset(&size, 0, sizeof(size));
+  size.ws_row = (unsigned short)vt->rows;
+  size.ws_col = (unsigned short)vt->cols;
+  if (vt->graphics) {
+    size.ws_xpixel = (unsigned short)(cell_width(vt->graphics) * (size_t)vt->cols);
+    size.ws_ypixel = (unsigned short)(cell_height(vt->graphics) * (size_t)vt->rows);
+  }
+
+  // replay writes to /dev/null, which has no size
+  if (ioctl(vt->pty, TIOCSWINSZ, &size) < 0 && errno != ENOTTY) {
+    print_error("failed to set window size: %s\n", strerror(errno));
+  }
+}
+
+static void set_tabstop(struct vt *vt, int x, int set) {
+  uint64_t bit = 1ull << (x % TABSTOP_WORD_BITS);
+  if (set) {
+    vt->tabstops[x / TABSTOP_WORD_BITS] |= bit;
+  } else {
+    vt->tabstops[x / TABSTOP_WORD_BITS] &= ~bit;
+  }
+}
+
+// Returns the column of the nth tab stop after x, or the last column of the
+// cursor's row if there are fewer than n. Whole words of stops are skipped by
+// their population count, so this costs one step per 64 columns.
+static int next_tabstop(struct vt *vt, int x, int n) {
+  int width = row_cols(vt, vt->current_row);
+  int start = x + 1;
+  if (start >= width) {
+    return width - 1;
+  }
+
+  int last_word = (width - 1) / TABSTOP_WORD_BITS;
+  for (int w = start / TABSTOP_WORD_BITS; w <= last_word; ++w) {
+    uint64_t bits = vt->tabstops[w];
+    if (w == start / TABSTOP_WORD_BITS) {
+      bits &= ~0ull << (start % TABSTOP_WORD_BITS);
+    }
+    if (w == last_word && width % TABSTOP_WORD_BITS) {
+      bits &= ~(~0ull << (width % TABSTOP_WORD_BITS));
+    }
+
+    int count = __builtin_popcountll(bits);
+    if (count < n) {
+      n -= count;
+      continue;
+    }
+
+    // drop the n - 1 lowest stops in this word
+    while (--n) {
+      bits &= bits - 1;
+    }
+    return w * TABSTOP_WORD_BITS + __builtin_ctzll(bits);
+  }
+
+  return width - 1;
+}
+
+// Returns the column of the nth tab stop before x, or the first column if
+// there are fewer than n.
+static int prev_tabstop(struct vt *vt, int x, int n) {
+  int width = row_cols(vt, vt->current_row);
+  int end = (x < width ? x : width) - 1;
+  if (end < 0) {
+    return 0;
+  }
+
+  for (int w = end / TABSTOP_WORD_BITS; w >= 0; --w) {
+    uint64_t bits = vt->tabstops[w];
+    if (w == end / TABSTOP_WORD_BITS) {
+      bits &= ~0ull >> (TABSTOP_WORD_BITS - 1 - end % TABSTOP_WORD_BITS);
+    }
+
+    int count = __builtin_popcountll(bits);
+    if (count < n) {
+      n -= count;
+      continue;
+    }
+
+    // drop the n - 1 highest stops in this word
+    while (--n) {
+      bits &= ~(1ull << (TABSTOP_WORD_BITS - 1 - __builtin_clzll(bits)));
+    }
+    return w * TABSTOP_WORD_BITS + TABSTOP_WORD_BITS - 1 - __builtin_clzll(bits);
+  }
+
+  return 0;
+}
+
+static void do_vt52(struct vt *vt) {
+  // fprintf(stderr, "vt52: %s\n", vt->sequence);
+
+  switch (vt->sequence[0]) {
+  case 'A':
+    cursor_up(vt, 1, 0);
+    vt->lcf = 0;
+    break;
+  case 'B':
+    cursor_down(vt, 1, 0);
+    vt->lcf = 0;
+    break;
+  case 'C':
+    cursor_fwd(vt, 1, 0);
+    vt->lcf = 0;
+    break;
+  case 'D':
+    cursor_back(vt, 1);
+    vt->lcf = 0;
+    break;
+  case 'F':
+    // Select Special Graphics character set
+    select_charset(vt, 1);
+    break;
+  case 'G':
+    // Select ASCII character set
+    select_charset(vt, 0);
+    break;
+  case 'H':
+    cursor_home(vt);
+    break;
+  case 'I':
+    cursor_up(vt, 1, 1);
+    break;
+  case 'J':
+    erase_screen_cursor(vt, 0);
+    break;
+  case 'K':
+    erase_line_cursor(vt, 0);
+    break;
+  case 'Y':
+    // Direct cursor address - has two params
+    if (vt->seqidx < 3) {
+      return;
+    }
+
+    char l = vt->sequence[1];
+    char c = vt->sequence[2];
+    cursor_to(vt, c - 037 - 1, l - 037 - 1, 0, 0);
+    break;
+  case 'Z':
+    // Identify
+    queue_response(vt, "\033/Z", 3);
+    break;
+  case '=':
+    // Enter alternate keypad mode
+    vt->mode.deckpam = 1;
+    break;
+  case '>':
+    // Exit alternate keypad mode
+    vt->mode.deckpam = 0;
+    break;
+  case '<':
+    // Enter ANSI mode
+    vt->mode.decanm = 1;
+    break;
+  default:
+    print_error("unknown vt52 sequence: %s\n", vt->sequence);
+  }
+
+  end_sequence(vt);
+}
+
+static void end_sequence(struct vt *vt) {
+  vt->in_sequence = 0;
+  vt->seqidx = 0;
+  memset(vt->sequence, 0, sizeof(vt->sequence));
+}
+
+static void cell_size(struct vt *vt, int *w, int *h) {
+  if (vt->graphics) {
+    *w = (int)cell_width(vt->graphics);
+    *h = (int)cell_height(vt->graphics);
+  } else {
+    *w = DEFAULT_CELL_WIDTH;
+    *h = DEFAULT_CELL_HEIGHT;
+  }
+}
+
+// Anchor an image at the cursor, one slice per row it covers, scrolling as
+// needed. The cursor ends up at the start of the line below the image.
+static void place_image(struct vt *vt, struct sixel_image *image) {
+  int cw, ch;
+  cell_size(vt, &cw, &ch);
+
+  int cols = (image->width + cw - 1) / cw;
+  int rows = (image->height + ch - 1) / ch;
+
+  struct image_layer *layer =
+      (struct image_layer *)calloc(1, sizeof(struct image_layer));
+  if (!layer) {
+    sixel_image_free(image);
+    return;
+  }
+  layer->image = image;
+  layer->refs = 1;
+
+  for (int i = 0; i < rows; ++i) {
+    if (i) {
+      cursor_down(vt, 1, 1);
+    }
+
+    struct image_slice *slice =
+        (struct image_slice *)calloc(1, sizeof(struct image_slice));
+    if (!slice) {
+      break;
+    }
+
+    struct row *row = get_row(vt, vt->cy, NULL);
+    slice->layer = layer;
+    slice->col = vt->cx;
+    slice->slice = i;
+    slice->next = row->images;
+    row->images = slice;
+    ++layer->refs;
+
+    mark_damage(vt, vt->cx, vt->cy, cols, 1);
+  }
+
+  // drop the reference held while placing
+  if (!--layer->refs) {
+    sixel_image_free(image);
+    free(layer);
+  }
+
+  cursor_down(vt, 1, 1);
+  cursor_sol(vt);
+  vt->lcf = 0;
+}
+
+static void title_start(struct vt *vt, const char *prefix) {
+  (void)prefix;
+  vt->pending_title.len = 0;
+}
+
+static void title_data(struct vt *vt, const char *data, size_t length) {
+  for (size_t i = 0; i < length; ++i) {
+    // long titles are truncated, control characters dropped
+    if (vt->pending_title.len + 1 >= TITLE_SIZE) {
+      break;
+    } else if ((unsigned char)data[i] < 0x20) {
+      continue;
+    }
+
+    vt->pending_title.buf[vt->pending_title.len++] = data[i];
+  }
+}
+
+static void title_end(struct vt *vt, int aborted) {
+  if (aborted) {
+    return;
+  }
+
+  memcpy(vt->title, vt->pending_title.buf, vt->pending_title.len);
+  vt->title[vt->pending_title.len] = '\0';
+
+  if (vt->graphics) {
+    graphics_set_title(vt->graphics, vt->title);
+  }
+}
+
+static const struct string_handler title_handler = {
+    title_start,
+    title_data,
+    title_end,
+};
+
+static void clipboard_start(struct vt *vt, const char *prefix) {
+  (void)prefix;
+
+  free(vt->osc52.buf);
+  memset(&vt->osc52, 0, sizeof(vt->osc52));
+  base64_init(&vt->osc52.decoder);
+}
+
+static void clipboard_data(struct vt *vt, const char *data, size_t length) {
+  // OSC 52 ; Pc ; Pd - Pc names the selection(s), Pd is base64 or ?
+  while (!vt->osc52.in_payload && length) {
+    if (*data == ';') {
+      vt->osc52.in_payload = 1;
+    } else if (vt->osc52.selection_len + 1 < CLIPBOARD_SELECTION_SIZE) {
+      vt->osc52.selection[vt->osc52.selection_len++] = *data;
+    }
+    ++data;
+    --length;
+  }
+
+  if (!length || vt->osc52.query || vt->osc52.overflow) {
+    return;
+  }
+
+  if (!vt->osc52.len && !vt->osc52.decoder.nbits && *data == '?') {
+    vt->osc52.query = 1;
+    return;
+  }
+
+  size_t need = vt->osc52.len + base64_decoded_size(length);
+  if (need > CLIPBOARD_MAX_SIZE) {
+    print_error("OSC 52 clipboard larger than %d bytes, ignoring\n",
+                CLIPBOARD_MAX_SIZE);
+    vt->osc52.overflow = 1;
+    return;
+  }
+
+  if (need + 1 > vt->osc52.cap) {
+    size_t cap = vt->osc52.cap ? vt->osc52.cap : 256;
+    while (cap < need + 1) {
+      cap *= 2;
+    }
+
+    uint8_t *buf = (uint8_t *)realloc(vt->osc52.buf, cap);
+    if (!buf) {
+      vt->osc52.overflow = 1;
+      return;
+    }
+
+    vt->osc52.buf = buf;
+    vt->osc52.cap = cap;
+  }
+
+  vt->osc52.len += base64_decode(&vt->osc52.decoder, data, length,
+                                 vt->osc52.buf + vt->osc52.len);
+}
+
+static void clipboard_reply(struct vt *vt) {
+  char *text = NULL;
+  size_t length = 0;
+  if (vt->graphics) {
+    text = graphics_get_clipboard(vt->graphics);
+    length = text ? strlen(text) : 0;
+  } else if (vt->clipboard) {
+    text = vt->clipboard;
+    length = vt->clipboard_len;
+  }
+
+  // replies share the response queue, so anything that won't fit in it is
+  // answered as an empty clipboard
+  size_t header = 5 + vt->osc52.selection_len + 1;
+  size_t size = header + base64_encoded_size(length) + 2;
+  if (size > RESPONSE_QUEUE_SIZE - vt->responses.len) {
+    length = 0;
+    size = header + 2;
+  }
+
+  char *reply = (char *)malloc(size);
+  if (reply) {
+    memcpy(reply, "\033]52;", 5);
+    memcpy(reply + 5, vt->osc52.selection, vt->osc52.selection_len);
+    reply[header - 1] = ';';
+    size_t n = header + base64_encode((const uint8_t *)text, length, reply + header);
+    memcpy(reply + n, "\033\\", 2);
+    queue_response(vt, reply, n + 2);
+    free(reply);
+  }
+
+  if (text != vt->clipboard) {
+    free(text);
+  }
+}
+
+static void clipboard_end(struct vt *vt, int aborted) {
+  if (aborted || vt->osc52.overflow || !vt->osc52.in_payload) {
+    // nothing to do
+  } else if (vt->osc52.query) {
+    // like xterm, a query that isn't allowed gets no answer at all
+    if (vt->clipboard_read) {
+      clipboard_reply(vt);
+    }
+  } else if (base64_finish(&vt->osc52.decoder)) {
+    print_error("OSC 52 with invalid base64 data, ignoring\n");
+  } else {
+    // hand the decoded buffer over rather than copying it
+    free(vt->clipboard);
+    vt->clipboard = (char *)vt->osc52.buf;
+    vt->clipboard_len = vt->osc52.len;
+    if (!vt->clipboard) {
+      vt->clipboard = (char *)calloc(1, 1);
+    } else {
+      vt->clipboard[vt->clipboard_len] = '\0';
+    }
+    vt->osc52.buf = NULL;
+
+    if (vt->graphics && vt->clipboard) {
+      graphics_set_clipboard(vt->graphics, vt->clipboard);
+    }
+  }
+
+  free(vt->osc52.buf);
+  memset(&vt->osc52, 0, sizeof(vt->osc52));
+}
+
+static const struct string_handler clipboard_handler = {
+    clipboard_start,
+    clipboard_data,
+    clipboard_end,
+};
+
+static const struct string_handler *osc_handler(int command) {
+  switch (command) {
+  case 0:
+  case 2:
+    // set icon name and window title / set window title
+    return &title_handler;
+  case 1:
+    // set icon name, which we have no use for
+    return NULL;
+  case 52:
+    // manipulate selection data
+    return &clipboard_handler;
+  default:
+    print_error("unknown OSC %d\n", command);
+    return NULL;
+  }
+}
+
+static void sixel_start(struct vt *vt, const char *prefix) {
+  sixel_init(&vt->sixel, prefix);
+}
+
+static void sixel_data(struct vt *vt, const char *data, size_t length) {
+  sixel_decode(&vt->sixel, data, length);
+}
+
+static void sixel_end(struct vt *vt, int aborted) {
+  if (aborted) {
+    sixel_discard(&vt->sixel);
+    return;
+  }
+
+  struct sixel_image *image = sixel_finish(&vt->sixel);
+  if (image) {
+    place_image(vt, image);
+  }
+}
+
+static const struct string_handler sixel_handler = {
+    sixel_start,
+    sixel_data,
+    sixel_end,
+};
+
+static const struct string_handler *dcs_handler(const char *prefix) {
+  // DCS P1 ; P2 ; P3 q - sixel graphics, with no intermediates
+  size_t len = strlen(prefix);
+  if (len && prefix[len - 1] == 'q' &&
+      strspn(prefix, "0123456789;") == len - 1) {
+    return &sixel_handler;
+  }
+
+  print_error("unknown DCS %s\n", prefix);
+  return NULL;
+}
+
+static void start_string(struct vt *vt, enum string_kind kind) {
+  end_sequence(vt);
+
+  size_t limit = vt->string.limit;
+  memset(&vt->string, 0, sizeof(vt->string));
+  vt->string.kind = kind;
+  vt->string.limit = limit;
+
+  // ignored strings have no prefix to wait for
+  vt->string.started = kind == STRING_IGNORED;
+}
+
+// The prefix is complete, find the handler for the string.
+static void begin_payload(struct vt *vt) {
+  vt->string.prefix[vt->string.prefix_len] = '\0';
+  vt->string.started = 1;
+
+  if (vt->string.kind == STRING_OSC) {
+    vt->string.handler = osc_handler(atoi(vt->string.prefix));
+  } else if (vt->string.kind == STRING_DCS) {
+    vt->string.handler = dcs_handler(vt->string.prefix);
+  }
+
+  if (vt->string.handler && vt->string.handler->start) {
+    vt->string.handler->start(vt, vt->string.prefix);
+  }
+}
+
+static void string_data(struct vt *vt, const char *data, size_t length) {
+  if (vt->string.overflow || !length) {
+    return;
+  }
+
+  if (length > vt->string.limit - vt->string.len) {
+    print_error("control string longer than %zu bytes, ignoring\n",
+                vt->string.limit);
+    vt->string.overflow = 1;
+    return;
+  }
+
+  vt->string.len += length;
+  if (vt->string.handler && vt->string.handler->data) {
+    vt->string.handler->data(vt, data, length);
+  }
+}
+
+static void finish_string(struct vt *vt, int aborted) {
+  if (!vt->string.started) {
+    // e.g. OSC 104 BEL, which has no payload at all
+    begin_payload(vt);
+  }
+
+  if (vt->string.handler && vt->string.handler->end) {
+    vt->string.handler->end(vt, aborted || vt->string.overflow);
+  }
+
+  vt->string.kind = STRING_NONE;
+  vt->string.handler = NULL;
+}
+
+// Returns 1 if c was consumed as part of the prefix.
+static int string_prefix_char(struct vt *vt, char c) {
+  if (vt->string.prefix_len + 1 >= STRING_PREFIX_SIZE) {
+    // no handler takes a prefix this long
+    vt->string.kind = STRING_IGNORED;
+    vt->string.started = 1;
+    return 0;
+  }
+
+  if (vt->string.kind == STRING_OSC) {
+    // OSC Ps ; Pt
+    if (isdigit(c)) {
+      vt->string.prefix[vt->string.prefix_len++] = c;
+      return 1;
+    }
+
+    begin_payload(vt);
+    return c == ';';
+  }
+
+  // DCS: parameters and intermediates, then a final byte
+  if (c >= 0x20 && c <= 0x3f) {
+    vt->string.prefix[vt->string.prefix_len++] = c;
+  } else if (c >= 0x40 && c <= 0x7e) {
+    vt->string.prefix[vt->string.prefix_len++] = c;
+    begin_payload(vt);
+  }
+
+  return 1;
+}
+
+static int is_string_terminator(char c) {
+  return c == '\a' || c == '\033' || c == '\030' || c == '\032';
+}
+
+// Feed bytes of the current OSC/DCS string. Returns how many were consumed;
+// the rest belong to whatever follows the string.
+static size_t process_string(struct vt *vt, const char *string, size_t length) {
+  size_t i = 0;
+  while (i < length) {
+    char c = string[i];
+
+    if (vt->string.esc) {
+      vt->string.esc = 0;
+      if (c == '\\') {
+        // ST - String Terminator
+        finish_string(vt, 0);
+        return i + 1;
+      }
+
+      // ESC followed by anything else cancels the string and starts a new
+      // sequence, which this byte belongs to
+      finish_string(vt, 1);
+      vt->in_sequence = 1;
+      return i;
+    }
+
+    switch (c) {
+    case '\a':
+      // BEL ends the string too, as in xterm
+      finish_string(vt, 0);
+      return i + 1;
+    case '\033':
+      vt->string.esc = 1;
+      ++i;
+      continue;
+    case '\030':
+    case '\032':
+      // CAN, SUB
+      finish_string(vt, 1);
+      return i + 1;
+    }
+
+    if (!vt->string.started) {
+      if (string_prefix_char(vt, c)) {
+        ++i;
+      }
+      continue;
+    }
+
+    // hand over everything up to the next possible terminator in one go
+    size_t end = i + 1;
+    while (end < length && !is_string_terminator(string[end])) {
+      ++end;
+    }
+
+    string_data(vt, string + i, end - i);
+    i = end;
+  }
+
+  return i;
+}
+
+// Character set translation for the ASCII range, indexed by charset number.
+// The active table is picked whenever the charset changes so printing is a
+// single lookup.
+#define ASCII_ROW(n)                                                           \
+  (n), (n) + 1, (n) + 2, (n) + 3, (n) + 4, (n) + 5, (n) + 6, (n) + 7
+
+static const uint32_t charset_ascii[128] = {
+    ASCII_ROW(0x00),
+    ASCII_ROW(0x08),
+    ASCII_ROW(0x10),
+    ASCII_ROW(0x18),
+    ASCII_ROW(0x20),
+    ASCII_ROW(0x28),
+    ASCII_ROW(0x30),
+    ASCII_ROW(0x38),
+    ASCII_ROW(0x40),
+    ASCII_ROW(0x48),
+    ASCII_ROW(0x50),
+    ASCII_ROW(0x58),
+    ASCII_ROW(0x60),
+    ASCII_ROW(0x68),
+    ASCII_ROW(0x70),
+    ASCII_ROW(0x78),
+};
+
+static const uint32_t charset_graphics[128] = {
+    ASCII_ROW(0x00),
+    ASCII_ROW(0x08),
+    ASCII_ROW(0x10),
+    ASCII_ROW(0x18),
+    ASCII_ROW(0x20),
+    ASCII_ROW(0x28),
+    ASCII_ROW(0x30),
+    ASCII_ROW(0x38),
+    ASCII_ROW(0x40),
+    ASCII_ROW(0x48),
+    ASCII_ROW(0x50),
+    0x58, 0x59, 0x5A, 0x5B, 0x5C, 0x5D, 0x5E, ' ',
+    0x25C6, 0x2592, 0x2409, 0x240C, 0x240D, 0x240A, 0x00B0, 0x00B1,
+    0x2424, 0x240B, 0x2518, 0x2510, 0x250C, 0x2514, 0x253C, 0x23BA,
+    0x23BB, 0x2500, 0x23BC, 0x23BD, 0x251C, 0x2524, 0x2534, 0x252C,
+    0x2502, 0x2264, 0x2265, 0x03C0, 0x2260, 0x00A3, 0x00B7, 0x7F,
+};
+
+static const uint32_t charset_uk[128] = {
+    ASCII_ROW(0x00),
+    ASCII_ROW(0x08),
+    ASCII_ROW(0x10),
+    ASCII_ROW(0x18),
+    // pound sign instead of #
+    ' ', '!', '"', 0xA3, '$', '%', '&', '\'',
+    ASCII_ROW(0x28),
+    ASCII_ROW(0x30),
+    ASCII_ROW(0x38),
+    ASCII_ROW(0x40),
+    ASCII_ROW(0x48),
+    ASCII_ROW(0x50),
+    ASCII_ROW(0x58),
+    ASCII_ROW(0x60),
+    ASCII_ROW(0x68),
+    ASCII_ROW(0x70),
+    ASCII_ROW(0x78),
+};
+
+static const uint32_t *const charset_tables[] = {
+    charset_ascii,
+    charset_graphics,
+    charset_uk,
+};
+
+#undef ASCII_ROW
+
+static void handle_paren_seq(struct vt *vt) {
+  if (vt->seqidx < 2) {
+    return;
+  }
+
+  // fprintf(stderr, "paren: %s\n", vt->sequence);
+
+  int new_charset = 0;
+  switch (vt->sequence[1]) {
+  case 'A':
+    // UK
+    new_charset = 2;
+    break;
+  case 'B':
+    // ASCII
+    new_charset = 0;
+    break;
+  case '0':
+    // special graphics
+    new_charset = 1;
+    break;
+  case '1':
+    // alternate standard characters
+    new_charset = 0;
+    break;
+  case '2':
+    // alternate special graphics
+    new_charset = 1;
+    break;
+  }
+
+  if (vt->sequence[0] == '(') {
+    vt->charset_g0 = new_charset;
+  } else {
+    vt->charset_g1 = new_charset;
+  }
+
+  // redesignating the invoked set takes effect immediately
+  if ((vt->sequence[0] == '(') == !vt->shifted) {
+    select_charset(vt, new_charset);
+  }
+
+  // fprintf(stderr, " -> G0 %d, G1 %d\n", vt->charset_g0, vt->charset_g1);
+}
+
+void set_cp(struct vt *vt, struct cell *cell, uint32_t cp) {
+  // character sets only remap the ASCII range
+  cell->cp = cp < 0x80 ? vt->translate[cp] : cp;
+
+  // a new character drops any marks or wide state left from the old one
+  for (int i = 0; i < CELL_MAX_COMBINING; ++i) {
+    cell->combining[i] = 0;
+  }
+  cell->flags = 0;
+}
+
+static void select_charset(struct vt *vt, int charset) {
+  vt->charset = charset;
+  vt->translate = charset_tables[charset];
+}
+
+static int valid_charset(uint32_t charset) {
+  return charset < sizeof(charset_tables) / sizeof(charset_tables[0]);
 }
 
 static int row_cols(struct vt *vt, struct row *row) {
@@ -1,13 +1,21 @@
 #include <fcntl.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <termios.h>
 #include <unistd.h>
 
+#include <string>
+
 #include <gtest/gtest.h>
 
+#include <nihterm/diff.h>
+#include <nihterm/record.h>
+#include <nihterm/sixel.h>
 #include <nihterm/vt.h>
+#include <nihterm/width.h>
 
 struct teststate {
   teststate() {
@@ -100,6 +108,7 @@ static void vt_printf(struct teststate &state, const char *fmt, ...) {
 
 static ssize_t cpr(struct teststate &state, char *buf, size_t buflen) {
   vt_process(state.vt, "\033[6n", 4);
+  vt_flush(state.vt);
   return read_timeout(state.pty_child, buf, buflen, 2);
 }
 
@@ -186,6 +195,31 @@ TEST(VTTest, Overwrite) {
   delete[] testdata;
 }
 
+TEST(VTTest, PrintableRuns) {
+  struct teststate state;
+
+  char buf[64] = {0};
+  std::string run(100, 'a');
+  run[99] = 'z';
+
+  // without autowrap the end of a long run piles up on the last column
+  vt_printf(state, "\033[?7l%s", run.c_str());
+  EXPECT_EQ(vt_codepoint(state.vt, 78, 0), 'a');
+  EXPECT_EQ(vt_codepoint(state.vt, 79, 0), 'z');
+  cpr(state, buf, sizeof(buf));
+  EXPECT_STREQ(buf, "\033[1;80R");
+
+  // with it the run carries on at the start of the next line
+  vt_printf(state, "\033[?7h\033[2;1H%s", run.c_str());
+  EXPECT_EQ(vt_codepoint(state.vt, 79, 1), 'a');
+  EXPECT_EQ(vt_codepoint(state.vt, 19, 2), 'z');
+
+  // a run that ends on the left half of a wide character blanks the right
+  vt_printf(state, "\033[5;1Hab\xE4\xB8\xAD\033[5;1Hxyz");
+  EXPECT_EQ(vt_codepoint(state.vt, 2, 4), 'z');
+  EXPECT_EQ(vt_codepoint(state.vt, 3, 4), ' ');
+}
+
 TEST(VTTest, VT100_DECALN) {
   struct teststate state;
 
@@ -271,6 +305,64 @@ TEST(VTTest, VT102_IL) {
   delete[] testdata;
 }
 
+TEST(VTTest, InsertLineInRegion) {
+  struct teststate state;
+
+  // lines go in above the cursor's line and drop off the bottom margin
+  vt_printf(state, "one\r\ntwo\r\nthree\r\nfour\033[1;3r\033[2;1H\033[L");
+
+  char buf[4096];
+  vt_fill_into(state.vt, buf, sizeof(buf), VT_FILL_TRIM);
+  EXPECT_EQ(std::string(buf, 14), "one\n\ntwo\nfour\n");
+
+  // deleting the bottom line of the region keeps the lines below it
+  vt_printf(state, "\033[3;1H\033[M\033[r");
+  vt_fill_into(state.vt, buf, sizeof(buf), VT_FILL_TRIM);
+  EXPECT_EQ(std::string(buf, 10), "one\n\n\nfour");
+
+  // a one-line region scrolls just that line, either way
+  vt_printf(state, "\033[3;1Hx\033[3;3r\033[3;1H\n\033[r");
+  EXPECT_EQ(vt_codepoint(state.vt, 0, 2), ' ');
+  EXPECT_EQ(vt_codepoint(state.vt, 0, 3), 'f');
+  vt_printf(state, "\033[1;1Hy\033[1;1r\033[1;1H\033M\033[r");
+  EXPECT_EQ(vt_codepoint(state.vt, 0, 0), ' ');
+  EXPECT_EQ(vt_codepoint(state.vt, 0, 3), 'f');
+}
+
+TEST(VTTest, ScrollEraseRepeat) {
+  struct teststate state;
+
+  // SU and SD within the margins
+  vt_printf(state, "a\r\nb\r\nc\r\nd\033[2;3r\033[S");
+  EXPECT_EQ(vt_codepoint(state.vt, 0, 0), 'a');
+  EXPECT_EQ(vt_codepoint(state.vt, 0, 1), 'c');
+  EXPECT_EQ(vt_codepoint(state.vt, 0, 2), ' ');
+  EXPECT_EQ(vt_codepoint(state.vt, 0, 3), 'd');
+  vt_printf(state, "\033[2T\033[r");
+  EXPECT_EQ(vt_codepoint(state.vt, 0, 1), ' ');
+  EXPECT_EQ(vt_codepoint(state.vt, 0, 2), ' ');
+  EXPECT_EQ(vt_codepoint(state.vt, 0, 3), 'd');
+
+  // a one-line region scrolls just that line
+  vt_printf(state, "\033[3;1Hc\033[3;3r\033[S\033[r");
+  EXPECT_EQ(vt_codepoint(state.vt, 0, 2), ' ');
+  EXPECT_EQ(vt_codepoint(state.vt, 0, 3), 'd');
+
+  // ECH erases with the pen and leaves the cursor alone
+  vt_printf(state, "\033[5;1Habcdef\033[5;2H\033[44m\033[3X\033[mZ");
+  EXPECT_EQ(vt_codepoint(state.vt, 1, 4), 'Z');
+  EXPECT_EQ(vt_codepoint(state.vt, 2, 4), ' ');
+  EXPECT_EQ(vt_attr(state.vt, 3, 4).bg, color_indexed(4));
+  EXPECT_EQ(vt_codepoint(state.vt, 4, 4), 'e');
+
+  // REP repeats the last character printed, wide ones included
+  vt_printf(state, "\033[6;1Hx\033[4b\xe4\xb8\x80\033[2b");
+  char buf[64];
+  memset(buf, 0, sizeof(buf));
+  vt_fill_region(state.vt, 0, 5, 11, 1, buf, sizeof(buf), 0);
+  EXPECT_STREQ(buf, "xxxxx\xe4\xb8\x80\xe4\xb8\x80\xe4\xb8\x80\n");
+}
+
 TEST(VTTest, ScrollUp) {
   struct teststate state;
 
@@ -707,6 +799,7 @@ TEST(VTTest, VT100_ENQ) {
 
   const char *teststr = "\005";
   vt_process(state.vt, teststr, strlen(teststr));
+  EXPECT_EQ(vt_flush(state.vt), 0);
 
   ssize_t rc = read_timeout(state.pty_child, buf, 64, 2);
   if (rc < 0 && errno == ETIMEDOUT) {
@@ -723,6 +816,7 @@ TEST(VTTest, VT100_DA) {
 
   const char *teststr = "\033[c";
   vt_process(state.vt, teststr, strlen(teststr));
+  EXPECT_EQ(vt_flush(state.vt), 0);
 
   ssize_t rc = read_timeout(state.pty_child, buf, 64, 2);
   if (rc < 0 && errno == ETIMEDOUT) {
@@ -739,6 +833,7 @@ TEST(VTTest, VT100_DECID) {
 
   const char *teststr = "\033Z";
   vt_process(state.vt, teststr, strlen(teststr));
+  EXPECT_EQ(vt_flush(state.vt), 0);
 
   ssize_t rc = read_timeout(state.pty_child, buf, 64, 2);
   if (rc < 0 && errno == ETIMEDOUT) {
@@ -748,6 +843,1095 @@ TEST(VTTest, VT100_DECID) {
   EXPECT_STREQ(buf, "\033[?1;6c");
 }
 
+TEST(VTTest, ResponsesQueuedUntilFlush) {
+  struct teststate state;
+
+  char buf[64] = {0};
+
+  vt_process(state.vt, "\033[5n", 4);
+  EXPECT_EQ(vt_pending(state.vt), 4u);
+
+  // nothing reaches the pty until the queue is drained
+  ssize_t rc = read_timeout(state.pty_child, buf, 64, 0);
+  EXPECT_LT(rc, 0);
+
+  EXPECT_EQ(vt_flush(state.vt), 0);
+  rc = read_timeout(state.pty_child, buf, 64, 2);
+  EXPECT_EQ(rc, 4);
+  EXPECT_STREQ(buf, "\033[0n");
+}
+
+TEST(VTTest, ResponseQueueIsBounded) {
+  struct teststate state;
+
+  // a CPR flood with nobody draining replies must not block or grow forever
+  for (int i = 0; i < 10000; ++i) {
+    vt_process(state.vt, "\033[6n", 4);
+  }
+
+  EXPECT_LE(vt_pending(state.vt), 4096u);
+
+  // parsing carries on regardless
+  vt_printf(state, "A");
+  char *buffer = NULL;
+  vt_fill(state.vt, &buffer);
+  EXPECT_EQ(buffer[0], 'A');
+  free(buffer);
+}
+
+TEST(VTTest, InputAfterQueuedReplies) {
+  struct teststate state;
+
+  char buf[64] = {0};
+
+  // LNM sends CR LF for RETURN
+  vt_printf(state, "\033[20h\033[5n");
+  EXPECT_EQ(vt_input(state.vt, "ab\rc", 4), 5);
+
+  // the reply was queued first, so it goes out first
+  ssize_t rc = read_timeout(state.pty_child, buf, 64, 2);
+  EXPECT_EQ(rc, 9);
+  EXPECT_STREQ(buf, "\033[0nab\r\nc");
+}
+
+TEST(VTTest, Paste) {
+  struct teststate state;
+
+  char buf[64] = {0};
+
+  EXPECT_EQ(vt_paste(state.vt, "a\nb\r\n", 5), 0);
+  EXPECT_EQ(vt_pending(state.vt), 4u);
+  EXPECT_EQ(vt_flush(state.vt), 0);
+
+  ssize_t rc = read_timeout(state.pty_child, buf, 64, 2);
+  EXPECT_EQ(rc, 4);
+  EXPECT_STREQ(buf, "a\rb\r");
+}
+
+TEST(VTTest, BracketedPaste) {
+  struct teststate state;
+
+  char buf[64] = {0};
+
+  vt_printf(state, "\033[?2004h");
+
+  // an embedded end marker must not escape the paste
+  EXPECT_EQ(vt_paste(state.vt, "x\033[201~y", 8), 0);
+  EXPECT_EQ(vt_flush(state.vt), 0);
+
+  ssize_t rc = read_timeout(state.pty_child, buf, 64, 2);
+  EXPECT_EQ(rc, 19);
+  EXPECT_STREQ(buf, "\033[200~x[201~y\033[201~");
+}
+
+TEST(VTTest, PasteInterruptedByInput) {
+  struct teststate state;
+
+  char buf[64] = {0};
+
+  // as in nihterm, so flushing stops when the pty is full
+  fcntl(state.pty_parent, F_SETFL,
+        fcntl(state.pty_parent, F_GETFL) | O_NONBLOCK);
+
+  vt_printf(state, "\033[?2004h");
+
+  // a paste far larger than one flush will write
+  size_t len = 1 << 20;
+  char *text = new char[len];
+  memset(text, 'p', len);
+  EXPECT_EQ(vt_paste(state.vt, text, len), 0);
+  delete[] text;
+
+  vt_flush(state.vt);
+  EXPECT_GT(vt_pending(state.vt), 0u);
+
+  // drain whatever made it to the pty
+  char drain[65536];
+  while (read_timeout(state.pty_child, drain, sizeof(drain), 0) > 0) {
+  }
+
+  // typing cuts the paste short, closing the bracket first
+  EXPECT_EQ(vt_input(state.vt, "\003", 1), 1);
+  EXPECT_EQ(vt_pending(state.vt), 0u);
+
+  ssize_t rc = read_timeout(state.pty_child, buf, 64, 2);
+  EXPECT_EQ(rc, 7);
+  EXPECT_STREQ(buf, "\033[201~\003");
+}
+
+TEST(VTTest, InputModes) {
+  struct teststate state;
+
+  EXPECT_EQ(vt_input_modes(state.vt), 0u);
+
+  vt_printf(state, "\033[?1h\033=");
+  EXPECT_EQ(vt_input_modes(state.vt), VT_INPUT_DECCKM | VT_INPUT_DECKPAM);
+
+  vt_printf(state, "\033>");
+  EXPECT_EQ(vt_input_modes(state.vt), VT_INPUT_DECCKM);
+
+  vt_printf(state, "\033[?1l\033[?2l");
+  EXPECT_EQ(vt_input_modes(state.vt), VT_INPUT_VT52);
+
+  // VT52 has its own keypad mode sequences
+  vt_printf(state, "\033=");
+  EXPECT_EQ(vt_input_modes(state.vt), VT_INPUT_VT52 | VT_INPUT_DECKPAM);
+
+  vt_printf(state, "\033<\033>");
+  EXPECT_EQ(vt_input_modes(state.vt), 0u);
+}
+
+TEST(VTTest, OSC_Title) {
+  struct teststate state;
+
+  vt_printf(state, "\033]2;hello\007A");
+  EXPECT_STREQ(vt_title(state.vt), "hello");
+
+  // split across writes and terminated by ST
+  vt_printf(state, "\033]0;split ");
+  vt_printf(state, "title\033\\B");
+  EXPECT_STREQ(vt_title(state.vt), "split title");
+
+  // cancelled strings leave the title alone
+  vt_printf(state, "\033]2;nope\030C");
+  EXPECT_STREQ(vt_title(state.vt), "split title");
+
+  char *buffer = nullptr;
+  vt_fill(state.vt, &buffer);
+  EXPECT_EQ(strncmp(buffer, "ABC", 3), 0);
+  free(buffer);
+}
+
+TEST(VTTest, LongControlStrings) {
+  struct teststate state;
+
+  vt_set_string_limit(state.vt, 1024);
+
+  // far longer than both the limit and the old sequence buffer
+  std::string title = "\033]2;";
+  title.append(100000, 'x');
+  title += "\007";
+  vt_process(state.vt, title.data(), title.size());
+  EXPECT_STREQ(vt_title(state.vt), "");
+
+  std::string dcs = "\033P1;2|";
+  dcs.append(100000, 'y');
+  dcs += "\033\\";
+  vt_process(state.vt, dcs.data(), dcs.size());
+
+  // titles within the limit are truncated rather than dropped
+  title = "\033]2;";
+  title.append(1000, 'z');
+  title += "\007";
+  vt_process(state.vt, title.data(), title.size());
+  EXPECT_EQ(strlen(vt_title(state.vt)), 255u);
+
+  vt_printf(state, "A");
+
+  char *buffer = nullptr;
+  vt_fill(state.vt, &buffer);
+  EXPECT_EQ(buffer[0], 'A');
+  free(buffer);
+}
+
+TEST(VTTest, OSC52_SetClipboard) {
+  struct teststate state;
+
+  size_t length = 0;
+  EXPECT_EQ(vt_clipboard(state.vt, &length), nullptr);
+
+  // "hello, clipboard" split at awkward points, with padding
+  const char *parts[] = {"\033]52;c;aGVsb", "G8sIGNs", "aXBib2Fy", "ZA=", "=\033\\"};
+  for (const char *part : parts) {
+    vt_process(state.vt, part, strlen(part));
+  }
+
+  const char *clipboard = vt_clipboard(state.vt, &length);
+  ASSERT_NE(clipboard, nullptr);
+  EXPECT_EQ(length, 16u);
+  EXPECT_STREQ(clipboard, "hello, clipboard");
+
+  // invalid data leaves the clipboard alone
+  vt_printf(state, "\033]52;c;!!!!\007");
+  EXPECT_STREQ(vt_clipboard(state.vt, nullptr), "hello, clipboard");
+
+  // an empty payload clears it
+  vt_printf(state, "\033]52;c;\007");
+  EXPECT_STREQ(vt_clipboard(state.vt, &length), "");
+  EXPECT_EQ(length, 0u);
+}
+
+TEST(VTTest, OSC52_QueryClipboard) {
+  struct teststate state;
+
+  char buf[64] = {0};
+
+  // queries go unanswered until reads are allowed, so the DA reply is the
+  // first thing back
+  vt_printf(state, "\033]52;c;bmlo\007\033]52;c;?\007\033[c");
+  EXPECT_EQ(vt_flush(state.vt), 0);
+
+  ssize_t rc = read_timeout(state.pty_child, buf, 64, 2);
+  EXPECT_EQ(rc, 7);
+  EXPECT_STREQ(buf, "\033[?1;6c");
+
+  memset(buf, 0, sizeof(buf));
+  vt_allow_clipboard_read(state.vt, 1);
+  vt_printf(state, "\033]52;c;?\007");
+  EXPECT_EQ(vt_flush(state.vt), 0);
+
+  rc = read_timeout(state.pty_child, buf, 64, 2);
+  EXPECT_EQ(rc, 13);
+  EXPECT_STREQ(buf, "\033]52;c;bmlo\033\\");
+}
+
+TEST(VTTest, SixelDecode) {
+  struct sixel_decoder dec;
+  sixel_init(&dec, "q");
+
+  // red run, then green over the first column, then a second band; split
+  // mid-parameter and mid-run
+  const char *parts[] = {"#1;2;100;0;0!", "3~$#2;2;0;1", "00;0~-?", "@"};
+  for (const char *part : parts) {
+    sixel_decode(&dec, part, strlen(part));
+  }
+
+  struct sixel_image *image = sixel_finish(&dec);
+  ASSERT_NE(image, nullptr);
+  EXPECT_EQ(image->width, 3);
+  EXPECT_EQ(image->height, 7);
+
+  EXPECT_EQ(image->pixels[0], 0xFF00FF00u);
+  EXPECT_EQ(image->pixels[1], 0xFFFF0000u);
+  EXPECT_EQ(image->pixels[5 * 3 + 2], 0xFFFF0000u);
+  EXPECT_EQ(image->pixels[6 * 3 + 1], 0xFF00FF00u);
+
+  // unset pixels take the background unless P2 is 1
+  EXPECT_EQ(image->pixels[6 * 3], 0xFF000000u);
+
+  sixel_image_free(image);
+
+  sixel_init(&dec, "0;1;0q");
+  sixel_decode(&dec, "@-@", 3);
+  image = sixel_finish(&dec);
+  ASSERT_NE(image, nullptr);
+  EXPECT_EQ(image->height, 7);
+  EXPECT_EQ(image->pixels[1], 0u);
+  sixel_image_free(image);
+}
+
+TEST(VTTest, SixelPlacement) {
+  struct teststate state;
+
+  char buf[64] = {0};
+
+  // 24 pixels tall covers two 20 pixel rows
+  vt_printf(state, "\033Pq#0;2;100;0;0!20~-!20~-!20~-!20~\033\\A");
+
+  ssize_t rc = cpr(state, buf, 64);
+  EXPECT_GT(rc, 0);
+  EXPECT_STREQ(buf, "\033[3;2R");
+
+  char *buffer = nullptr;
+  vt_fill(state.vt, &buffer);
+  EXPECT_EQ(buffer[2 * 81], 'A');
+  free(buffer);
+}
+
+TEST(VTTest, UTF8) {
+  struct teststate state;
+
+  // "a", e acute, euro sign, musical G clef, each split across calls
+  const char *parts[] = {"a\xC3", "\xA9\xE2\x82", "\xAC\xF0", "\x9D\x84",
+                         "\x9E" "b"};
+  for (const char *part : parts) {
+    vt_process(state.vt, part, strlen(part));
+  }
+
+  EXPECT_EQ(vt_codepoint(state.vt, 0, 0), 'a');
+  EXPECT_EQ(vt_codepoint(state.vt, 1, 0), 0xE9u);
+  EXPECT_EQ(vt_codepoint(state.vt, 2, 0), 0x20ACu);
+  EXPECT_EQ(vt_codepoint(state.vt, 3, 0), 0x1D11Eu);
+  EXPECT_EQ(vt_codepoint(state.vt, 4, 0), 'b');
+
+  char *buffer = nullptr;
+  vt_fill(state.vt, &buffer);
+  EXPECT_EQ(strncmp(buffer, "a???b", 5), 0);
+  free(buffer);
+}
+
+TEST(VTTest, UTF8_Invalid) {
+  struct teststate state;
+
+  // truncated sequence, stray continuation, overlong NUL, surrogate, C1
+  // control, then a sequence cut short by an escape sequence
+  vt_printf(state, "\xE2\x82x\x80\xC0\x80\xED\xA0\x80\xC2\x85y\xC3\033[3;1H!");
+
+  EXPECT_EQ(vt_codepoint(state.vt, 0, 0), 0xFFFDu);
+  EXPECT_EQ(vt_codepoint(state.vt, 1, 0), 'x');
+  EXPECT_EQ(vt_codepoint(state.vt, 2, 0), 0xFFFDu);
+  EXPECT_EQ(vt_codepoint(state.vt, 3, 0), 0xFFFDu);
+  EXPECT_EQ(vt_codepoint(state.vt, 4, 0), 0xFFFDu);
+  EXPECT_EQ(vt_codepoint(state.vt, 5, 0), 0xFFFDu);
+  EXPECT_EQ(vt_codepoint(state.vt, 6, 0), 0xFFFDu);
+  EXPECT_EQ(vt_codepoint(state.vt, 7, 0), 0xFFFDu);
+  EXPECT_EQ(vt_codepoint(state.vt, 8, 0), 'y');
+  EXPECT_EQ(vt_codepoint(state.vt, 9, 0), 0xFFFDu);
+  EXPECT_EQ(vt_codepoint(state.vt, 0, 2), '!');
+}
+
+TEST(VTTest, WideCharacters) {
+  struct teststate state;
+
+  char buf[64] = {0};
+
+  // two CJK ideographs then ASCII
+  vt_printf(state, "\xE4\xB8\xAD\xE6\x96\x87x");
+  EXPECT_EQ(vt_codepoint(state.vt, 0, 0), 0x4E2Du);
+  EXPECT_EQ(vt_codepoint(state.vt, 1, 0), 0u);
+  EXPECT_EQ(vt_codepoint(state.vt, 2, 0), 0x6587u);
+  EXPECT_EQ(vt_codepoint(state.vt, 4, 0), 'x');
+
+  ssize_t rc = cpr(state, buf, 64);
+  EXPECT_GT(rc, 0);
+  EXPECT_STREQ(buf, "\033[1;6R");
+
+  // overwriting the right half of the first character blanks its left half
+  vt_printf(state, "\033[1;2Hy");
+  EXPECT_EQ(vt_codepoint(state.vt, 0, 0), ' ');
+  EXPECT_EQ(vt_codepoint(state.vt, 1, 0), 'y');
+  EXPECT_EQ(vt_codepoint(state.vt, 2, 0), 0x6587u);
+
+  // deleting either half of a character blanks the other
+  vt_printf(state, "\033[3;1H\xE4\xB8\xAD\xE6\x96\x87\033[3;2H\033[P");
+  EXPECT_EQ(vt_codepoint(state.vt, 0, 2), ' ');
+  EXPECT_EQ(vt_codepoint(state.vt, 1, 2), 0x6587u);
+  vt_printf(state, "\033[P");
+  EXPECT_EQ(vt_codepoint(state.vt, 1, 2), ' ');
+  EXPECT_EQ(vt_codepoint(state.vt, 2, 2), ' ');
+  vt_printf(state, "\033[3;1H\033[K");
+
+  // an emoji that doesn't fit in the last column wraps whole
+  vt_printf(state, "\033[?7h\033[2;80H\xF0\x9F\x98\x80");
+  EXPECT_EQ(vt_codepoint(state.vt, 79, 1), ' ');
+  EXPECT_EQ(vt_codepoint(state.vt, 0, 2), 0x1F600u);
+
+  char *buffer = nullptr;
+  vt_fill(state.vt, &buffer);
+  EXPECT_EQ(strncmp(buffer, " y? x", 5), 0);
+  free(buffer);
+}
+
+TEST(VTTest, CombiningMarks) {
+  struct teststate state;
+
+  char buf[64] = {0};
+
+  // e + combining acute + combining diaeresis, then a third mark which is
+  // dropped
+  vt_printf(state, "e\xCC\x81\xCC\x88\xCC\xA3z");
+  EXPECT_EQ(vt_codepoint(state.vt, 0, 0), 'e');
+  EXPECT_EQ(vt_codepoint(state.vt, 1, 0), 'z');
+
+  ssize_t rc = cpr(state, buf, 64);
+  EXPECT_GT(rc, 0);
+  EXPECT_STREQ(buf, "\033[1;3R");
+
+  // a mark after a pending wrap lands on the last column
+  vt_printf(state, "\033[2;80Hq\xCC\x81");
+  rc = cpr(state, buf, 64);
+  EXPECT_GT(rc, 0);
+  EXPECT_STREQ(buf, "\033[2;80R");
+
+  // and so does one with wrap off, where the cursor stays on that column
+  vt_printf(state, "\033[?7l\033[3;79Hpq\xCC\x81");
+  struct snapshot *snap = vt_snapshot(state.vt);
+  struct snapshot_row row;
+  ASSERT_EQ(vt_snapshot_row(snap, 2, &row), 0);
+  EXPECT_EQ(row.cells[78].combining[0], 0u);
+  EXPECT_EQ(row.cells[79].combining[0], 0x301u);
+  vt_snapshot_release(snap);
+
+  // CUP doesn't clamp the column, and a mark there has nothing to attach to
+  vt_printf(state, "\033[1;134H\xCC\x81\033[99999;99999H\xCC\x81");
+  snap = vt_snapshot(state.vt);
+  ASSERT_EQ(vt_snapshot_row(snap, 0, &row), 0);
+  EXPECT_EQ(row.cells[79].combining[0], 0u);
+  vt_snapshot_release(snap);
+
+  // the table lookups match a few known widths
+  EXPECT_EQ(unicode_width('a'), 1);
+  EXPECT_EQ(unicode_width(0x0301), 0);
+  EXPECT_EQ(unicode_width(0x200B), 0);
+  EXPECT_EQ(unicode_width(0x1160), 0);
+  EXPECT_EQ(unicode_width(0xAC00), 2);
+  EXPECT_EQ(unicode_width(0xFF21), 2);
+  EXPECT_EQ(unicode_width(0x1F600), 2);
+  EXPECT_EQ(unicode_width(0x10FFFF), 1);
+}
+
+TEST(VTTest, CharacterSets) {
+  struct teststate state;
+
+  // G1 as special graphics, shifted in and out
+  vt_printf(state, "\033)0q\016qx_\017q");
+  EXPECT_EQ(vt_codepoint(state.vt, 0, 0), 'q');
+  EXPECT_EQ(vt_codepoint(state.vt, 1, 0), 0x2500u);
+  EXPECT_EQ(vt_codepoint(state.vt, 2, 0), 0x2502u);
+  EXPECT_EQ(vt_codepoint(state.vt, 3, 0), ' ');
+  EXPECT_EQ(vt_codepoint(state.vt, 4, 0), 'q');
+
+  // designating G0 while it is invoked takes effect straight away
+  vt_printf(state, "\033(A#\033(B#");
+  EXPECT_EQ(vt_codepoint(state.vt, 5, 0), 0xA3u);
+  EXPECT_EQ(vt_codepoint(state.vt, 6, 0), '#');
+
+  // DECSC/DECRC carry the charset
+  vt_printf(state, "\033(0\0337\033(Bj\0338j");
+  EXPECT_EQ(vt_codepoint(state.vt, 7, 0), 0x2518u);
+}
+
+TEST(VTTest, CSIParameters) {
+  struct teststate state;
+
+  char buf[64] = {0};
+
+  // more parameters than are kept, with an oversized value
+  vt_printf(state, "\033[1;2;3;4;5;6;7;8;9;10;11;12;13;14;15;16;17;99999999mA\033[m");
+  EXPECT_EQ(vt_codepoint(state.vt, 0, 0), 'A');
+
+  // empty and zero parameters take the default
+  vt_printf(state, "\033[;5H");
+  ssize_t rc = cpr(state, buf, 64);
+  EXPECT_GT(rc, 0);
+  EXPECT_STREQ(buf, "\033[1;5R");
+
+  vt_printf(state, "\033[0B\033[0C");
+  rc = cpr(state, buf, 64);
+  EXPECT_GT(rc, 0);
+  EXPECT_STREQ(buf, "\033[2;6R");
+
+  // several modes in one sequence
+  vt_printf(state, "\033[?1;2004h");
+  EXPECT_EQ(vt_input_modes(state.vt), VT_INPUT_DECCKM);
+  vt_paste(state.vt, "x", 1);
+  vt_flush(state.vt);
+  memset(buf, 0, sizeof(buf));
+  rc = read_timeout(state.pty_child, buf, 64, 2);
+  EXPECT_STREQ(buf, "\033[200~x\033[201~");
+
+  // private DSR
+  vt_printf(state, "\033[?15n");
+  vt_flush(state.vt);
+  memset(buf, 0, sizeof(buf));
+  rc = read_timeout(state.pty_child, buf, 64, 2);
+  EXPECT_STREQ(buf, "\033[?13n");
+
+  // sequences with intermediates are consumed whole, not printed
+  vt_printf(state, "\033[1;1H\033[2 q\033[!p");
+  EXPECT_EQ(vt_codepoint(state.vt, 0, 0), 'A');
+  EXPECT_EQ(vt_codepoint(state.vt, 1, 0), ' ');
+}
+
+TEST(VTTest, SGR) {
+  struct teststate state;
+
+  // attributes accumulate across sequences
+  vt_printf(state, "\033[1m\033[3;9mA\033[22;23mB\033[2;7;8mC\033[0mD");
+  EXPECT_EQ(vt_attr(state.vt, 0, 0).flags,
+            static_cast<uint32_t>(ATTR_BOLD | ATTR_ITALIC | ATTR_STRIKE));
+  EXPECT_EQ(vt_attr(state.vt, 1, 0).flags, static_cast<uint32_t>(ATTR_STRIKE));
+  EXPECT_EQ(vt_attr(state.vt, 2, 0).flags,
+            static_cast<uint32_t>(ATTR_STRIKE | ATTR_DIM | ATTR_REVERSE | ATTR_HIDDEN));
+  EXPECT_EQ(vt_attr(state.vt, 3, 0).flags, 0u);
+
+  // 16 colors, bright colors and defaults
+  vt_printf(state, "\033[31;42mE\033[97;104mF\033[39mG\033[49mH");
+  EXPECT_EQ(vt_attr(state.vt, 4, 0).fg, color_indexed(1));
+  EXPECT_EQ(vt_attr(state.vt, 4, 0).bg, color_indexed(2));
+  EXPECT_EQ(vt_attr(state.vt, 5, 0).fg, color_indexed(15));
+  EXPECT_EQ(vt_attr(state.vt, 5, 0).bg, color_indexed(12));
+  EXPECT_EQ(vt_attr(state.vt, 6, 0).fg, static_cast<uint32_t>(COLOR_DEFAULT));
+  EXPECT_EQ(vt_attr(state.vt, 7, 0).bg, static_cast<uint32_t>(COLOR_DEFAULT));
+
+  // 256 colors and truecolor, in both the ';' and ':' forms
+  vt_printf(state, "\033[0;38;5;208;48;2;1;2;3mI");
+  vt_printf(state, "\033[38:2::10:20:30;48:5:99;4mJ");
+  vt_printf(state, "\033[38:2:40:50:60;4:0mK");
+  EXPECT_EQ(vt_attr(state.vt, 8, 0).fg, color_indexed(208));
+  EXPECT_EQ(vt_attr(state.vt, 8, 0).bg, color_rgb(1, 2, 3));
+  EXPECT_EQ(vt_attr(state.vt, 9, 0).fg, color_rgb(10, 20, 30));
+  EXPECT_EQ(vt_attr(state.vt, 9, 0).bg, color_indexed(99));
+  EXPECT_EQ(vt_attr(state.vt, 9, 0).flags, static_cast<uint32_t>(ATTR_UNDERLINE));
+  EXPECT_EQ(vt_attr(state.vt, 10, 0).fg, color_rgb(40, 50, 60));
+  EXPECT_EQ(vt_attr(state.vt, 10, 0).flags, 0u);
+
+  // a truncated color drops the rest of the sequence
+  vt_printf(state, "\033[0;38;2;1;1mL");
+  EXPECT_EQ(vt_attr(state.vt, 11, 0).fg, static_cast<uint32_t>(COLOR_DEFAULT));
+}
+
+TEST(VTTest, SGR_ManyColors) {
+  struct teststate state;
+
+  // more distinct attributes than the table holds; only what's on screen
+  // has to survive
+  vt_printf(state, "\033[38;2;1;2;3mA\033[H");
+
+  // snapshots share the attribute table rather than copying it
+  struct snapshot *snap = vt_snapshot(state.vt);
+  struct snapshot *again = vt_snapshot(state.vt);
+  size_t num_attrs = 0, num_again = 0;
+  const struct cellattr *attrs = vt_snapshot_attrs(snap, &num_attrs);
+  EXPECT_EQ(vt_snapshot_attrs(again, &num_again), attrs);
+  EXPECT_EQ(num_again, num_attrs);
+  vt_snapshot_release(again);
+
+  std::string out;
+  for (int i = 0; i < 70000; ++i) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "\033[48;2;%d;%d;%dm ", i >> 16, (i >> 8) & 255,
+             i & 255);
+    out += buf;
+    if (i % 1000 == 0) {
+      out += "\033[2;1H";
+    }
+  }
+  vt_process(state.vt, out.data(), out.size());
+
+  vt_printf(state, "\033[1;2HB");
+  EXPECT_EQ(vt_attr(state.vt, 0, 0).fg, color_rgb(1, 2, 3));
+  EXPECT_EQ(vt_attr(state.vt, 1, 0).bg, color_rgb(1, 17, 111));
+
+  // compaction renumbered the table, but not the snapshot's
+  struct snapshot_row row;
+  ASSERT_EQ(vt_snapshot_row(snap, 0, &row), 0);
+  ASSERT_LT(row.cells[0].attr, num_attrs);
+  EXPECT_EQ(attrs[row.cells[0].attr].fg, color_rgb(1, 2, 3));
+  EXPECT_EQ(vt_snapshot_attrs(snap, &num_again), attrs);
+  EXPECT_EQ(num_again, num_attrs);
+  vt_snapshot_release(snap);
+}
+
+TEST(VTTest, TabStops) {
+  struct teststate state;
+
+  char buf[64] = {0};
+
+  // default stops every 8 columns
+  vt_printf(state, "\tA");
+  EXPECT_EQ(vt_codepoint(state.vt, 8, 0), 'A');
+
+  // CHT and CBT move several stops at once
+  vt_printf(state, "\033[3I");
+  ssize_t rc = cpr(state, buf, 64);
+  EXPECT_GT(rc, 0);
+  EXPECT_STREQ(buf, "\033[1;33R");
+
+  vt_printf(state, "\033[2Z");
+  memset(buf, 0, sizeof(buf));
+  rc = cpr(state, buf, 64);
+  EXPECT_GT(rc, 0);
+  EXPECT_STREQ(buf, "\033[1;17R");
+
+  // running out of stops stops at the edges
+  vt_printf(state, "\033[99Z");
+  memset(buf, 0, sizeof(buf));
+  rc = cpr(state, buf, 64);
+  EXPECT_GT(rc, 0);
+  EXPECT_STREQ(buf, "\033[1;1R");
+
+  vt_printf(state, "\033[99I");
+  memset(buf, 0, sizeof(buf));
+  rc = cpr(state, buf, 64);
+  EXPECT_GT(rc, 0);
+  EXPECT_STREQ(buf, "\033[1;80R");
+
+  // clear them all and set stops either side of a 64-column word
+  vt_printf(state, "\033[3g\033[1;4H\033H\033[1;70H\033H\033[1;1H\t");
+  memset(buf, 0, sizeof(buf));
+  rc = cpr(state, buf, 64);
+  EXPECT_GT(rc, 0);
+  EXPECT_STREQ(buf, "\033[1;4R");
+
+  vt_printf(state, "\t");
+  memset(buf, 0, sizeof(buf));
+  rc = cpr(state, buf, 64);
+  EXPECT_GT(rc, 0);
+  EXPECT_STREQ(buf, "\033[1;70R");
+
+  vt_printf(state, "\033[Z");
+  memset(buf, 0, sizeof(buf));
+  rc = cpr(state, buf, 64);
+  EXPECT_GT(rc, 0);
+  EXPECT_STREQ(buf, "\033[1;4R");
+
+  // TBC 0 clears only the stop under the cursor
+  vt_printf(state, "\033[g\033[1;1H\t");
+  memset(buf, 0, sizeof(buf));
+  rc = cpr(state, buf, 64);
+  EXPECT_GT(rc, 0);
+  EXPECT_STREQ(buf, "\033[1;70R");
+}
+
+TEST(VTTest, AlternateScreen) {
+  struct teststate state;
+
+  char buf[64] = {0};
+
+  vt_printf(state, "\033[31mprimary\033[3;5H");
+
+  // 1049 saves the cursor and shows a cleared alternate screen
+  vt_printf(state, "\033[?1049h");
+  EXPECT_EQ(vt_codepoint(state.vt, 0, 0), ' ');
+  vt_printf(state, "\033[mX\033[10;10H");
+  EXPECT_EQ(vt_codepoint(state.vt, 4, 2), 'X');
+
+  // leaving restores the primary screen, cursor and attributes
+  vt_printf(state, "\033[?1049l");
+  EXPECT_EQ(vt_codepoint(state.vt, 0, 0), 'p');
+  EXPECT_EQ(vt_codepoint(state.vt, 4, 2), ' ');
+  ssize_t rc = cpr(state, buf, 64);
+  EXPECT_GT(rc, 0);
+  EXPECT_STREQ(buf, "\033[3;5R");
+  vt_printf(state, "Y");
+  EXPECT_EQ(vt_attr(state.vt, 4, 2).fg, color_indexed(1));
+
+  // 47 keeps the alternate screen's contents
+  vt_printf(state, "\033[?47h");
+  EXPECT_EQ(vt_codepoint(state.vt, 4, 2), 'X');
+  vt_printf(state, "\033[?47l");
+  EXPECT_EQ(vt_codepoint(state.vt, 4, 2), 'Y');
+
+  // 1047 clears it on the way out
+  vt_printf(state, "\033[?1047h\033[?1047l\033[?47h");
+  EXPECT_EQ(vt_codepoint(state.vt, 4, 2), ' ');
+  vt_printf(state, "\033[?47l");
+
+  // scrolling on either screen leaves the other alone
+  vt_printf(state, "\033[?47h\033[24;1H\n\n\n\033[?47l");
+  EXPECT_EQ(vt_codepoint(state.vt, 0, 0), 'p');
+
+  // DECCOLM while the primary screen is hidden brings its saved cursor in
+  vt_printf(state, "\033[?3h\033[1;120H\033[?1049h\033[?3l\033[?1049l");
+  memset(buf, 0, sizeof(buf));
+  cpr(state, buf, sizeof(buf));
+  EXPECT_STREQ(buf, "\033[1;80R");
+
+  size_t size = vt_save(state.vt, nullptr, 0);
+  std::string blob(size, '\0');
+  ASSERT_EQ(vt_save(state.vt, &blob[0], blob.size()), size);
+  EXPECT_EQ(vt_load(state.vt, blob.data(), blob.size()), 0);
+
+  // and leaves nothing from an earlier width in the columns it gains
+  vt_printf(state, "\033[?3h\033[1;101Hstale\033[?1049h\033[?3l\033[?3h");
+  vt_printf(state, "\033[?1049l");
+  EXPECT_EQ(vt_codepoint(state.vt, 100, 0), ' ');
+}
+
+TEST(VTTest, Resize) {
+  struct teststate state;
+
+  char buf[64] = {0};
+
+  // a 100 character line wrapped by autowrap, then a short one
+  std::string line;
+  for (int i = 0; i < 100; ++i) {
+    line += static_cast<char>('0' + i % 10);
+  }
+  vt_printf(state, "\033[?7h%s\r\nnext", line.c_str());
+
+  vt_resize(state.vt, 25, 40);
+  EXPECT_EQ(vt_codepoint(state.vt, 39, 0), '9');
+  EXPECT_EQ(vt_codepoint(state.vt, 0, 1), '0');
+  EXPECT_EQ(vt_codepoint(state.vt, 19, 2), '9');
+  EXPECT_EQ(vt_codepoint(state.vt, 20, 2), ' ');
+  EXPECT_EQ(vt_codepoint(state.vt, 0, 3), 'n');
+  ssize_t rc = cpr(state, buf, 64);
+  EXPECT_GT(rc, 0);
+  EXPECT_STREQ(buf, "\033[4;5R");
+
+  // wider than the rows were allocated for
+  vt_resize(state.vt, 25, 150);
+  EXPECT_EQ(vt_codepoint(state.vt, 99, 0), '9');
+  EXPECT_EQ(vt_codepoint(state.vt, 100, 0), ' ');
+  EXPECT_EQ(vt_codepoint(state.vt, 0, 1), 'n');
+  memset(buf, 0, sizeof(buf));
+  rc = cpr(state, buf, 64);
+  EXPECT_GT(rc, 0);
+  EXPECT_STREQ(buf, "\033[2;5R");
+
+  // the application on the pty sees the new size
+  struct winsize size;
+  ASSERT_EQ(ioctl(state.pty_child, TIOCGWINSZ, &size), 0);
+  EXPECT_EQ(size.ws_row, 25);
+  EXPECT_EQ(size.ws_col, 150);
+
+  // new columns get the default tab stops
+  vt_printf(state, "\r\033[17I");
+  memset(buf, 0, sizeof(buf));
+  rc = cpr(state, buf, 64);
+  EXPECT_GT(rc, 0);
+  EXPECT_STREQ(buf, "\033[2;137R");
+
+  // a wide character that no longer fits moves to the next row
+  vt_printf(state, "\033[3;1H%s\xe4\xb8\x80", std::string(39, 'x').c_str());
+  vt_resize(state.vt, 25, 40);
+  EXPECT_EQ(vt_codepoint(state.vt, 38, 4), 'x');
+  EXPECT_EQ(vt_codepoint(state.vt, 39, 4), ' ');
+  EXPECT_EQ(vt_codepoint(state.vt, 0, 5), 0x4e00u);
+
+  // fewer rows keeps the cursor on screen, losing lines off the top
+  vt_printf(state, "\033[20;1Hbottom");
+  vt_resize(state.vt, 10, 40);
+  EXPECT_EQ(vt_codepoint(state.vt, 0, 9), 'b');
+  memset(buf, 0, sizeof(buf));
+  rc = cpr(state, buf, 64);
+  EXPECT_GT(rc, 0);
+  EXPECT_STREQ(buf, "\033[10;7R");
+
+  // the hidden primary screen is resized along with the alternate one
+  vt_printf(state, "\033[?1049h");
+  vt_resize(state.vt, 12, 60);
+  vt_printf(state, "\033[?1049l");
+  EXPECT_EQ(vt_codepoint(state.vt, 0, 9), 'b');
+  memset(buf, 0, sizeof(buf));
+  rc = cpr(state, buf, 64);
+  EXPECT_GT(rc, 0);
+  EXPECT_STREQ(buf, "\033[10;7R");
+}
+
+TEST(VTTest, Snapshot) {
+  struct teststate state;
+
+  vt_printf(state, "\033[31mhello\033[m\r\nworld");
+  struct snapshot *before = vt_snapshot(state.vt);
+
+  // change one row, scroll everything and compact the attribute table
+  vt_printf(state, "\033[1;1HJ");
+  struct snapshot *after = vt_snapshot(state.vt);
+
+  std::string out = "\033[25;1H";
+  for (int i = 0; i < 70000; ++i) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "\033[48;2;%d;%d;%dm ", i >> 16, (i >> 8) & 255,
+             i & 255);
+    out += buf;
+  }
+  out += "\r\n\r\n";
+  vt_process(state.vt, out.data(), out.size());
+  EXPECT_NE(vt_codepoint(state.vt, 0, 0), 'J');
+
+  // the snapshots still show the screen as it was
+  int rows = 0, cols = 0;
+  vt_snapshot_size(before, &rows, &cols);
+  EXPECT_EQ(rows, 25);
+  EXPECT_EQ(cols, 80);
+
+  int x = 0, y = 0;
+  vt_snapshot_cursor(before, &x, &y);
+  EXPECT_EQ(x, 5);
+  EXPECT_EQ(y, 1);
+
+  size_t num_attrs = 0;
+  const struct cellattr *attrs = vt_snapshot_attrs(before, &num_attrs);
+
+  struct snapshot_row row;
+  ASSERT_EQ(vt_snapshot_row(before, 0, &row), 0);
+  EXPECT_EQ(row.cells[0].cp, 'h');
+  ASSERT_LT(row.cells[0].attr, num_attrs);
+  EXPECT_EQ(attrs[row.cells[0].attr].fg, color_indexed(1));
+  ASSERT_EQ(vt_snapshot_row(before, 1, &row), 0);
+  EXPECT_EQ(row.cells[0].cp, 'w');
+  EXPECT_EQ(vt_snapshot_row(before, 25, &row), -1);
+
+  ASSERT_EQ(vt_snapshot_row(after, 0, &row), 0);
+  EXPECT_EQ(row.cells[0].cp, 'J');
+  EXPECT_EQ(row.cells[1].cp, 'e');
+
+  // rows that didn't change between the two are shared, not copied
+  struct snapshot_row a, b;
+  ASSERT_EQ(vt_snapshot_row(before, 0, &a), 0);
+  ASSERT_EQ(vt_snapshot_row(after, 0, &b), 0);
+  EXPECT_NE(a.cells, b.cells);
+  ASSERT_EQ(vt_snapshot_row(before, 1, &a), 0);
+  ASSERT_EQ(vt_snapshot_row(after, 1, &b), 0);
+  EXPECT_EQ(a.cells, b.cells);
+
+  // a reference outlives the original
+  struct snapshot *copy = vt_snapshot_ref(after);
+  vt_snapshot_release(after);
+  ASSERT_EQ(vt_snapshot_row(copy, 1, &row), 0);
+  EXPECT_EQ(row.cells[0].cp, 'w');
+  vt_snapshot_release(copy);
+
+  vt_snapshot_release(before);
+}
+
+TEST(VTTest, FillInto) {
+  struct teststate state;
+
+  // accented, combining, wide and plain text
+  vt_printf(state, "h\xc3\xa9" "e\xcc\x81\xe4\xb8\x80!\r\n  x  ");
+
+  char buf[4096];
+  size_t len = vt_fill_into(state.vt, buf, sizeof(buf), VT_FILL_TRIM);
+  std::string expected = "h\xc3\xa9" "e\xcc\x81\xe4\xb8\x80!\n  x\n";
+  expected += std::string(23, '\n');
+  EXPECT_EQ(len, expected.size());
+  EXPECT_STREQ(buf, expected.c_str());
+
+  // untrimmed rows are full width
+  len = vt_fill_into(state.vt, buf, sizeof(buf), 0);
+  // the first row has four bytes more than cells
+  EXPECT_EQ(len, 25u * 81u + 4u);
+  EXPECT_EQ(std::string(buf + 85, 81), std::string("  x") + std::string(77, ' ') + "\n");
+
+  // a region starting on the right half of the wide character
+  len = vt_fill_region(state.vt, 4, 0, 3, 2, buf, sizeof(buf), 0);
+  EXPECT_STREQ(buf, " ! \n   \n");
+  EXPECT_EQ(len, 8u);
+
+  // too small: the length is still reported and characters aren't split
+  len = vt_fill_region(state.vt, 0, 0, 80, 1, buf, 5, VT_FILL_TRIM);
+  EXPECT_EQ(len, 11u);
+  EXPECT_STREQ(buf, "h\xc3\xa9");
+
+  EXPECT_EQ(vt_fill_into(state.vt, nullptr, 0, VT_FILL_TRIM), expected.size());
+}
+
+TEST(VTTest, SaveLoad) {
+  struct teststate saved;
+  struct teststate loaded;
+
+  // primary screen with a saved cursor, then the alternate screen with
+  // margins, modes, tab stops and the graphics charset in G1
+  vt_printf(saved, "\033]2;session\007\033[31mred\033[m\r\nplain\033[2;3H");
+  vt_printf(saved, "\033[?1049h\033[1;44mblue\033[3;20r\033[?7l\033[4h");
+  vt_printf(saved, "\033[3g\033[1;5H\033H\033)0\016q\017\033[7;9H");
+
+  size_t size = vt_save(saved.vt, nullptr, 0);
+  std::string blob(size, '\0');
+  ASSERT_EQ(vt_save(saved.vt, &blob[0], blob.size()), size);
+
+  // loading resizes to match
+  vt_resize(loaded.vt, 10, 40);
+  ASSERT_EQ(vt_load(loaded.vt, blob.data(), blob.size()), 0);
+
+  // saving again gives the same bytes
+  std::string again(size, '\0');
+  ASSERT_EQ(vt_save(loaded.vt, &again[0], again.size()), size);
+  EXPECT_EQ(blob, again);
+
+  EXPECT_STREQ(vt_title(loaded.vt), "session");
+  EXPECT_EQ(vt_codepoint(loaded.vt, 2, 1), 'b');
+  EXPECT_EQ(vt_attr(loaded.vt, 2, 1).bg, color_indexed(4));
+  EXPECT_EQ(vt_codepoint(loaded.vt, 4, 2), 0x2500u);
+
+  char buf[64];
+  memset(buf, 0, sizeof(buf));
+  cpr(loaded, buf, sizeof(buf));
+  EXPECT_STREQ(buf, "\033[7;9R");
+
+  // the same input does the same thing to both
+  const char *input = "\033[HX\tY\033[20;1H\n\nwrap past the end of the line "
+                      "without autowrap\033[?1049l!";
+  for (struct teststate *state : {&saved, &loaded}) {
+    vt_process(state->vt, input, strlen(input));
+  }
+
+  char expected[4096], actual[4096];
+  vt_fill_into(saved.vt, expected, sizeof(expected), 0);
+  vt_fill_into(loaded.vt, actual, sizeof(actual), 0);
+  EXPECT_STREQ(actual, expected);
+  EXPECT_EQ(vt_attr(loaded.vt, 0, 0).fg, color_indexed(1));
+
+  memset(buf, 0, sizeof(buf));
+  cpr(loaded, buf, sizeof(buf));
+  EXPECT_STREQ(buf, "\033[2;4R");
+
+  // damaged blobs are refused and leave the vt alone
+  EXPECT_EQ(vt_load(loaded.vt, blob.data(), blob.size() - 1), -1);
+  std::string bad = blob;
+  bad[8] = 2;
+  EXPECT_EQ(vt_load(loaded.vt, bad.data(), bad.size()), -1);
+  EXPECT_EQ(vt_codepoint(loaded.vt, 2, 1), '!');
+}
+
+TEST(VTTest, RecordPlayback) {
+  char path[] = "/tmp/nihterm-record-XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_GE(fd, 0);
+  close(fd);
+
+  // the long chunk needs a two byte length, and the terminal is resized
+  // before the last one
+  std::string chunks[] = {"hello", std::string(300, 'x'), "\033[2J"};
+  chunks[1][299] = 'y';
+
+  struct recorder *rec = recorder_open(path, 24, 80);
+  ASSERT_NE(rec, nullptr);
+  for (const std::string &chunk : chunks) {
+    if (&chunk == &chunks[2]) {
+      EXPECT_EQ(recorder_resize(rec, 50, 132), 0);
+    }
+    EXPECT_EQ(recorder_write(rec, chunk.data(), chunk.size()), 0);
+
+    // empty reads leave nothing behind that could look like the end
+    EXPECT_EQ(recorder_write(rec, "", 0), 0);
+  }
+  recorder_close(rec);
+
+  for (int truncated = 0; truncated < 2; ++truncated) {
+    struct playback *pb = playback_open(path);
+    ASSERT_NE(pb, nullptr);
+
+    int rows = 0, cols = 0;
+    playback_geometry(pb, &rows, &cols);
+    EXPECT_EQ(rows, 24);
+    EXPECT_EQ(cols, 80);
+
+    uint64_t last = 0;
+    for (const std::string &chunk : chunks) {
+      const char *data = nullptr;
+      uint64_t timestamp = 0;
+      ssize_t length = playback_next(pb, &data, &timestamp);
+      ASSERT_EQ(length, static_cast<ssize_t>(chunk.size()));
+      EXPECT_EQ(std::string(data, chunk.size()), chunk);
+      EXPECT_GE(timestamp, last);
+      last = timestamp;
+
+      playback_geometry(pb, &rows, &cols);
+      EXPECT_EQ(rows, &chunk == &chunks[2] ? 50 : 24);
+      EXPECT_EQ(cols, &chunk == &chunks[2] ? 132 : 80);
+    }
+
+    // a clean end, or an error for a frame cut off part way
+    const char *data = nullptr;
+    uint64_t timestamp = 0;
+    EXPECT_EQ(playback_next(pb, &data, &timestamp), truncated ? -1 : 0);
+    playback_close(pb);
+    if (truncated) {
+      break;
+    }
+
+    // a frame that promises 10 bytes but only has 2
+    FILE *fp = fopen(path, "ab");
+    ASSERT_NE(fp, nullptr);
+    fwrite("\001\012ab", 1, 4, fp);
+    fclose(fp);
+  }
+
+  unlink(path);
+}
+
+// Expect got to show exactly what want does: text, attributes, double
+// width and height rows and the cursor.
+static void expect_same_screen(struct vt *want, struct vt *got) {
+  char want_text[8192], got_text[8192];
+  vt_fill_into(want, want_text, sizeof(want_text), 0);
+  vt_fill_into(got, got_text, sizeof(got_text), 0);
+  EXPECT_STREQ(got_text, want_text);
+
+  struct snapshot *a = vt_snapshot(want);
+  struct snapshot *b = vt_snapshot(got);
+  int ax = 0, ay = 0, bx = 0, by = 0;
+  vt_snapshot_cursor(a, &ax, &ay);
+  vt_snapshot_cursor(b, &bx, &by);
+  EXPECT_EQ(bx, ax);
+  EXPECT_EQ(by, ay);
+
+  for (int y = 0; y < 25; ++y) {
+    struct snapshot_row ra, rb;
+    ASSERT_EQ(vt_snapshot_row(a, y, &ra), 0);
+    ASSERT_EQ(vt_snapshot_row(b, y, &rb), 0);
+    EXPECT_EQ(rb.dbl_width, ra.dbl_width) << "row " << y;
+    EXPECT_EQ(rb.dbl_height, ra.dbl_height) << "row " << y;
+
+    for (int x = 0; x < 80; ++x) {
+      struct cellattr aa = vt_attr(want, x, y);
+      struct cellattr ba = vt_attr(got, x, y);
+      EXPECT_EQ(ba.fg, aa.fg) << "cell " << x << "," << y;
+      EXPECT_EQ(ba.bg, aa.bg) << "cell " << x << "," << y;
+      EXPECT_EQ(ba.flags, aa.flags) << "cell " << x << "," << y;
+    }
+  }
+
+  vt_snapshot_release(a);
+  vt_snapshot_release(b);
+}
+
+// Bring sink up to date with source by a diff from the last snapshot sent,
+// returning the new snapshot.
+static struct snapshot *send_diff(struct teststate &source,
+                                  struct teststate &sink,
+                                  struct snapshot *last, std::string &out) {
+  struct snapshot *next = vt_snapshot(source.vt);
+  out.assign(snapshot_diff(last, next, nullptr, 0), '\0');
+  EXPECT_EQ(snapshot_diff(last, next, &out[0], out.size()), out.size());
+  vt_process(sink.vt, out.data(), out.size());
+  if (last) {
+    vt_snapshot_release(last);
+  }
+
+  return next;
+}
+
+TEST(VTTest, Diff) {
+  struct teststate source;
+  struct teststate sink;
+  std::string out;
+
+  // everything the encoder has to reproduce: colors, every SGR flag at once,
+  // wide and combining characters and double width rows
+  vt_printf(source, "\033[31mred\033[m plain \033[1;2;3;4;5;7;8;9;38;2;1;2;3;"
+                    "48;5;200mall\033[m\r\n");
+  vt_printf(source, "wide \xe4\xb8\x80\xe4\xb8\x80 e\xcc\x81 \033[44m    "
+                    "\033[m|\r\n\033#6double\r\n");
+  for (int i = 0; i < 20; ++i) {
+    vt_printf(source, "line %d\r\n", i);
+  }
+  struct snapshot *last = send_diff(source, sink, nullptr, out);
+  expect_same_screen(source.vt, sink.vt);
+
+  // the scroll is sent as such, not as the whole screen again
+  std::string scroll;
+  for (int i = 20; i < 25; ++i) {
+    scroll += "line " + std::to_string(i) + " has rather more text on it\r\n";
+  }
+  vt_process(source.vt, scroll.data(), scroll.size());
+  last = send_diff(source, sink, last, out);
+  expect_same_screen(source.vt, sink.vt);
+  EXPECT_NE(out.find("\033[4S"), std::string::npos);
+  EXPECT_LT(out.size(), scroll.size() + 16);
+
+  // a scroll inside margins, a line inserted mid screen and some edits
+  vt_printf(source, "\033[5;15r\033[2S\033[r\033[10;1H\033[L\033[8;20Hedit");
+  last = send_diff(source, sink, last, out);
+  expect_same_screen(source.vt, sink.vt);
+
+  // runs of one character and blanks between changes
+  vt_printf(source, "\033[3;1H%s\033[42m%40s\033[m.\033[45m\033[K\033[m",
+            "==================================", "");
+  vt_printf(source, "\033[12;70Hwide\xe4\xb8\x80\033[14;1H\033#3tall\r\n\033#4tall");
+  last = send_diff(source, sink, last, out);
+  expect_same_screen(source.vt, sink.vt);
+
+  // the alternate screen is just a different screen
+  vt_printf(source, "\033[?1049h\033[2J\033[10;10Hfull screen\033[20;5H");
+  last = send_diff(source, sink, last, out);
+  expect_same_screen(source.vt, sink.vt);
+
+  // once they match, only the cursor is sent
+  struct snapshot *now = vt_snapshot(sink.vt);
+  char buf[64];
+  EXPECT_EQ(snapshot_diff(now, last, buf, sizeof(buf)), 7u);
+  EXPECT_EQ(std::string(buf, 7), "\033[20;5H");
+
+  vt_snapshot_release(now);
+  vt_snapshot_release(last);
+}
+
 TEST(VTTest, AutoWrap) {
   struct teststate state;
 